@@ -27,6 +27,7 @@ Binder-based NFC plugin for Android 8+.
 %build
 make %{_smp_mflags} \
     %{?disable_hexdump: DISABLE_HEXDUMP=1} \
+    %{?enable_lto: LTO=1} \
     KEEP_SYMBOLS=1 \
     release
 
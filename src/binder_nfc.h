@@ -64,10 +64,158 @@ GType binder_nfc_target_get_type(void);
 
 #define DEFAULT_INSTANCE    "default"
 
+#ifndef BINDER_NFC_CONFIG_FILE
+#  define BINDER_NFC_CONFIG_FILE "/etc/nfcd/binder.conf"
+#endif
+
+/* Environment variable overriding BINDER_NFC_CONFIG_FILE */
+#define BINDER_NFC_CONFIG_ENV "BINDER_NFC_CONFIG"
+
+typedef struct binder_nfc_capture BinderNfcCapture;
+typedef struct binder_nfc_transport BinderNfcTransport;
+
+/* Fake HAL parameters */
+
+typedef enum binder_nfc_fake_cplt {
+    BINDER_NFC_FAKE_CPLT_BEFORE_REPLY,
+    BINDER_NFC_FAKE_CPLT_AFTER_REPLY,
+    BINDER_NFC_FAKE_CPLT_NONE
+} BINDER_NFC_FAKE_CPLT;
+
+typedef struct binder_nfc_fake_hal_params {
+    guint reply_delay_ms;
+    guint event_delay_ms;
+    guint data_delay_ms;
+    BINDER_NFC_FAKE_CPLT open_cplt;
+    BINDER_NFC_FAKE_CPLT close_cplt;
+    int open_result;
+    int close_result;
+    int write_result;
+} BinderNfcFakeHalParams;
+
+typedef struct binder_nfc_config {
+    char* capture_file;
+    gboolean capture_enabled;
+    guint capture_max_size;
+    guint capture_max_files;
+    guint capture_queue_size;
+    guint rx_batch_frames;
+    guint rx_batch_latency_us;
+    guint control_timeout_ms;
+    gboolean prewarm;
+    guint prewarm_timeout_ms;
+    char* prewarm_state_dir;
+    char** failover_instances;
+    guint failover_threshold;
+    guint failover_watchdog_ms;
+    guint failover_max_rtt_us;
+    gboolean hexdump_deferred;
+    gboolean fake_hal;
+    char* fake_hal_script;
+    BinderNfcFakeHalParams fake_hal_params;
+    char* record_file;
+    char* replay_file;
+    gdouble replay_speed;
+    gboolean replay_exit;
+    gboolean bench;
+    char* bench_output;
+    guint bench_frames;
+    guint bench_frame_size;
+    guint bench_max_chunks;
+    guint bench_cycles;
+    gboolean stress;
+    char* stress_output;
+    guint stress_rounds;
+    guint stress_max_burst;
+    guint stress_max_gap_ms;
+    guint stress_max_delay_ms;
+    guint stress_seed;
+} BinderNfcConfig;
+
+BinderNfcConfig*
+binder_nfc_config_new(
+    const char* file);
+
+void
+binder_nfc_config_free(
+    BinderNfcConfig* config);
+
 NfcAdapter*
 binder_nfc_adapter_new(
-    GBinderServiceManager* sm,
-    const char* name);
+    BinderNfcTransport* transport,
+    const BinderNfcConfig* config,
+    BinderNfcCapture* capture);
+
+/*
+ * Runtime statistics. Counters are updated by the main thread and can
+ * be read from any thread within the plugin at any time, the snapshot
+ * is always consistent. Events are indexed by HAL_NFC_EVT_*
+ * code, the last slot counts unknown events. Reconnects and failovers
+ * are only counted by the plugin-wide statistics. Failover time is the
+ * time from the decision to move to another HAL instance until the new
+ * instance is open. Control time is the time
+ * between granting control to the HAL and getting it back, while
+ * the NCI traffic is on hold.
+ *
+ * Received frames are handed to the NCI core in batches. Batch sizes
+ * are counted in buckets of 1, 2, 3-4, 5-8, 9-16 and 17+ frames. The
+ * time each frame spent waiting for its batch to be delivered goes to
+ * power-of-two buckets: <16us, 16-31us, ... 512-1023us and 1ms+
+ */
+
+#define BINDER_NFC_EXPORT __attribute__((visibility("default")))
+#define BINDER_NFC_STATS_EVENT_COUNT (9)
+#define BINDER_NFC_STATS_BATCH_BUCKETS (6)
+#define BINDER_NFC_STATS_DELAY_BUCKETS (8)
+
+typedef struct binder_nfc_stats {
+    guint64 frames_in;
+    guint64 frames_out;
+    guint64 bytes_in;
+    guint64 bytes_out;
+    guint64 write_failures;
+    guint64 events[BINDER_NFC_STATS_EVENT_COUNT];
+    guint64 power_on;
+    guint64 power_off;
+    guint64 powered_usec;
+    guint64 deaths;
+    guint64 reconnects;
+    guint64 failovers;
+    guint64 failover_usec;
+    guint64 control_grants;
+    guint64 control_usec;
+    guint64 rx_batches[BINDER_NFC_STATS_BATCH_BUCKETS];
+    guint64 rx_delays[BINDER_NFC_STATS_DELAY_BUCKETS];
+    guint in_flight;
+} BinderNfcStats;
+
+gboolean
+binder_nfc_adapter_get_stats(
+    NfcAdapter* adapter,
+    BinderNfcStats* stats)
+    BINDER_NFC_EXPORT;
+
+void
+binder_nfc_get_stats(
+    BinderNfcStats* stats)
+    BINDER_NFC_EXPORT;
+
+void
+binder_nfc_adapter_shutdown(
+    NfcAdapter* adapter);
+
+void
+binder_nfc_adapter_prewarm(
+    NfcAdapter* adapter,
+    guint timeout_ms);
+
+NciHalIo*
+binder_nfc_adapter_hal_io(
+    NfcAdapter* adapter);
+
+gboolean
+binder_nfc_adapter_settled(
+    NfcAdapter* adapter);
 
 gulong
 binder_nfc_adapter_add_death_handler(
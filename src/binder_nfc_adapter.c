@@ -31,14 +31,15 @@
  */
 
 #include "binder_nfc.h"
+#include "binder_nfc_capture.h"
+#include "binder_nfc_stats.h"
+#include "binder_nfc_transport.h"
 
 #include <nci_adapter_impl.h>
 
 #include <nci_core.h>
 #include <nci_hal.h>
 
-#include <gbinder.h>
-
 #include <gutil_misc.h>
 #include <gutil_macros.h>
 
@@ -54,29 +55,102 @@ GLogModule binder_hexdump_log = {
 typedef struct binder_nfc_adapter BinderNfcAdapter;
 typedef NciAdapterClass BinderNfcAdapterClass;
 
+/* HAL session states, see the transition table below */
+#define BINDER_NFC_ADAPTER_STATES(s) \
+    s(OFF)          /* HAL is closed */ \
+    s(OPEN)         /* open() is pending */ \
+    s(OPEN_CPLT)    /* open() is pending, OPEN_CPLT received */ \
+    s(OPEN_WAIT)    /* open() has completed, waiting for OPEN_CPLT */ \
+    s(WARM)         /* Opened ahead of time, waiting for a power request */ \
+    s(INIT)         /* Powered, coreInitialized() hasn't been called */ \
+    s(CORE_INIT)    /* coreInitialized() is pending */ \
+    s(ON)           /* Powered */ \
+    s(PREDISCOVER)  /* prediscover() is pending */ \
+    s(CLOSE)        /* close() is pending */ \
+    s(CLOSE_CPLT)   /* close() is pending, CLOSE_CPLT received */ \
+    s(CLOSE_WAIT)   /* Closed, waiting for CLOSE_CPLT to reopen */
+
+#define BINDER_NFC_ADAPTER_EVENTS(e) \
+    e(EVALUATE)     /* Power request or NCI state may have changed */ \
+    e(OPEN_OK) \
+    e(OPEN_ERROR) \
+    e(OPEN_CPLT) \
+    e(CLOSE_DONE) \
+    e(CLOSE_CPLT) \
+    e(TX_DONE)      /* coreInitialized() or prediscover() completed */
+
+typedef enum binder_nfc_adapter_state {
+#define ADAPTER_STATE(x) BINDER_NFC_ADAPTER_STATE_##x,
+    BINDER_NFC_ADAPTER_STATES(ADAPTER_STATE)
+#undef ADAPTER_STATE
+    BINDER_NFC_ADAPTER_STATE_COUNT
+} BINDER_NFC_ADAPTER_STATE;
+
+typedef enum binder_nfc_adapter_event {
+#define ADAPTER_EVENT(x) BINDER_NFC_ADAPTER_EVENT_##x,
+    BINDER_NFC_ADAPTER_EVENTS(ADAPTER_EVENT)
+#undef ADAPTER_EVENT
+    BINDER_NFC_ADAPTER_EVENT_COUNT
+} BINDER_NFC_ADAPTER_EVENT;
+
+static const char* const binder_nfc_adapter_state_names[] = {
+#define ADAPTER_STATE_NAME(x) #x,
+    BINDER_NFC_ADAPTER_STATES(ADAPTER_STATE_NAME)
+#undef ADAPTER_STATE_NAME
+};
+
+static const char* const binder_nfc_adapter_event_names[] = {
+#define ADAPTER_EVENT_NAME(x) #x,
+    BINDER_NFC_ADAPTER_EVENTS(ADAPTER_EVENT_NAME)
+#undef ADAPTER_EVENT_NAME
+};
+
+/* Returns the next state */
 typedef
-void
-(*BinderNfcAdapterFunc)(
+BINDER_NFC_ADAPTER_STATE
+(*BinderNfcAdapterTransition)(
     BinderNfcAdapter* self);
 
 struct binder_nfc_adapter {
     NciAdapter adapter;
-    GBinderRemoteObject* remote;
-    GBinderClient* client;
-    GBinderLocalObject* callback;
+    BinderNfcTransport* transport;
+    BinderNfcTransportClient transport_client;
     NciHalIo hal_io;
     NciHalClient* hal_client;
     gulong nci_write_id;
-    char* fqname;
-    gboolean core_initialized;
-    gulong death_id;
-
+    NciHalClientFunc nci_write_complete;
+    GBytes* held_write;
+    NciHalClientFunc held_write_complete;
+    gboolean control_requested;
+    gboolean hal_control;
+    gulong control_tx;
+    guint control_timeout_ms;
+    guint control_timeout_id;
+    BinderNfcCapture* capture;
+    BinderNfcCaptureIface* capture_iface;
+    BinderNfcStatsBlock stats;
+    GByteArray* dump_staging;
+    guint dump_skipped;
+    guint dump_flush_id;
+    GByteArray* rx_batch;
+    GByteArray* rx_spare;
+    gboolean rx_flushing;
+    guint rx_batch_max;
+    gint64 rx_latency_max;
+    guint rx_frames;
+    gint64 rx_first;
+    guint rx_flush_id;
+
+    BINDER_NFC_ADAPTER_STATE state;
+    gint64 state_since;
+    guint evaluate_id;
+    gboolean prewarm;
+    guint prewarm_timeout_id;
+    gboolean reopen;
     gboolean need_power;
     gboolean power_on;
     gboolean power_switch_pending;
     gulong pending_tx;
-    BinderNfcAdapterFunc open_cplt;
-    BinderNfcAdapterFunc close_cplt;
 };
 
 G_DEFINE_TYPE(BinderNfcAdapter, binder_nfc_adapter, NCI_TYPE_ADAPTER)
@@ -94,46 +168,109 @@ enum binder_nfc_adapter_signal {
 
 static guint binder_nfc_adapter_signals[SIGNAL_COUNT] = { 0 };
 
-/* android.hardware.nfc@1.0::INfc */
-#define BINDER_NFC_REQ_OPEN                 (1) /* open */
-#define BINDER_NFC_REQ_WRITE                (2) /* write */
-#define BINDER_NFC_REQ_CORE_INITIALIZED     (3) /* coreInitialized */
-#define BINDER_NFC_REQ_PREDISCOVER          (4) /* prediscover */
-#define BINDER_NFC_REQ_CLOSE                (5) /* close */
-#define BINDER_NFC_REQ_CONTROL_GRANTED      (6) /* controlGranted */
-#define BINDER_NFC_REQ_POWER_CYCLE          (7) /* powerCycle */
+#define DIR_IN  '>'
+#define DIR_OUT '<'
 
-/* android.hardware.nfc@1.0::INfcClientCallback */
-#define BINDER_NFC_REQ_CALLBACK_SEND_EVENT  (1) /* sendEvent */
-#define BINDER_NFC_REQ_SEND_DATA            (2) /* sendData */
+#ifndef DISABLE_HEXDUMP
 
-#define BINDER_NFC_EVENTS(e) \
-    e(OPEN_CPLT) \
-    e(CLOSE_CPLT) \
-    e(POST_INIT_CPLT) \
-    e(PRE_DISCOVER_CPLT) \
-    e(REQUEST_CONTROL) \
-    e(RELEASE_CONTROL) \
-    e(ERROR)
-
-enum BinderNfcEvent {
-#define HAL_NFC_EVT(x) HAL_NFC_EVT_##x,
-    BINDER_NFC_EVENTS(HAL_NFC_EVT)
-#undef HAL_NFC_EVT
-};
+/* Deferred hexdump doesn't stage more than this many bytes */
+#define BINDER_DUMP_STAGING_MAX (0x10000)
 
-enum BinderNfcStatus_t {
-    HAL_NFC_STATUS_OK,
-    HAL_NFC_STATUS_FAILED,
-    HAL_NFC_STATUS_ERR_TRANSPORT,
-    HAL_NFC_STATUS_ERR_CMD_TIMEOUT,
-    HAL_NFC_STATUS_REFUSED
-};
+typedef struct binder_dump_record {
+    guint32 len;
+    char dir;
+} BinderDumpRecord;
 
-#define DIR_IN  '>'
-#define DIR_OUT '<'
+static const char binder_hex_digits[] = "0123456789abcdef";
+
+static
+void
+binder_hex_encode(
+    char* out,
+    const guint8* data,
+    guint len)
+{
+    guint i;
+
+    for (i = 0; i < len; i++) {
+        const guint8 b = data[i];
+
+        if (i) {
+            *out++ = ' ';
+        }
+        *out++ = binder_hex_digits[b >> 4];
+        *out++ = binder_hex_digits[b & 0x0f];
+    }
+    *out = 0;
+}
+
+static
+gboolean
+binder_dump_flush(
+    gpointer user_data)
+{
+    BinderNfcAdapter* self = user_data;
+    GByteArray* staging = self->dump_staging;
+    GLogModule* log = &binder_hexdump_log;
+    const int level = GLOG_LEVEL_VERBOSE;
+    char* buf = NULL;
+    guint bufsize = 0;
+    guint off = 0;
+
+    self->dump_flush_id = 0;
+    while (off < staging->len) {
+        BinderDumpRecord rec;
+
+        memcpy(&rec, staging->data + off, sizeof(rec));
+        off += sizeof(rec);
+        if (bufsize < 3 * rec.len + 1) {
+            bufsize = 3 * rec.len + 1;
+            buf = g_realloc(buf, bufsize);
+        }
+        /* One log record per frame, plus the header for incoming ones */
+        if (rec.dir == DIR_IN) {
+            gutil_log(log, level, "%c data, %u byte(s)", rec.dir, rec.len);
+        }
+        binder_hex_encode(buf, staging->data + off, rec.len);
+        gutil_log(log, level, "%c %s", rec.dir, buf);
+        off += rec.len;
+    }
+    if (self->dump_skipped) {
+        gutil_log(log, level, "%u frame(s) not dumped", self->dump_skipped);
+        self->dump_skipped = 0;
+    }
+    g_byte_array_set_size(staging, 0);
+    g_free(buf);
+    return G_SOURCE_REMOVE;
+}
+
+static
+void
+binder_dump_stage(
+    BinderNfcAdapter* self,
+    char dir,
+    const void* data,
+    guint len)
+{
+    GByteArray* staging = self->dump_staging;
+
+    if (staging->len + sizeof(BinderDumpRecord) + len <=
+        BINDER_DUMP_STAGING_MAX) {
+        BinderDumpRecord rec;
+
+        rec.len = len;
+        rec.dir = dir;
+        g_byte_array_append(staging, (void*)&rec, sizeof(rec));
+        g_byte_array_append(staging, data, len);
+    } else {
+        self->dump_skipped++;
+    }
+    if (!self->dump_flush_id) {
+        self->dump_flush_id = g_idle_add_full(G_PRIORITY_LOW,
+            binder_dump_flush, self, NULL);
+    }
+}
 
-#ifndef DISABLE_HEXDUMP
 static
 void
 binder_hexdump(
@@ -159,6 +296,7 @@ binder_hexdump(
 static
 void
 binder_dump_data(
+    BinderNfcAdapter* self,
     char dir,
     const void* data,
     guint len)
@@ -167,158 +305,336 @@ binder_dump_data(
     GLogModule* log = &binder_hexdump_log;
 
     if (gutil_log_enabled(log, level)) {
-        binder_hexdump(log, level, dir, data, len);
+        if (self->dump_staging) {
+            /* Formatting is done later, off the NCI path */
+            binder_dump_stage(self, dir, data, len);
+        } else {
+            if (dir == DIR_IN) {
+                gutil_log(log, level, "%c data, %u byte(s)", dir, len);
+            }
+            binder_hexdump(log, level, dir, data, len);
+        }
     }
 }
 
-    #define BINDER_DUMP(dir, data, len)  binder_dump_data(dir, data, len)
-    #define DUMP(f,args...)  gutil_log(&binder_hexdump_log, \
-       GLOG_LEVEL_VERBOSE, f, ##args)
+    #define BINDER_DUMP(self, dir, data, len) \
+        binder_dump_data(self, dir, data, len)
 #else
-    #define BINDER_DUMP(dir, data, len)
-    #define DUMP(f,args...)
+    #define BINDER_DUMP(self, dir, data, len)
 #endif /* !DISABLE_HEXDUMP */
 
 static
-gboolean
-binder_nfc_adapter_close(
+void
+binder_nfc_adapter_dispatch(
+    BinderNfcAdapter* self,
+    BINDER_NFC_ADAPTER_EVENT event);
+
+static
+void
+binder_nfc_adapter_evaluate(
+    BinderNfcAdapter* self);
+
+static
+void
+binder_nfc_adapter_open_reply(
+    BinderNfcTransport* transport,
+    int result,
+    void* user_data);
+
+static
+void
+binder_nfc_adapter_close_reply(
+    BinderNfcTransport* transport,
+    int result,
+    void* user_data);
+
+static
+void
+binder_nfc_adapter_core_initialized_reply(
+    BinderNfcTransport* transport,
+    int result,
+    void* user_data);
+
+static
+void
+binder_nfc_adapter_prediscover_reply(
+    BinderNfcTransport* transport,
+    int result,
+    void* user_data);
+
+static
+void
+binder_nfc_adapter_grant_control_check(
+    BinderNfcAdapter* self);
+
+static
+void
+binder_nfc_adapter_request_control(
     BinderNfcAdapter* self);
 
 static
 void
-binder_nfc_adapter_state_check(
+binder_nfc_adapter_release_control(
+    BinderNfcAdapter* self);
+
+static
+void
+binder_nfc_adapter_take_control(
+    BinderNfcAdapter* self);
+
+static
+void
+binder_nfc_adapter_reopen(
     BinderNfcAdapter* self);
 
 /*==========================================================================*
- * INfcClientCallback
+ * Receive batching
+ *
+ * Frames arriving within the same main loop iteration are collected and
+ * handed to the NCI core in one pass, from an idle callback which runs
+ * after all the pending binder transactions have been dispatched. The
+ * batch is delivered right away when it gets too large or when its
+ * oldest frame has been waiting for too long.
  *==========================================================================*/
 
+typedef struct binder_rx_record {
+    gint64 time;
+    guint32 len;
+} BinderRxRecord;
+
 static
-int
-binder_nfc_callback_handle_event(
-    BinderNfcAdapter* self,
-    GBinderReader* reader)
+void
+binder_nfc_adapter_rx_drop(
+    BinderNfcAdapter* self)
 {
-    guint32 event, status;
+    if (self->rx_flush_id) {
+        g_source_remove(self->rx_flush_id);
+        self->rx_flush_id = 0;
+    }
+    if (self->rx_frames) {
+        GDEBUG("Dropping %u received frame(s)", self->rx_frames);
+        g_byte_array_set_size(self->rx_batch, 0);
+        self->rx_frames = 0;
+    }
+}
 
-    if (gbinder_reader_read_uint32(reader, &event) &&
-        gbinder_reader_read_uint32(reader, &status) &&
-        gbinder_reader_at_end(reader)) {
-        BinderNfcAdapterFunc action = NULL;
+static
+void
+binder_nfc_adapter_rx_flush(
+    BinderNfcAdapter* self)
+{
+    /* Frames queued by the read callbacks are delivered by the outer pass */
+    if (self->rx_flushing) {
+        return;
+    }
+    self->rx_flushing = TRUE;
+    while (self->rx_frames) {
+        GByteArray* batch = self->rx_batch;
+        const gint64 now = g_get_monotonic_time();
+        guint delays[BINDER_NFC_STATS_DELAY_BUCKETS];
+        guint frames = 0, off = 0;
+
+        /* Nothing left for the idle callback to do, this pass takes all */
+        if (self->rx_flush_id) {
+            g_source_remove(self->rx_flush_id);
+            self->rx_flush_id = 0;
+        }
 
-        if (GLOG_ENABLED(GLOG_LEVEL_DEBUG)) {
-            switch (event) {
-#define HAL_NFC_DUMP_EVT(x) case HAL_NFC_EVT_##x: GDEBUG("> " #x); break;
-            BINDER_NFC_EVENTS(HAL_NFC_DUMP_EVT)
-            default:
-                GDEBUG("> event %u", event);
-                break;
+        /*
+         * Detach the batch before delivering it, read callbacks may queue
+         * more frames which must not touch the buffer we are reading.
+         */
+        self->rx_batch = self->rx_spare ? self->rx_spare : g_byte_array_new();
+        self->rx_spare = NULL;
+        self->rx_frames = 0;
+        memset(delays, 0, sizeof(delays));
+        while (off < batch->len) {
+            NciHalClient* hal_client = self->hal_client;
+            BinderRxRecord rec;
+
+            memcpy(&rec, batch->data + off, sizeof(rec));
+            off += sizeof(rec);
+            delays[binder_nfc_stats_delay_bucket(now - rec.time)]++;
+            frames++;
+            if (hal_client) {
+                hal_client->fn->read(hal_client, batch->data + off, rec.len);
             }
+            off += rec.len;
         }
+        g_byte_array_set_size(batch, 0);
+        self->rx_spare = batch;
+        binder_nfc_stats_rx_batch(&self->stats, frames, delays);
+    }
+    self->rx_flushing = FALSE;
+}
+
+static
+gboolean
+binder_nfc_adapter_rx_flush_cb(
+    gpointer user_data)
+{
+    BinderNfcAdapter* self = user_data;
+
+    self->rx_flush_id = 0;
+    binder_nfc_adapter_rx_flush(self);
+    return G_SOURCE_REMOVE;
+}
+
+static
+void
+binder_nfc_adapter_rx_queue(
+    BinderNfcAdapter* self,
+    const void* data,
+    guint len)
+{
+    const gint64 now = g_get_monotonic_time();
+    BinderRxRecord rec;
+
+    rec.time = now;
+    rec.len = len;
+    g_byte_array_append(self->rx_batch, (void*)&rec, sizeof(rec));
+    g_byte_array_append(self->rx_batch, data, len);
+    if (!self->rx_frames++) {
+        self->rx_first = now;
+    }
+    if (self->rx_frames >= self->rx_batch_max ||
+        (now - self->rx_first) >= self->rx_latency_max) {
+        binder_nfc_adapter_rx_flush(self);
+    } else if (!self->rx_flush_id) {
+        self->rx_flush_id = g_idle_add(binder_nfc_adapter_rx_flush_cb, self);
+    }
+}
+
+/*==========================================================================*
+ * INfcClientCallback
+ *==========================================================================*/
+
+static inline
+BinderNfcAdapter*
+binder_nfc_adapter_from_transport_client(
+    BinderNfcTransportClient* client)
+{
+    return G_CAST(client, BinderNfcAdapter, transport_client);
+}
+
+static
+void
+binder_nfc_callback_handle_event(
+    BinderNfcTransportClient* client,
+    guint event,
+    guint status)
+{
+    BinderNfcAdapter* self = binder_nfc_adapter_from_transport_client(client);
+
+    /* Events must not overtake the data received before them */
+    if (self->rx_frames) {
+        binder_nfc_adapter_rx_flush(self);
+    }
+    if (event == BINDER_NFC_TRANSPORT_EVT_REOPEN) {
+        /* Not a HAL event, doesn't count */
+        GDEBUG("> REOPEN");
+        binder_nfc_adapter_reopen(self);
+        return;
+    }
+    binder_nfc_stats_event(&self->stats, event);
+    if (GLOG_ENABLED(GLOG_LEVEL_DEBUG)) {
         switch (event) {
-        case HAL_NFC_EVT_OPEN_CPLT:
-            action = self->open_cplt;
-            self->open_cplt = NULL;
-            break;
-        case HAL_NFC_EVT_CLOSE_CPLT:
-            action = self->close_cplt;
-            self->close_cplt = NULL;
-            break;
+#define HAL_NFC_DUMP_EVT(x) case HAL_NFC_EVT_##x: GDEBUG("> " #x); break;
+        BINDER_NFC_EVENTS(HAL_NFC_DUMP_EVT)
         default:
+            GDEBUG("> event %u", event);
             break;
         }
-        if (action) {
-            action(self);
-        }
-        return GBINDER_STATUS_OK;
-    } else {
-        GWARN("Failed to parse INfcClientCallback::sendEvent payload");
-        return GBINDER_STATUS_FAILED;
+    }
+    switch (event) {
+    case HAL_NFC_EVT_OPEN_CPLT:
+        binder_nfc_adapter_dispatch(self, BINDER_NFC_ADAPTER_EVENT_OPEN_CPLT);
+        break;
+    case HAL_NFC_EVT_CLOSE_CPLT:
+        binder_nfc_adapter_dispatch(self, BINDER_NFC_ADAPTER_EVENT_CLOSE_CPLT);
+        break;
+    case HAL_NFC_EVT_REQUEST_CONTROL:
+        binder_nfc_adapter_request_control(self);
+        break;
+    case HAL_NFC_EVT_RELEASE_CONTROL:
+        binder_nfc_adapter_release_control(self);
+        break;
+    default:
+        break;
     }
 }
 
 static
-int
+void
 binder_nfc_callback_handle_data(
-    BinderNfcAdapter* self,
-    GBinderReader* reader)
+    BinderNfcTransportClient* client,
+    const void* data,
+    guint len)
 {
-    gsize len;
-    const guint8* data = gbinder_reader_read_hidl_byte_vec(reader, &len);
-
-    if (data && gbinder_reader_at_end(reader)) {
-        NciHalClient* hal_client = self->hal_client;
-
-        DUMP("%c data, %u byte(s)", DIR_IN, (guint)len);
-        BINDER_DUMP(DIR_IN, data, len);
+    BinderNfcAdapter* self = binder_nfc_adapter_from_transport_client(client);
+    NciHalClient* hal_client = self->hal_client;
+
+    BINDER_DUMP(self, DIR_IN, data, len);
+    binder_nfc_capture_frame(self->capture_iface, BINDER_NFC_CAPTURE_IN,
+        data, len);
+    binder_nfc_stats_frame(&self->stats, FALSE, len);
+    if (self->rx_batch) {
         if (hal_client) {
-            hal_client->fn->read(hal_client, data, len);
+            binder_nfc_adapter_rx_queue(self, data, len);
         }
-        return GBINDER_STATUS_OK;
-    } else {
-        GWARN("Failed to parse INfcClientCallback::sendData payload");
-        return GBINDER_STATUS_FAILED;
+    } else if (hal_client) {
+        hal_client->fn->read(hal_client, data, len);
     }
 }
 
 static
-GBinderLocalReply*
-binder_nfc_callback_handler(
-    GBinderLocalObject* obj,
-    GBinderRemoteRequest* req,
-    guint code,
-    guint flags,
-    int* status,
-    void* user_data)
+void
+binder_nfc_callback_handle_death(
+    BinderNfcTransportClient* client)
 {
-    BinderNfcAdapter* self = BINDER_NFC_ADAPTER(user_data);
-    const char* iface = gbinder_remote_request_interface(req);
+    BinderNfcAdapter* self = binder_nfc_adapter_from_transport_client(client);
 
-    if (!g_strcmp0(iface, BINDER_NFC_CALLBACK)) {
-        GBinderReader reader;
-
-        gbinder_remote_request_init_reader(req, &reader);
-        switch (code) {
-        case BINDER_NFC_REQ_CALLBACK_SEND_EVENT:
-            GDEBUG(BINDER_NFC_CALLBACK " %u sendEvent", code);
-            *status = binder_nfc_callback_handle_event(self, &reader);
-            break;
-        case BINDER_NFC_REQ_SEND_DATA:
-            GDEBUG(BINDER_NFC_CALLBACK " %u sendData", code);
-            *status = binder_nfc_callback_handle_data(self, &reader);
-            break;
-        default:
-            GDEBUG(BINDER_NFC_CALLBACK " %u", code);
-            *status = GBINDER_STATUS_FAILED;
-            break;
-        }
-    } else {
-        GDEBUG("%s %u", iface, code);
-        *status = GBINDER_STATUS_FAILED;
+    if (self->rx_frames) {
+        binder_nfc_adapter_rx_flush(self);
     }
-    return (*status == GBINDER_STATUS_OK) ? gbinder_local_reply_append_int32
-        (gbinder_local_object_new_reply(obj), 0) : NULL;
+    binder_nfc_stats_death(&self->stats);
+    g_signal_emit(self, binder_nfc_adapter_signals[SIGNAL_DEATH], 0);
 }
 
 /*==========================================================================*
  * INfc
  *==========================================================================*/
 
+static
+gulong
+binder_nfc_client_started(
+    BinderNfcAdapter* self,
+    gulong id)
+{
+    if (id) {
+        binder_nfc_stats_tx_start(&self->stats);
+    }
+    return id;
+}
+
+static
+void
+binder_nfc_client_finished(
+    BinderNfcAdapter* self)
+{
+    binder_nfc_stats_tx_done(&self->stats);
+}
+
 static
 gulong
 binder_nfc_client_open(
     BinderNfcAdapter* self,
-    GBinderClientReplyFunc reply)
+    BinderNfcTransportReplyFunc reply)
 {
-    GBinderLocalRequest* req = gbinder_client_new_request(self->client);
-    gulong id;
+    BinderNfcTransport* transport = self->transport;
 
-    GASSERT(self->callback);
-    gbinder_local_request_append_local_object(req, self->callback);
-    id = gbinder_client_transact(self->client, BINDER_NFC_REQ_OPEN,
-        0, req, reply, NULL, self);
-    gbinder_local_request_unref(req);
-    return id;
+    return binder_nfc_client_started(self,
+        transport->fn->open(transport, reply, NULL, self));
 }
 
 static
@@ -326,58 +642,113 @@ gulong
 binder_nfc_client_write(
     BinderNfcAdapter* self,
     const void* data,
-    gsize len,
-    GBinderClientReplyFunc complete,
+    guint len,
+    BinderNfcTransportReplyFunc complete,
     GDestroyNotify destroy,
     void* user_data)
 {
-    GBinderLocalRequest* req = gbinder_client_new_request(self->client);
-    GBinderWriter writer;
+    BinderNfcTransport* transport = self->transport;
     gulong id;
 
-    BINDER_DUMP(DIR_OUT, data, len);
-    gbinder_local_request_init_writer(req, &writer);
-    gbinder_writer_append_hidl_vec(&writer, data, len, 1);
-    id = gbinder_client_transact(self->client, BINDER_NFC_REQ_WRITE,
-        0, req, complete, destroy, user_data);
-    gbinder_local_request_unref(req);
-    return id;
+    BINDER_DUMP(self, DIR_OUT, data, len);
+    binder_nfc_capture_frame(self->capture_iface, BINDER_NFC_CAPTURE_OUT,
+        data, len);
+    binder_nfc_stats_frame(&self->stats, TRUE, len);
+    id = transport->fn->write(transport, data, len, complete, destroy,
+        user_data);
+    if (!id) {
+        binder_nfc_stats_write_failed(&self->stats);
+    }
+    return binder_nfc_client_started(self, id);
 }
 
 static
 gulong
 binder_nfc_client_close(
     BinderNfcAdapter* self,
-    GBinderClientReplyFunc reply)
+    BinderNfcTransportReplyFunc reply)
 {
-    return gbinder_client_transact(self->client, BINDER_NFC_REQ_CLOSE,
-        0, NULL, reply, NULL, self);
+    BinderNfcTransport* transport = self->transport;
+
+    return binder_nfc_client_started(self,
+        transport->fn->close(transport, reply, NULL, self));
 }
 
 static
 gulong
 binder_nfc_client_core_initialized(
     BinderNfcAdapter* self,
-    GBinderClientReplyFunc reply)
+    BinderNfcTransportReplyFunc reply)
 {
-    return gbinder_client_transact(self->client,
-        BINDER_NFC_REQ_CORE_INITIALIZED, 0, NULL, reply, NULL, self);
+    BinderNfcTransport* transport = self->transport;
+
+    return binder_nfc_client_started(self,
+        transport->fn->core_initialized(transport, reply, NULL, self));
 }
 
 static
 gulong
 binder_nfc_client_prediscover(
     BinderNfcAdapter* self,
-    GBinderClientReplyFunc reply)
+    BinderNfcTransportReplyFunc reply)
 {
-    return gbinder_client_transact(self->client,
-        BINDER_NFC_REQ_PREDISCOVER, 0, NULL, reply, NULL, self);
+    BinderNfcTransport* transport = self->transport;
+
+    return binder_nfc_client_started(self,
+        transport->fn->prediscover(transport, reply, NULL, self));
+}
+
+static
+gulong
+binder_nfc_client_control_granted(
+    BinderNfcAdapter* self,
+    BinderNfcTransportReplyFunc reply)
+{
+    BinderNfcTransport* transport = self->transport;
+
+    return binder_nfc_client_started(self,
+        transport->fn->control_granted(transport, reply, NULL, self));
 }
 
 /*==========================================================================*
  * Implementation
  *==========================================================================*/
 
+static inline
+gboolean
+binder_nfc_adapter_quiesced(
+    BinderNfcAdapter* self)
+{
+    /* NCI traffic is on hold while the HAL wants or has the control */
+    return self->control_requested || self->hal_control;
+}
+
+static
+void
+binder_nfc_adapter_drop_control(
+    BinderNfcAdapter* self)
+{
+    if (self->control_timeout_id) {
+        g_source_remove(self->control_timeout_id);
+        self->control_timeout_id = 0;
+    }
+    if (self->control_tx) {
+        self->transport->fn->cancel(self->transport, self->control_tx);
+        binder_nfc_client_finished(self);
+        self->control_tx = 0;
+    }
+    if (self->hal_control) {
+        self->hal_control = FALSE;
+        binder_nfc_stats_control(&self->stats, FALSE);
+    }
+    if (self->held_write) {
+        g_bytes_unref(self->held_write);
+        self->held_write = NULL;
+        self->held_write_complete = NULL;
+    }
+    self->control_requested = FALSE;
+}
+
 static
 void
 binder_nfc_adapter_set_power(
@@ -386,6 +757,9 @@ binder_nfc_adapter_set_power(
 {
     NciCore* nci = self->adapter.nci;
 
+    if (self->power_on != on) {
+        binder_nfc_stats_power(&self->stats, on);
+    }
     if (self->power_switch_pending) {
         self->power_switch_pending = FALSE;
         self->power_on = on;
@@ -402,6 +776,30 @@ binder_nfc_adapter_set_power(
     }
 }
 
+static
+void
+binder_nfc_adapter_power_request_done(
+    BinderNfcAdapter* self)
+{
+    /* Request which didn't require any action (power is already there) */
+    if (self->power_switch_pending) {
+        self->power_switch_pending = FALSE;
+        nfc_adapter_power_notify(NFC_ADAPTER(self), self->power_on, TRUE);
+    }
+}
+
+static
+void
+binder_nfc_adapter_prewarm_done(
+    BinderNfcAdapter* self)
+{
+    if (self->prewarm_timeout_id) {
+        g_source_remove(self->prewarm_timeout_id);
+        self->prewarm_timeout_id = 0;
+    }
+    self->prewarm = FALSE;
+}
+
 static
 gboolean
 binder_nfc_adapter_can_close(
@@ -412,226 +810,487 @@ binder_nfc_adapter_can_close(
     return (nci->current_state <= NCI_RFST_IDLE);
 }
 
+static
+gboolean
+binder_nfc_adapter_nci_idle(
+    BinderNfcAdapter* self)
+{
+    NciCore* nci = self->adapter.nci;
+
+    return nci->current_state == NCI_RFST_IDLE &&
+        nci->next_state == NCI_RFST_IDLE;
+}
+
+/*==========================================================================*
+ * State machine
+ *
+ * Transitions are driven by HAL replies and events, and by evaluation
+ * of the power request against the NCI state. Evaluation is coalesced,
+ * no matter how many times it gets requested (NCI state changes, power
+ * requests, replies) it runs at most once per main loop iteration.
+ *==========================================================================*/
+
+static
+BINDER_NFC_ADAPTER_STATE
+binder_nfc_adapter_start_close(
+    BinderNfcAdapter* self);
+
+static
+gboolean
+binder_nfc_adapter_evaluate_cb(
+    gpointer user_data)
+{
+    BinderNfcAdapter* self = BINDER_NFC_ADAPTER(user_data);
+
+    self->evaluate_id = 0;
+    if (!binder_nfc_adapter_quiesced(self)) {
+        binder_nfc_adapter_dispatch(self, BINDER_NFC_ADAPTER_EVENT_EVALUATE);
+    }
+    return G_SOURCE_REMOVE;
+}
+
 static
 void
-binder_nfc_adapter_open_done(
+binder_nfc_adapter_evaluate(
     BinderNfcAdapter* self)
 {
-    GDEBUG("Power on");
-    binder_nfc_adapter_set_power(self, TRUE);
+    if (!self->evaluate_id) {
+        self->evaluate_id = g_idle_add(binder_nfc_adapter_evaluate_cb, self);
+    }
 }
 
 static
 void
-binder_nfc_adapter_open_cplt(
+binder_nfc_adapter_enter(
+    BinderNfcAdapter* self,
+    BINDER_NFC_ADAPTER_STATE state,
+    const char* reason)
+{
+    if (self->state != state) {
+        const gint64 now = g_get_monotonic_time();
+
+        GDEBUG("%s -> %s (%s) after %u us",
+            binder_nfc_adapter_state_names[self->state],
+            binder_nfc_adapter_state_names[state], reason,
+            (guint)(now - self->state_since));
+        self->state = state;
+        self->state_since = now;
+        binder_nfc_adapter_evaluate(self);
+    }
+}
+
+static
+BINDER_NFC_ADAPTER_STATE
+binder_nfc_adapter_start_open(
     BinderNfcAdapter* self)
 {
-    if (!self->pending_tx) {
-        /* open call already completed */
-        binder_nfc_adapter_open_done(self);
+    GDEBUG("Opening adapter");
+    self->reopen = FALSE;
+    self->pending_tx = binder_nfc_client_open(self,
+        binder_nfc_adapter_open_reply);
+    if (self->pending_tx) {
+        return BINDER_NFC_ADAPTER_STATE_OPEN;
     } else {
-        GDEBUG("Waiting for open to complete");
+        GWARN("Failed to open adapter");
+        binder_nfc_adapter_set_power(self, FALSE);
+        return BINDER_NFC_ADAPTER_STATE_OFF;
     }
 }
 
 static
-void
-binder_nfc_adapter_open_cancel(
+BINDER_NFC_ADAPTER_STATE
+binder_nfc_adapter_closed(
+    BinderNfcAdapter* self)
+{
+    if (self->need_power) {
+        /* Reopen the adapter */
+        GDEBUG("Opps, we need the power");
+        return binder_nfc_adapter_start_open(self);
+    } else {
+        /* The HAL is closed, release per-session resources */
+        self->transport->fn->release(self->transport);
+        GDEBUG("Power off");
+        binder_nfc_adapter_set_power(self, FALSE);
+        return BINDER_NFC_ADAPTER_STATE_OFF;
+    }
+}
+
+static
+BINDER_NFC_ADAPTER_STATE
+binder_nfc_adapter_start_close(
+    BinderNfcAdapter* self)
+{
+    NciCore* nci = self->adapter.nci;
+
+    /* Should never be > NCI_RFST_IDLE but let's check >= just in case */
+    if (nci->current_state >= NCI_RFST_IDLE) {
+        /*
+         * Make sure that state machine isn't going to continue
+         * transition to RFST_DISCOVERY while we are closing the
+         * adapter.
+         */
+        nci_core_set_state(nci, NCI_RFST_IDLE);
+    }
+
+    GDEBUG("Closing adapter");
+    self->pending_tx = binder_nfc_client_close(self,
+        binder_nfc_adapter_close_reply);
+    if (self->pending_tx) {
+        return BINDER_NFC_ADAPTER_STATE_CLOSE;
+    } else {
+        GWARN("Failed to close adapter");
+        return binder_nfc_adapter_closed(self);
+    }
+}
+
+static
+BINDER_NFC_ADAPTER_STATE
+binder_nfc_adapter_power_off(
     BinderNfcAdapter* self)
 {
-    binder_nfc_adapter_close(self);
+    if (binder_nfc_adapter_can_close(self)) {
+        return binder_nfc_adapter_start_close(self);
+    } else {
+        NciCore* nci = self->adapter.nci;
+
+        if (nci->next_state != NCI_RFST_IDLE) {
+            GDEBUG("Waiting for NCI state machine to become idle");
+            nci_core_set_state(nci, NCI_RFST_IDLE);
+        }
+        return self->state;
+    }
 }
 
 static
 void
-binder_nfc_adapter_open_reply(
-    GBinderClient* client,
-    GBinderRemoteReply* reply,
-    int status,
-    void* user_data)
+binder_nfc_adapter_reopen(
+    BinderNfcAdapter* self)
 {
-    int result = -1;
-    BinderNfcAdapter* self = BINDER_NFC_ADAPTER(user_data);
-    const gboolean success = (status == GBINDER_STATUS_OK &&
-        gbinder_remote_reply_read_int32(reply, &result) &&
-        result == 0);
+    switch (self->state) {
+    case BINDER_NFC_ADAPTER_STATE_OFF:
+    case BINDER_NFC_ADAPTER_STATE_CLOSE:
+    case BINDER_NFC_ADAPTER_STATE_CLOSE_CPLT:
+    case BINDER_NFC_ADAPTER_STATE_CLOSE_WAIT:
+        /* It's being closed anyway, the next open starts afresh */
+        break;
+    default:
+        /*
+         * The HAL has to be reopened once it's powered and the call in
+         * progress (if any) is done.
+         */
+        self->reopen = TRUE;
+        binder_nfc_adapter_evaluate(self);
+        break;
+    }
+}
 
-    GASSERT(self->pending_tx);
-    self->pending_tx = 0;
+/* Transition handlers return the next state */
+
+static
+BINDER_NFC_ADAPTER_STATE
+binder_nfc_adapter_off_evaluate(
+    BinderNfcAdapter* self)
+{
     if (self->need_power) {
-        if (success) {
-            if (self->open_cplt) {
-                GDEBUG("Waiting for OPEN_CPLT");
-            } else {
-                binder_nfc_adapter_open_done(self);
-            }
+        return binder_nfc_adapter_start_open(self);
+    } else {
+        binder_nfc_adapter_power_request_done(self);
+        return BINDER_NFC_ADAPTER_STATE_OFF;
+    }
+}
+
+static
+BINDER_NFC_ADAPTER_STATE
+binder_nfc_adapter_open_ok(
+    BinderNfcAdapter* self)
+{
+    GDEBUG("Waiting for OPEN_CPLT");
+    return BINDER_NFC_ADAPTER_STATE_OPEN_WAIT;
+}
+
+static
+BINDER_NFC_ADAPTER_STATE
+binder_nfc_adapter_open_cplt(
+    BinderNfcAdapter* self)
+{
+    GDEBUG("Waiting for open to complete");
+    return BINDER_NFC_ADAPTER_STATE_OPEN_CPLT;
+}
+
+static
+BINDER_NFC_ADAPTER_STATE
+binder_nfc_adapter_open_error(
+    BinderNfcAdapter* self)
+{
+    binder_nfc_adapter_set_power(self, FALSE);
+    return BINDER_NFC_ADAPTER_STATE_OFF;
+}
+
+static
+BINDER_NFC_ADAPTER_STATE
+binder_nfc_adapter_opened(
+    BinderNfcAdapter* self)
+{
+    if (self->need_power) {
+        if (self->power_on && !self->power_switch_pending) {
+            /* Reopened at the transport's request, restart NCI */
+            GDEBUG("Restarting NCI");
+            nci_core_restart(self->adapter.nci);
         } else {
-            GWARN("Power on error %d", result);
-            self->open_cplt = NULL;
-            binder_nfc_adapter_set_power(self, FALSE);
+            GDEBUG("Power on");
+            binder_nfc_adapter_set_power(self, TRUE);
         }
+        return BINDER_NFC_ADAPTER_STATE_INIT;
+    } else if (self->prewarm) {
+        GDEBUG("Waiting for power request");
+        return BINDER_NFC_ADAPTER_STATE_WARM;
     } else {
         GDEBUG("Opps, we don't need the power anymore");
-        if (self->open_cplt) {
-            self->open_cplt = binder_nfc_adapter_open_cancel;
-        } else {
-            binder_nfc_adapter_close(self);
+        return binder_nfc_adapter_start_close(self);
+    }
+}
+
+static
+BINDER_NFC_ADAPTER_STATE
+binder_nfc_adapter_warm_evaluate(
+    BinderNfcAdapter* self)
+{
+    /* The HAL is open but the NCI core hasn't been started yet */
+    if (self->need_power) {
+        GDEBUG("Power on (pre-warmed)");
+        binder_nfc_adapter_set_power(self, TRUE);
+        return BINDER_NFC_ADAPTER_STATE_INIT;
+    } else if (self->prewarm) {
+        return BINDER_NFC_ADAPTER_STATE_WARM;
+    } else {
+        return binder_nfc_adapter_start_close(self);
+    }
+}
+
+static
+gboolean
+binder_nfc_adapter_reopen_check(
+    BinderNfcAdapter* self)
+{
+    if (self->reopen) {
+        self->reopen = FALSE;
+        if (self->need_power) {
+            GDEBUG("Reopening HAL");
+            return TRUE;
         }
     }
+    return FALSE;
+}
+
+static
+BINDER_NFC_ADAPTER_STATE
+binder_nfc_adapter_init_evaluate(
+    BinderNfcAdapter* self)
+{
+    if (binder_nfc_adapter_reopen_check(self)) {
+        return binder_nfc_adapter_start_close(self);
+    } else if (!self->need_power) {
+        return binder_nfc_adapter_power_off(self);
+    }
+    binder_nfc_adapter_power_request_done(self);
+    if (binder_nfc_adapter_nci_idle(self)) {
+        self->pending_tx = binder_nfc_client_core_initialized(self,
+            binder_nfc_adapter_core_initialized_reply);
+        return self->pending_tx ? BINDER_NFC_ADAPTER_STATE_CORE_INIT :
+            BINDER_NFC_ADAPTER_STATE_ON;
+    }
+    return BINDER_NFC_ADAPTER_STATE_INIT;
 }
 
 static
-gboolean
-binder_nfc_adapter_open(
+BINDER_NFC_ADAPTER_STATE
+binder_nfc_adapter_on_evaluate(
     BinderNfcAdapter* self)
 {
-    GDEBUG("Opening adapter");
-    if (!self->callback) {
-        GBinderIpc* ipc = gbinder_remote_object_ipc(self->remote);
-        static const char* ifaces[] = { BINDER_NFC_CALLBACK, NULL };
-
-        self->callback = gbinder_local_object_new(ipc, ifaces,
-            binder_nfc_callback_handler, self);
+    if (binder_nfc_adapter_reopen_check(self)) {
+        return binder_nfc_adapter_start_close(self);
+    } else if (!self->need_power) {
+        return binder_nfc_adapter_power_off(self);
     }
-    self->core_initialized = FALSE;
-    self->open_cplt = binder_nfc_adapter_open_cplt;
-    self->pending_tx = binder_nfc_client_open(self,
-        binder_nfc_adapter_open_reply);
-    return (self->pending_tx != 0);
+    binder_nfc_adapter_power_request_done(self);
+    if (binder_nfc_adapter_nci_idle(self)) {
+        /* This includes both first time initialization and the case
+         * when NCI state machine has switched to IDLE by itself. */
+        self->pending_tx = binder_nfc_client_prediscover(self,
+            binder_nfc_adapter_prediscover_reply);
+        if (self->pending_tx) {
+            return BINDER_NFC_ADAPTER_STATE_PREDISCOVER;
+        }
+    }
+    return BINDER_NFC_ADAPTER_STATE_ON;
 }
 
 static
-void
-binder_nfc_adapter_reopen_cplt(
+BINDER_NFC_ADAPTER_STATE
+binder_nfc_adapter_core_initialized(
     BinderNfcAdapter* self)
 {
-    GASSERT(!self->pending_tx);
-    self->pending_tx = binder_nfc_adapter_open(self);
+    return BINDER_NFC_ADAPTER_STATE_ON;
 }
 
 static
-void
-binder_nfc_adapter_close_done(
+BINDER_NFC_ADAPTER_STATE
+binder_nfc_adapter_prediscovered(
     BinderNfcAdapter* self)
 {
-    /* We can release our local object now */
-    gbinder_local_object_drop(self->callback);
-    self->callback = NULL;
+    nci_core_set_state(self->adapter.nci, NCI_RFST_DISCOVERY);
+    return BINDER_NFC_ADAPTER_STATE_ON;
+}
 
-    GDEBUG("Power off");
-    binder_nfc_adapter_set_power(self, FALSE);
+static
+BINDER_NFC_ADAPTER_STATE
+binder_nfc_adapter_close_done(
+    BinderNfcAdapter* self)
+{
+    /*
+     * Don't wait for CLOSE_CPLT unless we are going to reopen the HAL,
+     * it may never come. In those cases when it does come, it usually
+     * comes before completion of the close() call.
+     */
+    return self->need_power ? BINDER_NFC_ADAPTER_STATE_CLOSE_WAIT :
+        binder_nfc_adapter_closed(self);
 }
 
 static
-void
+BINDER_NFC_ADAPTER_STATE
 binder_nfc_adapter_close_cplt(
     BinderNfcAdapter* self)
 {
-    if (!self->pending_tx) {
-        /* close call already completed */
-        binder_nfc_adapter_close_done(self);
-    } else {
-        GDEBUG("Waiting for close to complete");
-    }
+    GDEBUG("Waiting for close to complete");
+    return BINDER_NFC_ADAPTER_STATE_CLOSE_CPLT;
 }
 
 static
-void
-binder_nfc_adapter_close_reply(
-    GBinderClient* client,
-    GBinderRemoteReply* reply,
-    int status,
-    void* user_data)
+BINDER_NFC_ADAPTER_STATE
+binder_nfc_adapter_close_wait_evaluate(
+    BinderNfcAdapter* self)
 {
-    int result = 0;
-    BinderNfcAdapter* self = BINDER_NFC_ADAPTER(user_data);
-    const gboolean success = (status == GBINDER_STATUS_OK &&
-        gbinder_remote_reply_read_int32(reply, &result) &&
-        result == 0);
+    /* The request may have been cancelled while we were waiting */
+    return self->need_power ? BINDER_NFC_ADAPTER_STATE_CLOSE_WAIT :
+        binder_nfc_adapter_closed(self);
+}
 
-    GVERIFY(gbinder_remote_reply_read_int32(reply, &result));
-    GASSERT(self->pending_tx);
-    GASSERT(self->power_on);
+static const BinderNfcAdapterTransition
+binder_nfc_adapter_transitions[BINDER_NFC_ADAPTER_STATE_COUNT]
+[BINDER_NFC_ADAPTER_EVENT_COUNT] = {
+    [BINDER_NFC_ADAPTER_STATE_OFF] = {
+        [BINDER_NFC_ADAPTER_EVENT_EVALUATE] = binder_nfc_adapter_off_evaluate
+    },
+    [BINDER_NFC_ADAPTER_STATE_OPEN] = {
+        [BINDER_NFC_ADAPTER_EVENT_OPEN_OK] = binder_nfc_adapter_open_ok,
+        [BINDER_NFC_ADAPTER_EVENT_OPEN_ERROR] = binder_nfc_adapter_open_error,
+        [BINDER_NFC_ADAPTER_EVENT_OPEN_CPLT] = binder_nfc_adapter_open_cplt
+    },
+    [BINDER_NFC_ADAPTER_STATE_OPEN_CPLT] = {
+        [BINDER_NFC_ADAPTER_EVENT_OPEN_OK] = binder_nfc_adapter_opened,
+        [BINDER_NFC_ADAPTER_EVENT_OPEN_ERROR] = binder_nfc_adapter_open_error
+    },
+    [BINDER_NFC_ADAPTER_STATE_OPEN_WAIT] = {
+        [BINDER_NFC_ADAPTER_EVENT_OPEN_CPLT] = binder_nfc_adapter_opened
+    },
+    [BINDER_NFC_ADAPTER_STATE_WARM] = {
+        [BINDER_NFC_ADAPTER_EVENT_EVALUATE] = binder_nfc_adapter_warm_evaluate
+    },
+    [BINDER_NFC_ADAPTER_STATE_INIT] = {
+        [BINDER_NFC_ADAPTER_EVENT_EVALUATE] = binder_nfc_adapter_init_evaluate
+    },
+    [BINDER_NFC_ADAPTER_STATE_CORE_INIT] = {
+        [BINDER_NFC_ADAPTER_EVENT_TX_DONE] =
+            binder_nfc_adapter_core_initialized
+    },
+    [BINDER_NFC_ADAPTER_STATE_ON] = {
+        [BINDER_NFC_ADAPTER_EVENT_EVALUATE] = binder_nfc_adapter_on_evaluate
+    },
+    [BINDER_NFC_ADAPTER_STATE_PREDISCOVER] = {
+        [BINDER_NFC_ADAPTER_EVENT_TX_DONE] = binder_nfc_adapter_prediscovered
+    },
+    [BINDER_NFC_ADAPTER_STATE_CLOSE] = {
+        [BINDER_NFC_ADAPTER_EVENT_CLOSE_DONE] = binder_nfc_adapter_close_done,
+        [BINDER_NFC_ADAPTER_EVENT_CLOSE_CPLT] = binder_nfc_adapter_close_cplt
+    },
+    [BINDER_NFC_ADAPTER_STATE_CLOSE_CPLT] = {
+        [BINDER_NFC_ADAPTER_EVENT_CLOSE_DONE] = binder_nfc_adapter_closed
+    },
+    [BINDER_NFC_ADAPTER_STATE_CLOSE_WAIT] = {
+        [BINDER_NFC_ADAPTER_EVENT_EVALUATE] =
+            binder_nfc_adapter_close_wait_evaluate,
+        [BINDER_NFC_ADAPTER_EVENT_CLOSE_CPLT] = binder_nfc_adapter_closed
+    }
+};
 
-    self->pending_tx = 0;
-    if (self->need_power) {
-        /* Reopen the adapter */
-        GDEBUG("Opps, we need the power");
-        if (self->close_cplt) {
-            self->close_cplt = binder_nfc_adapter_reopen_cplt;
-        } else {
-            self->pending_tx = binder_nfc_adapter_open(self);
-        }
-    } else {
-        if (success) {
-            /*
-             * Don't wait for CLOSE_CPLT, it may never come. In those cases
-             * when it does come, it usually comes before completion of the
-             * close() call.
-             */
-            self->close_cplt = NULL;
-            binder_nfc_adapter_close_done(self);
-        } else {
-            GWARN("Power on error %d", result);
-            self->close_cplt = NULL;
-            binder_nfc_adapter_close_done(self);
-        }
+static
+void
+binder_nfc_adapter_dispatch(
+    BinderNfcAdapter* self,
+    BINDER_NFC_ADAPTER_EVENT event)
+{
+    const BinderNfcAdapterTransition fn =
+        binder_nfc_adapter_transitions[self->state][event];
+
+    if (fn) {
+        binder_nfc_adapter_enter(self, fn(self),
+            binder_nfc_adapter_event_names[event]);
     }
 }
 
+/*==========================================================================*
+ * Replies
+ *==========================================================================*/
+
 static
-gboolean
-binder_nfc_adapter_close(
-    BinderNfcAdapter* self)
+void
+binder_nfc_adapter_open_reply(
+    BinderNfcTransport* transport,
+    int result,
+    void* user_data)
 {
-    NciCore* nci = self->adapter.nci;
+    BinderNfcAdapter* self = BINDER_NFC_ADAPTER(user_data);
 
-    /* Should never be > NCI_RFST_IDLE but let's check >= just in case */
-    if (nci->current_state >= NCI_RFST_IDLE) {
-        /*
-         * Make sure that state machine isn't going to continue
-         * transition to RFST_DISCOVERY while we are closing the
-         * adapter.
-         */
-        nci_core_set_state(nci, NCI_RFST_IDLE);
+    GASSERT(self->pending_tx);
+    self->pending_tx = 0;
+    binder_nfc_client_finished(self);
+    if (result == 0) {
+        binder_nfc_adapter_dispatch(self, BINDER_NFC_ADAPTER_EVENT_OPEN_OK);
+    } else {
+        GWARN("Power on error %d", result);
+        binder_nfc_adapter_dispatch(self, BINDER_NFC_ADAPTER_EVENT_OPEN_ERROR);
     }
-
-    GDEBUG("Closing adapter");
-    GASSERT(!self->pending_tx);
-    self->close_cplt = binder_nfc_adapter_close_cplt;
-    self->pending_tx = binder_nfc_client_close(self,
-        binder_nfc_adapter_close_reply);
-    return (self->pending_tx != 0);
 }
 
 static
 void
-binder_nfc_adapter_power_check(
-    BinderNfcAdapter* self)
+binder_nfc_adapter_close_reply(
+    BinderNfcTransport* transport,
+    int result,
+    void* user_data)
 {
-    if (self->power_on && !self->need_power && !self->pending_tx) {
-        if (binder_nfc_adapter_can_close(self)) {
-            binder_nfc_adapter_close(self);
-        }
+    BinderNfcAdapter* self = BINDER_NFC_ADAPTER(user_data);
+
+    GASSERT(self->pending_tx);
+    self->pending_tx = 0;
+    binder_nfc_client_finished(self);
+    if (result) {
+        GWARN("Power off error %d", result);
     }
+    binder_nfc_adapter_dispatch(self, BINDER_NFC_ADAPTER_EVENT_CLOSE_DONE);
 }
 
 static
 void
 binder_nfc_adapter_prediscover_reply(
-    GBinderClient* client,
-    GBinderRemoteReply* reply,
-    int status,
+    BinderNfcTransport* transport,
+    int result,
     void* user_data)
 {
     BinderNfcAdapter* self = BINDER_NFC_ADAPTER(user_data);
-    NciCore* nci = self->adapter.nci;
 
 #if GUTIL_LOG_DEBUG
-    int result;
-
-    if (status == GBINDER_STATUS_OK &&
-        gbinder_remote_reply_read_int32(reply, &result)) {
+    if (result >= 0) {
         GDEBUG("PREDISCOVER status %d", result);
     } else {
         GDEBUG("PREDISCOVER status failed (that's ok)");
@@ -639,25 +1298,21 @@ binder_nfc_adapter_prediscover_reply(
 #endif /* GUTIL_LOG_DEBUG */
 
     self->pending_tx = 0;
-    nci_core_set_state(nci, NCI_RFST_DISCOVERY);
-    binder_nfc_adapter_state_check(self);
+    binder_nfc_client_finished(self);
+    binder_nfc_adapter_dispatch(self, BINDER_NFC_ADAPTER_EVENT_TX_DONE);
 }
 
 static
 void
 binder_nfc_adapter_core_initialized_reply(
-    GBinderClient* client,
-    GBinderRemoteReply* reply,
-    int status,
+    BinderNfcTransport* transport,
+    int result,
     void* user_data)
 {
     BinderNfcAdapter* self = BINDER_NFC_ADAPTER(user_data);
 
 #if GUTIL_LOG_DEBUG
-    int result;
-
-    if (status == GBINDER_STATUS_OK &&
-        gbinder_remote_reply_read_int32(reply, &result)) {
+    if (result >= 0) {
         GDEBUG("CORE_INITIALIZED status %d", result);
     } else {
         GDEBUG("CORE_INITIALIZED failed (that's ok)");
@@ -665,82 +1320,156 @@ binder_nfc_adapter_core_initialized_reply(
 #endif /* GUTIL_LOG_DEBUG */
 
     self->pending_tx = 0;
-    binder_nfc_adapter_state_check(self);
+    binder_nfc_client_finished(self);
+    binder_nfc_adapter_dispatch(self, BINDER_NFC_ADAPTER_EVENT_TX_DONE);
 }
 
-static
-void
-binder_nfc_adapter_nci_check(
-    BinderNfcAdapter* self)
+/*==========================================================================*
+ * Interface
+ *==========================================================================*/
+
+NfcAdapter*
+binder_nfc_adapter_new(
+    BinderNfcTransport* transport,
+    const BinderNfcConfig* config,
+    BinderNfcCapture* capture)
 {
-    NciCore* nci = self->adapter.nci;
+    if (G_LIKELY(transport)) {
+        BinderNfcAdapter* self = g_object_new(BINDER_NFC_TYPE_ADAPTER, NULL);
 
-    if (self->power_on && self->need_power && !self->pending_tx) {
-        if (nci->current_state == NCI_RFST_IDLE &&
-            nci->next_state == NCI_RFST_IDLE) {
-            if (!self->core_initialized) {
-                self->core_initialized = TRUE;
-                self->pending_tx = binder_nfc_client_core_initialized(self,
-                    binder_nfc_adapter_core_initialized_reply);
-            } else {
-                /* This includes both first time initialization and the case
-                 * when NCI state machine has switched to IDLE by itself. */
-                self->pending_tx = binder_nfc_client_prediscover(self,
-                    binder_nfc_adapter_prediscover_reply);
-            }
+        /* The adapter takes the ownership of the transport */
+        self->transport = transport;
+        transport->fn->set_client(transport, &self->transport_client);
+#ifndef DISABLE_HEXDUMP
+        if (config->hexdump_deferred) {
+            self->dump_staging = g_byte_array_new();
+        }
+#endif
+        if (config->rx_batch_frames > 1) {
+            self->rx_batch = g_byte_array_new();
+            self->rx_batch_max = config->rx_batch_frames;
+            self->rx_latency_max = config->rx_batch_latency_us;
         }
+        self->control_timeout_ms = config->control_timeout_ms;
+        if (capture) {
+            self->capture = binder_nfc_capture_ref(capture);
+            self->capture_iface = binder_nfc_capture_add_iface(capture,
+                transport->name, transport->description);
+        }
+        return NFC_ADAPTER(self);
     }
+    return NULL;
 }
 
-static
 void
-binder_nfc_adapter_state_check(
-    BinderNfcAdapter* self)
+binder_nfc_adapter_shutdown(
+    NfcAdapter* adapter)
 {
-    binder_nfc_adapter_nci_check(self);
-    binder_nfc_adapter_power_check(self);
+    if (G_LIKELY(adapter)) {
+        BinderNfcAdapter* self = BINDER_NFC_ADAPTER(adapter);
+        BinderNfcTransport* transport = self->transport;
+
+        /* closeForPowerOffCase is synchronous and doesn't need CLOSE_CPLT */
+        if (self->state != BINDER_NFC_ADAPTER_STATE_OFF &&
+            binder_nfc_transport_shutdown(transport)) {
+            GDEBUG("Closed for power off");
+            if (self->nci_write_id) {
+                transport->fn->cancel(transport, self->nci_write_id);
+                binder_nfc_client_finished(self);
+                self->nci_write_id = 0;
+                self->nci_write_complete = NULL;
+            }
+            if (self->pending_tx) {
+                transport->fn->cancel(transport, self->pending_tx);
+                binder_nfc_client_finished(self);
+                self->pending_tx = 0;
+            }
+            binder_nfc_adapter_drop_control(self);
+            binder_nfc_adapter_prewarm_done(self);
+            self->reopen = FALSE;
+            self->need_power = FALSE;
+            binder_nfc_adapter_enter(self, binder_nfc_adapter_closed(self),
+                "shutdown");
+        }
+    }
 }
 
-/*==========================================================================*
- * Interface
- *==========================================================================*/
-
-NfcAdapter*
-binder_nfc_adapter_new(
-    GBinderServiceManager* sm,
-    const char* name)
+static
+gboolean
+binder_nfc_adapter_prewarm_timeout(
+    gpointer user_data)
 {
-    int status = 0;
-    char* fqname = g_strconcat(BINDER_NFC "/", name, NULL);
-    GBinderRemoteObject* remote = gbinder_servicemanager_get_service_sync(sm,
-        fqname, &status);
+    BinderNfcAdapter* self = BINDER_NFC_ADAPTER(user_data);
 
-    if (remote) {
-        BinderNfcAdapter* self = g_object_new(BINDER_NFC_TYPE_ADAPTER, NULL);
+    GDEBUG("Nobody wants the power");
+    self->prewarm_timeout_id = 0;
+    self->prewarm = FALSE;
+    binder_nfc_adapter_evaluate(self);
+    return G_SOURCE_REMOVE;
+}
 
-        /* gbinder_servicemanager_get_service_sync() returns auto-released
-         * reference, we need to add a reference of our own */
-        self->remote = gbinder_remote_object_ref(remote);
-        self->client = gbinder_client_new(self->remote, BINDER_NFC);
-        self->fqname = fqname;
-        GDEBUG("Connected to %s", fqname);
-        return NFC_ADAPTER(self);
-    } else {
-        GERR("Failed to connect to %s", fqname);
+void
+binder_nfc_adapter_prewarm(
+    NfcAdapter* adapter,
+    guint timeout_ms)
+{
+    if (G_LIKELY(adapter)) {
+        BinderNfcAdapter* self = BINDER_NFC_ADAPTER(adapter);
+
+        /* Only makes sense before anyone has asked for anything */
+        if (self->state == BINDER_NFC_ADAPTER_STATE_OFF &&
+            !self->need_power && !self->power_switch_pending &&
+            !self->prewarm) {
+            GDEBUG("Pre-warming the HAL");
+            self->prewarm = TRUE;
+            self->prewarm_timeout_id = g_timeout_add(timeout_ms,
+                binder_nfc_adapter_prewarm_timeout, self);
+            binder_nfc_adapter_enter(self,
+                binder_nfc_adapter_start_open(self), "prewarm");
+            if (self->state == BINDER_NFC_ADAPTER_STATE_OFF) {
+                binder_nfc_adapter_prewarm_done(self);
+            }
+        }
     }
+}
 
-    g_free(fqname);
-    return NULL;
+NciHalIo*
+binder_nfc_adapter_hal_io(
+    NfcAdapter* adapter)
+{
+    return G_LIKELY(adapter) ? &BINDER_NFC_ADAPTER(adapter)->hal_io : NULL;
 }
 
-static
-void
-binder_nfc_adapter_death(
-    GBinderRemoteObject* remote,
-    void* adapter)
+gboolean
+binder_nfc_adapter_get_stats(
+    NfcAdapter* adapter,
+    BinderNfcStats* stats)
+{
+    if (G_LIKELY(adapter) && G_LIKELY(stats)) {
+        binder_nfc_stats_read(&BINDER_NFC_ADAPTER(adapter)->stats, stats);
+        return TRUE;
+    }
+    return FALSE;
+}
+
+gboolean
+binder_nfc_adapter_settled(
+    NfcAdapter* adapter)
 {
-    g_signal_emit(BINDER_NFC_ADAPTER(adapter),
-        binder_nfc_adapter_signals[SIGNAL_DEATH], 0);
+    if (G_LIKELY(adapter)) {
+        BinderNfcAdapter* self = BINDER_NFC_ADAPTER(adapter);
+        NciCore* nci = self->adapter.nci;
+
+        /* Nothing in flight and power state matches the request */
+        return (self->state == BINDER_NFC_ADAPTER_STATE_OFF ||
+            self->state == BINDER_NFC_ADAPTER_STATE_ON) &&
+            !self->evaluate_id && !self->rx_flush_id &&
+            !self->power_switch_pending &&
+            self->need_power == self->power_on &&
+            !binder_nfc_adapter_quiesced(self) &&
+            nci->current_state == nci->next_state;
+    }
+    return FALSE;
 }
 
 gulong
@@ -750,13 +1479,8 @@ binder_nfc_adapter_add_death_handler(
     void* data)
 {
     if (G_LIKELY(adapter) && G_LIKELY(fn)) {
-        BinderNfcAdapter* self = BINDER_NFC_ADAPTER(adapter);
-
-        if (!self->death_id) {
-            self->death_id = gbinder_remote_object_add_death_handler
-                (self->remote, binder_nfc_adapter_death, self);
-        }
-        return g_signal_connect(self, SIGNAL_DEATH_NAME, G_CALLBACK(fn), data);
+        return g_signal_connect(BINDER_NFC_ADAPTER(adapter),
+            SIGNAL_DEATH_NAME, G_CALLBACK(fn), data);
     }
     return 0;
 }
@@ -771,7 +1495,7 @@ binder_nfc_adapter_current_state_changed(
     NciAdapter* adapter)
 {
     NCI_ADAPTER_CLASS(SUPER_CLASS)->current_state_changed(adapter);
-    binder_nfc_adapter_state_check(BINDER_NFC_ADAPTER(adapter));
+    binder_nfc_adapter_evaluate(BINDER_NFC_ADAPTER(adapter));
 }
 
 static
@@ -780,7 +1504,7 @@ binder_nfc_adapter_next_state_changed(
     NciAdapter* adapter)
 {
     NCI_ADAPTER_CLASS(SUPER_CLASS)->next_state_changed(adapter);
-    binder_nfc_adapter_state_check(BINDER_NFC_ADAPTER(adapter));
+    binder_nfc_adapter_evaluate(BINDER_NFC_ADAPTER(adapter));
 }
 
 static
@@ -792,33 +1516,30 @@ binder_nfc_adapter_submit_power_request(
     BinderNfcAdapter* self = BINDER_NFC_ADAPTER(adapter);
     NciCore* nci = self->adapter.nci;
 
+    const BINDER_NFC_ADAPTER_STATE state = self->state;
+
+    /* A pre-warmed session gets picked up (or closed) by the request */
+    binder_nfc_adapter_prewarm_done(self);
+    if (!on && binder_nfc_adapter_quiesced(self)) {
+        /* Power off doesn't wait for the HAL to give the control back */
+        GDEBUG("Taking control back for power off");
+        binder_nfc_adapter_take_control(self);
+    }
     self->need_power = on;
-    if (self->pending_tx) {
-        GDEBUG("Waiting for pending call to complete");
-        self->power_switch_pending = TRUE;
-    } else if (on) {
-        if (self->power_on) {
-            GDEBUG("Adapter already opened");
-            nci_core_set_state(nci, NCI_RFST_IDLE);
-            /* Power stays on, we are done */
-        } else {
-            self->power_switch_pending = binder_nfc_adapter_open(self);
-        }
+    if (on && (state == BINDER_NFC_ADAPTER_STATE_INIT ||
+        state == BINDER_NFC_ADAPTER_STATE_ON)) {
+        GDEBUG("Adapter already opened");
+        nci_core_set_state(nci, NCI_RFST_IDLE);
+        /* Power stays on, we are done */
+        self->power_switch_pending = FALSE;
+    } else if (!on && state == BINDER_NFC_ADAPTER_STATE_OFF) {
+        GDEBUG("Adapter already closed");
+        /* Power stays off, we are done */
+        self->power_switch_pending = FALSE;
     } else {
-        if (self->power_on) {
-            if (binder_nfc_adapter_can_close(self)) {
-                self->power_switch_pending = binder_nfc_adapter_close(self);
-            } else {
-                GDEBUG("Waiting for NCI state machine to become idle");
-                nci_core_set_state(nci, NCI_RFST_IDLE);
-                self->power_switch_pending =
-                    (nci->current_state != NCI_RFST_IDLE &&
-                    nci->next_state == NCI_RFST_IDLE);
-            }
-        } else {
-            GDEBUG("Adapter already closed");
-            /* Power stays off, we are done */
-        }
+        /* The state machine will take it from here */
+        self->power_switch_pending = TRUE;
+        binder_nfc_adapter_evaluate(self);
     }
     return self->power_switch_pending;
 }
@@ -832,17 +1553,13 @@ binder_nfc_adapter_cancel_power_request(
 
     self->need_power = self->power_on;
     self->power_switch_pending = FALSE;
+    binder_nfc_adapter_evaluate(self);
 }
 
 /*==========================================================================*
  * NFC HAL I/O
  *==========================================================================*/
 
-typedef struct binder_nci_write_data {
-    BinderNfcAdapter* self;
-    NciHalClientFunc complete;
-} BinderNciWriteData;
-
 static
 BinderNfcAdapter*
 binder_nfc_adapter_from_nci_hal_io(
@@ -853,31 +1570,44 @@ binder_nfc_adapter_from_nci_hal_io(
 
 static
 void
-binder_nci_adapter_hal_io_write_data_free(
-    gpointer data)
+binder_nfc_adapter_hal_io_write_reply(
+    BinderNfcTransport* transport,
+    int result,
+    void* user_data)
 {
-    g_slice_free1(sizeof(BinderNciWriteData), data);
+    BinderNfcAdapter* self = BINDER_NFC_ADAPTER(user_data);
+    NciHalClientFunc complete = self->nci_write_complete;
+
+    self->nci_write_id = 0;
+    self->nci_write_complete = NULL;
+    binder_nfc_client_finished(self);
+    if (result) {
+        binder_nfc_stats_write_failed(&self->stats);
+    }
+    if (complete) {
+        complete(self->hal_client, result == 0);
+    }
+    binder_nfc_adapter_grant_control_check(self);
 }
 
 static
-void
-binder_nfc_adapter_hal_io_write_reply(
-    GBinderClient* client,
-    GBinderRemoteReply* reply,
-    int status,
-    void* user_data)
+gboolean
+binder_nfc_adapter_submit_write(
+    BinderNfcAdapter* self,
+    const void* data,
+    guint len,
+    NciHalClientFunc complete)
 {
-    gint32 result;
-    BinderNciWriteData* write_data = user_data;
-    BinderNfcAdapter* self = write_data->self;
-    const gboolean success = (status == GBINDER_STATUS_OK &&
-        gbinder_remote_reply_read_int32(reply, &result) &&
-        result == 0);
+    GASSERT(!self->nci_write_id);
 
-    self->nci_write_id = 0;
-    if (write_data->complete) {
-        write_data->complete(self->hal_client, success);
+    /* There's only one write at a time */
+    self->nci_write_complete = complete;
+    self->nci_write_id = binder_nfc_client_write(self, data, len,
+        binder_nfc_adapter_hal_io_write_reply, NULL, self);
+    if (!self->nci_write_id) {
+        self->nci_write_complete = NULL;
     }
+    return (self->nci_write_id != 0);
 }
 
 static
@@ -900,6 +1630,7 @@ binder_nfc_adapter_hal_io_stop(
     BinderNfcAdapter* self = binder_nfc_adapter_from_nci_hal_io(hal_io);
 
     self->hal_client = NULL;
+    binder_nfc_adapter_rx_drop(self);
 }
 
 static
@@ -911,6 +1642,7 @@ binder_nfc_adapter_hal_io_write(
     NciHalClientFunc complete)
 {
     BinderNfcAdapter* self = binder_nfc_adapter_from_nci_hal_io(hal_io);
+    gboolean ok = FALSE;
     guint len = 0;
     const guint8* data = NULL;
     guint8* tmp_buf = NULL;
@@ -938,20 +1670,21 @@ binder_nfc_adapter_hal_io_write(
         }
     }
 
-    GASSERT(!self->nci_write_id);
     if (data) {
-        BinderNciWriteData* write_data = g_slice_new(BinderNciWriteData);
-
-        write_data->self = self;
-        write_data->complete = complete;
-
-        self->nci_write_id = binder_nfc_client_write(self, data, len,
-            binder_nfc_adapter_hal_io_write_reply,
-            binder_nci_adapter_hal_io_write_data_free, write_data);
+        if (binder_nfc_adapter_quiesced(self)) {
+            /* Hold it until the HAL gives the control back */
+            GASSERT(!self->held_write);
+            GDEBUG("Holding %u byte(s) while HAL is in control", len);
+            self->held_write = tmp_buf ? g_bytes_new_take(tmp_buf, len) :
+                g_bytes_new(data, len);
+            self->held_write_complete = complete;
+            return TRUE;
+        }
+        ok = binder_nfc_adapter_submit_write(self, data, len, complete);
     }
 
     g_free(tmp_buf);
-    return (self->nci_write_id != 0);
+    return ok;
 }
 
 static
@@ -961,9 +1694,141 @@ binder_nfc_adapter_hal_io_cancel_write(
 {
     BinderNfcAdapter* self = binder_nfc_adapter_from_nci_hal_io(hal_io);
 
-    GASSERT(self->nci_write_id);
-    gbinder_client_cancel(self->client, self->nci_write_id);
-    self->nci_write_id = 0;
+    if (self->held_write) {
+        g_bytes_unref(self->held_write);
+        self->held_write = NULL;
+        self->held_write_complete = NULL;
+    } else {
+        GASSERT(self->nci_write_id);
+        self->transport->fn->cancel(self->transport, self->nci_write_id);
+        binder_nfc_client_finished(self);
+        self->nci_write_id = 0;
+        self->nci_write_complete = NULL;
+    }
+    binder_nfc_adapter_grant_control_check(self);
+}
+
+/*==========================================================================*
+ * HAL control
+ *==========================================================================*/
+
+static
+void
+binder_nfc_adapter_control_granted_reply(
+    BinderNfcTransport* transport,
+    int result,
+    void* user_data)
+{
+    BinderNfcAdapter* self = BINDER_NFC_ADAPTER(user_data);
+
+    if (result) {
+        GWARN("controlGranted error %d", result);
+    }
+    self->control_tx = 0;
+    binder_nfc_client_finished(self);
+}
+
+static
+void
+binder_nfc_adapter_grant_control_check(
+    BinderNfcAdapter* self)
+{
+    /* Wait for the write in progress before handing the NFCC over */
+    if (self->control_requested && !self->nci_write_id) {
+        GDEBUG("Granting control to HAL");
+        self->control_requested = FALSE;
+        self->hal_control = TRUE;
+        binder_nfc_stats_control(&self->stats, TRUE);
+        if (self->control_tx) {
+            self->transport->fn->cancel(self->transport, self->control_tx);
+            binder_nfc_client_finished(self);
+        }
+        self->control_tx = binder_nfc_client_control_granted(self,
+            binder_nfc_adapter_control_granted_reply);
+    }
+}
+
+static
+void
+binder_nfc_adapter_take_control(
+    BinderNfcAdapter* self)
+{
+    NciHalClientFunc complete = self->held_write_complete;
+
+    /* The held write is dropped, let the NCI core know */
+    binder_nfc_adapter_drop_control(self);
+    if (complete) {
+        complete(self->hal_client, FALSE);
+    }
+    binder_nfc_adapter_evaluate(self);
+}
+
+static
+gboolean
+binder_nfc_adapter_control_timeout(
+    gpointer user_data)
+{
+    BinderNfcAdapter* self = BINDER_NFC_ADAPTER(user_data);
+
+    GWARN("HAL didn't release control in %u ms", self->control_timeout_ms);
+    self->control_timeout_id = 0;
+    binder_nfc_adapter_take_control(self);
+    return G_SOURCE_REMOVE;
+}
+
+static
+void
+binder_nfc_adapter_request_control(
+    BinderNfcAdapter* self)
+{
+    if (!binder_nfc_adapter_quiesced(self)) {
+        self->control_requested = TRUE;
+        if (self->control_timeout_ms) {
+            self->control_timeout_id = g_timeout_add(self->control_timeout_ms,
+                binder_nfc_adapter_control_timeout, self);
+        }
+        binder_nfc_adapter_grant_control_check(self);
+    }
+}
+
+static
+void
+binder_nfc_adapter_release_control(
+    BinderNfcAdapter* self)
+{
+    if (binder_nfc_adapter_quiesced(self)) {
+        GBytes* held = self->held_write;
+
+        if (self->control_timeout_id) {
+            g_source_remove(self->control_timeout_id);
+            self->control_timeout_id = 0;
+        }
+        if (self->hal_control) {
+            GDEBUG("HAL released control");
+            self->hal_control = FALSE;
+            binder_nfc_stats_control(&self->stats, FALSE);
+        } else {
+            GDEBUG("HAL no longer needs control");
+            self->control_requested = FALSE;
+        }
+
+        /* Resume NCI traffic in the order it was held */
+        if (held) {
+            NciHalClientFunc complete = self->held_write_complete;
+            gsize len;
+            const void* data = g_bytes_get_data(held, &len);
+
+            self->held_write = NULL;
+            self->held_write_complete = NULL;
+            if (!binder_nfc_adapter_submit_write(self, data, len, complete) &&
+                complete) {
+                complete(self->hal_client, FALSE);
+            }
+            g_bytes_unref(held);
+        }
+        /* Catch up with whatever has been requested in the meantime */
+        binder_nfc_adapter_evaluate(self);
+    }
 }
 
 /*==========================================================================*
@@ -975,6 +1840,11 @@ void
 binder_nfc_adapter_init(
     BinderNfcAdapter* self)
 {
+    static const BinderNfcTransportClientFunctions transport_client_fn = {
+        .event = binder_nfc_callback_handle_event,
+        .data = binder_nfc_callback_handle_data,
+        .death = binder_nfc_callback_handle_death
+    };
     static const NciHalIoFunctions hal_io_functions = {
         .start = binder_nfc_adapter_hal_io_start,
         .stop = binder_nfc_adapter_hal_io_stop,
@@ -982,7 +1852,10 @@ binder_nfc_adapter_init(
         .cancel_write = binder_nfc_adapter_hal_io_cancel_write
     };
 
+    self->transport_client.fn = &transport_client_fn;
     self->hal_io.fn = &hal_io_functions;
+    self->state = BINDER_NFC_ADAPTER_STATE_OFF;
+    self->state_since = g_get_monotonic_time();
     nci_adapter_init_base(&self->adapter, &self->hal_io);
 }
 
@@ -993,13 +1866,50 @@ binder_nfc_adapter_finalize(
 {
     BinderNfcAdapter* self = BINDER_NFC_ADAPTER(object);
 
-    gbinder_client_cancel(self->client, self->nci_write_id);
-    gbinder_client_cancel(self->client, self->pending_tx);
-    gbinder_client_unref(self->client);
-    gbinder_local_object_drop(self->callback);
-    gbinder_remote_object_remove_handler(self->remote, self->death_id);
-    gbinder_remote_object_unref(self->remote);
-    g_free(self->fqname);
+#ifndef DISABLE_HEXDUMP
+    if (self->dump_flush_id) {
+        g_source_remove(self->dump_flush_id);
+        binder_dump_flush(self);
+    }
+#endif
+    if (self->dump_staging) {
+        g_byte_array_free(self->dump_staging, TRUE);
+    }
+    if (self->rx_flush_id) {
+        g_source_remove(self->rx_flush_id);
+    }
+    if (self->rx_batch) {
+        g_byte_array_free(self->rx_batch, TRUE);
+    }
+    if (self->rx_spare) {
+        g_byte_array_free(self->rx_spare, TRUE);
+    }
+    if (self->evaluate_id) {
+        g_source_remove(self->evaluate_id);
+    }
+    if (self->prewarm_timeout_id) {
+        g_source_remove(self->prewarm_timeout_id);
+    }
+    if (self->transport) {
+        BinderNfcTransport* transport = self->transport;
+
+        if (self->nci_write_id) {
+            transport->fn->cancel(transport, self->nci_write_id);
+            binder_nfc_client_finished(self);
+        }
+        if (self->pending_tx) {
+            transport->fn->cancel(transport, self->pending_tx);
+            binder_nfc_client_finished(self);
+        }
+        binder_nfc_adapter_drop_control(self);
+        if (self->power_on) {
+            /* Stop the plugin-wide power clock */
+            binder_nfc_stats_power(&self->stats, FALSE);
+        }
+        transport->fn->set_client(transport, NULL);
+        binder_nfc_transport_free(transport);
+    }
+    binder_nfc_capture_unref(self->capture);
     G_OBJECT_CLASS(SUPER_CLASS)->finalize(object);
 }
 
@@ -0,0 +1,802 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ * Copyright (C) 2021 Slava Monich <slava.monich@jolla.com>
+ *
+ * You may use this file under the terms of BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "binder_nfc_bench.h"
+#include "binder_nfc_transport.h"
+
+#include <nfc_manager.h>
+
+#include <nci_hal.h>
+
+#include <gutil_macros.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef __GLIBC__
+#  include <malloc.h>
+#endif
+
+/*
+ * Heap usage is only used to estimate allocations per frame. There's
+ * no portable way to count malloc calls from within a plugin, so this
+ * is the number of bytes remaining allocated after the test divided by
+ * the number of frames (which catches leaks and growing caches, but
+ * not short-lived allocations).
+ */
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2,33)
+#  define BENCH_HEAP_IN_USE() ((gint64)mallinfo2().uordblks)
+#elif defined(__GLIBC__)
+#  define BENCH_HEAP_IN_USE() ((gint64)mallinfo().uordblks)
+#else
+#  define BENCH_HEAP_IN_USE() (0)
+#endif
+
+/* Give up if nothing happens for this many seconds */
+#define BENCH_STALL_SEC (5)
+
+#define BENCH_INSTANCE "bench"
+#define BENCH_MAX_FRAME_SIZE (0xff)
+#define BENCH_READ_BURST (8)
+
+struct binder_nfc_samples {
+    GArray* usec;
+    gboolean sorted;
+};
+
+typedef enum binder_nfc_bench_stage {
+    BENCH_STAGE_WRITE,
+    BENCH_STAGE_READ,
+    BENCH_STAGE_READ_BURST,
+    BENCH_STAGE_POWER,
+    BENCH_STAGE_DISCOVERY,
+    BENCH_STAGE_DONE
+} BENCH_STAGE;
+
+enum binder_nfc_bench_adapter_events {
+    BENCH_EVENT_POWERED,
+    BENCH_EVENT_MODE,
+    BENCH_EVENT_COUNT
+};
+
+typedef
+void
+(*BinderNfcBenchFunc)(
+    BinderNfcBench* self);
+
+struct binder_nfc_bench {
+    const BinderNfcConfig* config;
+    FILE* out;
+    NfcManager* manager;
+    NfcAdapter* adapter;
+    BinderNfcTransport* transport;
+    NciHalIo* io;
+    NciHalClient hal_client;
+    gboolean io_started;
+    gulong adapter_event_id[BENCH_EVENT_COUNT];
+    BENCH_STAGE stage;
+    BinderNfcBenchFunc next;
+    guint next_id;
+    guint watchdog_id;
+    guint progress;
+    guint last_progress;
+    guint stall_sec;
+    guint8* frame;
+    guint frame_len;
+    GUtilData* chunk;
+    guint chunks;
+    guint count;
+    guint64 bytes;
+    gint64 start;
+    gint64 heap;
+    gint64 t0;
+    gboolean want_power;
+    NFC_MODE want_mode;
+    BinderNfcSamples* samples[2];
+    BinderNfcStats rx_stats;
+    BinderNfcBenchDoneFunc done;
+    void* user_data;
+};
+
+/*==========================================================================*
+ * Samples
+ *==========================================================================*/
+
+static
+gint
+binder_nfc_samples_compare(
+    gconstpointer a,
+    gconstpointer b)
+{
+    const gint64 x = *(const gint64*)a;
+    const gint64 y = *(const gint64*)b;
+
+    return (x < y) ? -1 : (x > y) ? 1 : 0;
+}
+
+BinderNfcSamples*
+binder_nfc_samples_new(
+    void)
+{
+    BinderNfcSamples* samples = g_new0(BinderNfcSamples, 1);
+
+    samples->usec = g_array_new(FALSE, FALSE, sizeof(gint64));
+    return samples;
+}
+
+void
+binder_nfc_samples_add(
+    BinderNfcSamples* samples,
+    gint64 usec)
+{
+    g_array_append_val(samples->usec, usec);
+    samples->sorted = FALSE;
+}
+
+guint
+binder_nfc_samples_count(
+    BinderNfcSamples* samples)
+{
+    return samples->usec->len;
+}
+
+gint64
+binder_nfc_samples_percentile(
+    BinderNfcSamples* samples,
+    guint percent)
+{
+    GArray* usec = samples->usec;
+
+    if (usec->len) {
+        if (!samples->sorted) {
+            g_array_sort(usec, binder_nfc_samples_compare);
+            samples->sorted = TRUE;
+        }
+        return g_array_index(usec, gint64,
+            (usec->len - 1) * MIN(percent, 100) / 100);
+    }
+    return 0;
+}
+
+void
+binder_nfc_samples_clear(
+    BinderNfcSamples* samples)
+{
+    g_array_set_size(samples->usec, 0);
+    samples->sorted = FALSE;
+}
+
+void
+binder_nfc_samples_free(
+    BinderNfcSamples* samples)
+{
+    if (G_LIKELY(samples)) {
+        g_array_free(samples->usec, TRUE);
+        g_free(samples);
+    }
+}
+
+/*==========================================================================*
+ * Implementation
+ *==========================================================================*/
+
+static
+void
+binder_nfc_bench_finish(
+    BinderNfcBench* self,
+    gboolean ok);
+
+static
+gboolean
+binder_nfc_bench_next_proc(
+    gpointer user_data)
+{
+    BinderNfcBench* self = user_data;
+    BinderNfcBenchFunc next = self->next;
+
+    self->next_id = 0;
+    self->next = NULL;
+    next(self);
+    return G_SOURCE_REMOVE;
+}
+
+static
+void
+binder_nfc_bench_schedule(
+    BinderNfcBench* self,
+    BinderNfcBenchFunc next)
+{
+    /* Don't call back into nfcd from within its own signal handlers */
+    GASSERT(!self->next_id);
+    self->next = next;
+    self->next_id = g_idle_add(binder_nfc_bench_next_proc, self);
+}
+
+static
+gboolean
+binder_nfc_bench_watchdog(
+    gpointer user_data)
+{
+    BinderNfcBench* self = user_data;
+
+    if (self->progress != self->last_progress) {
+        self->last_progress = self->progress;
+        self->stall_sec = 0;
+    } else if (++self->stall_sec >= BENCH_STALL_SEC) {
+        GERR("Benchmark stalled (stage %d)", self->stage);
+        self->watchdog_id = 0;
+        binder_nfc_bench_finish(self, FALSE);
+        return G_SOURCE_REMOVE;
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+static
+void
+binder_nfc_bench_begin(
+    BinderNfcBench* self,
+    BENCH_STAGE stage)
+{
+    self->stage = stage;
+    self->count = 0;
+    self->bytes = 0;
+    binder_nfc_samples_clear(self->samples[0]);
+    binder_nfc_samples_clear(self->samples[1]);
+    self->heap = BENCH_HEAP_IN_USE();
+    self->start = g_get_monotonic_time();
+}
+
+static
+void
+binder_nfc_bench_sample(
+    BinderNfcBench* self,
+    BinderNfcSamples* samples)
+{
+    binder_nfc_samples_add(samples, g_get_monotonic_time() - self->t0);
+    self->progress++;
+}
+
+static
+void
+binder_nfc_bench_report(
+    BinderNfcBench* self,
+    const char* test,
+    guint chunks,
+    BinderNfcSamples* samples)
+{
+    FILE* out = self->out;
+    const gint64 usec = g_get_monotonic_time() - self->start;
+    const guint n = binder_nfc_samples_count(samples);
+
+    fprintf(out, "{\"test\":\"%s\"", test);
+    if (chunks) {
+        fprintf(out, ",\"chunks\":%u", chunks);
+    }
+    fprintf(out, ",\"count\":%u,\"usec\":%" G_GINT64_FORMAT, n, usec);
+    if (self->bytes && usec > 0) {
+        fprintf(out, ",\"bytes\":%" G_GUINT64_FORMAT ",\"frames_per_sec\":%.1f"
+            ",\"bytes_per_sec\":%.1f", self->bytes, n * 1e6 / usec,
+            self->bytes * 1e6 / usec);
+    }
+    fprintf(out, ",\"p50_usec\":%" G_GINT64_FORMAT ",\"p99_usec\":%"
+        G_GINT64_FORMAT ",\"max_usec\":%" G_GINT64_FORMAT,
+        binder_nfc_samples_percentile(samples, 50),
+        binder_nfc_samples_percentile(samples, 99),
+        binder_nfc_samples_percentile(samples, 100));
+    if (n) {
+        fprintf(out, ",\"heap_per_op\":%.1f",
+            (double)(BENCH_HEAP_IN_USE() - self->heap) / n);
+    }
+    fputs("}\n", out);
+    fflush(out);
+}
+
+static
+void
+binder_nfc_bench_io_stop(
+    BinderNfcBench* self)
+{
+    if (self->io_started) {
+        self->io_started = FALSE;
+        self->io->fn->stop(self->io);
+    }
+}
+
+static
+void
+binder_nfc_bench_done(
+    BinderNfcBench* self)
+{
+    binder_nfc_bench_finish(self, TRUE);
+}
+
+/*==========================================================================*
+ * Discovery re-arm
+ *==========================================================================*/
+
+static
+void
+binder_nfc_bench_discovery_next(
+    BinderNfcBench* self)
+{
+    NfcAdapter* adapter = self->adapter;
+
+    if (self->count < self->config->bench_cycles) {
+        self->want_mode = (adapter->mode == NFC_MODE_NONE) ?
+            NFC_MODE_READER_WRITER : NFC_MODE_NONE;
+        self->t0 = g_get_monotonic_time();
+        nfc_adapter_request_mode(adapter, self->want_mode);
+    } else {
+        binder_nfc_bench_report(self, "discovery_arm", 0, self->samples[0]);
+        binder_nfc_bench_report(self, "discovery_disarm", 0,
+            self->samples[1]);
+        self->want_power = FALSE;
+        nfc_adapter_request_power(adapter, FALSE);
+    }
+}
+
+static
+void
+binder_nfc_bench_discovery_start(
+    BinderNfcBench* self)
+{
+    binder_nfc_bench_begin(self, BENCH_STAGE_DISCOVERY);
+    self->want_power = TRUE;
+    if (self->adapter->powered) {
+        binder_nfc_bench_discovery_next(self);
+    } else {
+        nfc_adapter_request_power(self->adapter, TRUE);
+    }
+}
+
+static
+void
+binder_nfc_bench_mode_changed(
+    NfcAdapter* adapter,
+    void* bench)
+{
+    BinderNfcBench* self = bench;
+
+    if (self->stage == BENCH_STAGE_DISCOVERY &&
+        adapter->mode == self->want_mode && !self->next_id) {
+        if (self->want_mode == NFC_MODE_NONE) {
+            binder_nfc_bench_sample(self, self->samples[1]);
+            self->count++;
+        } else {
+            binder_nfc_bench_sample(self, self->samples[0]);
+        }
+        binder_nfc_bench_schedule(self, binder_nfc_bench_discovery_next);
+    }
+}
+
+/*==========================================================================*
+ * Power on/off
+ *==========================================================================*/
+
+static
+void
+binder_nfc_bench_power_next(
+    BinderNfcBench* self)
+{
+    NfcAdapter* adapter = self->adapter;
+
+    if (self->count < self->config->bench_cycles) {
+        self->want_power = !adapter->powered;
+        self->t0 = g_get_monotonic_time();
+        nfc_adapter_request_power(adapter, self->want_power);
+    } else {
+        binder_nfc_bench_report(self, "power_on", 0, self->samples[0]);
+        binder_nfc_bench_report(self, "power_off", 0, self->samples[1]);
+        binder_nfc_bench_discovery_start(self);
+    }
+}
+
+static
+void
+binder_nfc_bench_power_start(
+    BinderNfcBench* self)
+{
+    binder_nfc_bench_begin(self, BENCH_STAGE_POWER);
+    binder_nfc_bench_power_next(self);
+}
+
+static
+void
+binder_nfc_bench_powered_changed(
+    NfcAdapter* adapter,
+    void* bench)
+{
+    BinderNfcBench* self = bench;
+
+    if (adapter->powered == self->want_power && !self->next_id) {
+        switch (self->stage) {
+        case BENCH_STAGE_POWER:
+            if (self->want_power) {
+                binder_nfc_bench_sample(self, self->samples[0]);
+            } else {
+                binder_nfc_bench_sample(self, self->samples[1]);
+                self->count++;
+            }
+            binder_nfc_bench_schedule(self, binder_nfc_bench_power_next);
+            break;
+        case BENCH_STAGE_DISCOVERY:
+            self->progress++;
+            binder_nfc_bench_schedule(self, self->want_power ?
+                binder_nfc_bench_discovery_next : binder_nfc_bench_done);
+            break;
+        case BENCH_STAGE_WRITE:
+        case BENCH_STAGE_READ:
+        case BENCH_STAGE_READ_BURST:
+        case BENCH_STAGE_DONE:
+            break;
+        }
+    }
+}
+
+/*==========================================================================*
+ * sendData
+ *==========================================================================*/
+
+static
+void
+binder_nfc_bench_read_next(
+    BinderNfcBench* self)
+{
+    self->t0 = g_get_monotonic_time();
+    binder_nfc_transport_fake_inject_data(self->transport, self->frame,
+        self->frame_len);
+}
+
+static
+void
+binder_nfc_bench_read_start(
+    BinderNfcBench* self)
+{
+    binder_nfc_bench_begin(self, BENCH_STAGE_READ);
+    binder_nfc_bench_read_next(self);
+}
+
+static
+void
+binder_nfc_bench_read_burst_next(
+    BinderNfcBench* self)
+{
+    guint i;
+
+    /* The whole burst arrives in one dispatch cycle */
+    self->t0 = g_get_monotonic_time();
+    for (i = 0; i < BENCH_READ_BURST; i++) {
+        binder_nfc_transport_fake_inject_data(self->transport, self->frame,
+            self->frame_len);
+    }
+}
+
+static
+void
+binder_nfc_bench_read_burst_start(
+    BinderNfcBench* self)
+{
+    binder_nfc_bench_begin(self, BENCH_STAGE_READ_BURST);
+    binder_nfc_adapter_get_stats(self->adapter, &self->rx_stats);
+    binder_nfc_bench_read_burst_next(self);
+}
+
+static
+void
+binder_nfc_bench_report_rx_batches(
+    BinderNfcBench* self)
+{
+    FILE* out = self->out;
+    const BinderNfcStats* start = &self->rx_stats;
+    BinderNfcStats stats;
+    guint i;
+
+    /* Batch size and added latency histograms for this stage only */
+    binder_nfc_adapter_get_stats(self->adapter, &stats);
+    fputs("{\"test\":\"rx_batch\",\"batch_frames\":[", out);
+    for (i = 0; i < BINDER_NFC_STATS_BATCH_BUCKETS; i++) {
+        fprintf(out, "%s%" G_GUINT64_FORMAT, i ? "," : "",
+            stats.rx_batches[i] - start->rx_batches[i]);
+    }
+    fputs("],\"delay_usec\":[", out);
+    for (i = 0; i < BINDER_NFC_STATS_DELAY_BUCKETS; i++) {
+        fprintf(out, "%s%" G_GUINT64_FORMAT, i ? "," : "",
+            stats.rx_delays[i] - start->rx_delays[i]);
+    }
+    fputs("]}\n", out);
+    fflush(out);
+}
+
+static
+void
+binder_nfc_bench_hal_client_read(
+    NciHalClient* client,
+    const void* data,
+    guint len)
+{
+    BinderNfcBench* self = G_CAST(client, BinderNfcBench, hal_client);
+
+    /* Ignore credit notifications generated by the write test */
+    if (len != self->frame_len || memcmp(data, self->frame, len)) {
+        return;
+    }
+    if (self->stage == BENCH_STAGE_READ) {
+        binder_nfc_bench_sample(self, self->samples[0]);
+        self->bytes += len;
+        if (++self->count < self->config->bench_frames) {
+            binder_nfc_bench_read_next(self);
+        } else {
+            binder_nfc_bench_report(self, "read", 0, self->samples[0]);
+            binder_nfc_bench_schedule(self,
+                binder_nfc_bench_read_burst_start);
+        }
+    } else if (self->stage == BENCH_STAGE_READ_BURST) {
+        binder_nfc_bench_sample(self, self->samples[0]);
+        self->bytes += len;
+        if (++self->count % BENCH_READ_BURST) {
+            /* Wait for the rest of the burst */
+        } else if (self->count < self->config->bench_frames) {
+            binder_nfc_bench_read_burst_next(self);
+        } else {
+            binder_nfc_bench_report(self, "read_burst", 0, self->samples[0]);
+            binder_nfc_bench_report_rx_batches(self);
+            binder_nfc_bench_io_stop(self);
+            binder_nfc_bench_schedule(self, binder_nfc_bench_power_start);
+        }
+    }
+}
+
+static
+void
+binder_nfc_bench_hal_client_error(
+    NciHalClient* client)
+{
+    GWARN("Benchmark I/O error");
+}
+
+/*==========================================================================*
+ * NCI write
+ *==========================================================================*/
+
+static
+void
+binder_nfc_bench_write_complete(
+    NciHalClient* client,
+    gboolean ok);
+
+static
+void
+binder_nfc_bench_write_next(
+    BinderNfcBench* self)
+{
+    const guint n = MIN(self->chunks, self->frame_len);
+    const guint8* ptr = self->frame;
+    guint left = self->frame_len;
+    guint i;
+
+    for (i = 0; i < n; i++) {
+        const guint size = left / (n - i);
+
+        self->chunk[i].bytes = ptr;
+        self->chunk[i].size = size;
+        ptr += size;
+        left -= size;
+    }
+    self->t0 = g_get_monotonic_time();
+    if (!self->io->fn->write(self->io, self->chunk, n,
+        binder_nfc_bench_write_complete)) {
+        GERR("Benchmark write failed");
+        binder_nfc_bench_finish(self, FALSE);
+    }
+}
+
+static
+void
+binder_nfc_bench_write_complete(
+    NciHalClient* client,
+    gboolean ok)
+{
+    BinderNfcBench* self = G_CAST(client, BinderNfcBench, hal_client);
+
+    binder_nfc_bench_sample(self, self->samples[0]);
+    self->bytes += self->frame_len;
+    if (!ok) {
+        GERR("Benchmark write error");
+        binder_nfc_bench_finish(self, FALSE);
+    } else if (++self->count < self->config->bench_frames) {
+        binder_nfc_bench_write_next(self);
+    } else {
+        binder_nfc_bench_report(self, "write", self->chunks,
+            self->samples[0]);
+        if (self->chunks < self->config->bench_max_chunks) {
+            self->chunks++;
+            binder_nfc_bench_begin(self, BENCH_STAGE_WRITE);
+            binder_nfc_bench_write_next(self);
+        } else {
+            binder_nfc_bench_schedule(self, binder_nfc_bench_read_start);
+        }
+    }
+}
+
+static
+void
+binder_nfc_bench_write_start(
+    BinderNfcBench* self)
+{
+    self->io_started = self->io->fn->start(self->io, &self->hal_client);
+    if (self->io_started) {
+        self->chunks = 1;
+        binder_nfc_bench_begin(self, BENCH_STAGE_WRITE);
+        binder_nfc_bench_write_next(self);
+    } else {
+        GERR("Failed to start benchmark I/O");
+        binder_nfc_bench_finish(self, FALSE);
+    }
+}
+
+static
+void
+binder_nfc_bench_finish(
+    BinderNfcBench* self,
+    gboolean ok)
+{
+    if (self->stage != BENCH_STAGE_DONE) {
+        BinderNfcBenchDoneFunc done = self->done;
+
+        self->stage = BENCH_STAGE_DONE;
+        self->done = NULL;
+        if (self->watchdog_id) {
+            g_source_remove(self->watchdog_id);
+            self->watchdog_id = 0;
+        }
+        binder_nfc_bench_io_stop(self);
+        if (done) {
+            done(self, ok, self->user_data);
+        }
+    }
+}
+
+/*==========================================================================*
+ * Interface
+ *==========================================================================*/
+
+BinderNfcBench*
+binder_nfc_bench_new(
+    const BinderNfcConfig* config)
+{
+    static const NciHalClientFunctions bench_hal_client_fn = {
+        .error = binder_nfc_bench_hal_client_error,
+        .read = binder_nfc_bench_hal_client_read
+    };
+    BinderNfcBench* self = g_new0(BinderNfcBench, 1);
+    const guint payload = MIN(config->bench_frame_size, BENCH_MAX_FRAME_SIZE);
+    guint i;
+
+    self->config = config;
+    self->hal_client.fn = &bench_hal_client_fn;
+    self->samples[0] = binder_nfc_samples_new();
+    self->samples[1] = binder_nfc_samples_new();
+    self->chunk = g_new0(GUtilData, MAX(config->bench_max_chunks, 1));
+
+    /* NCI data packet, connection 0 */
+    self->frame_len = payload + 3;
+    self->frame = g_malloc(self->frame_len);
+    self->frame[0] = 0x00;
+    self->frame[1] = 0x00;
+    self->frame[2] = (guint8)payload;
+    for (i = 0; i < payload; i++) {
+        self->frame[3 + i] = (guint8)i;
+    }
+    return self;
+}
+
+gboolean
+binder_nfc_bench_start(
+    BinderNfcBench* self,
+    NfcManager* manager,
+    BinderNfcBenchDoneFunc done,
+    void* user_data)
+{
+    const BinderNfcConfig* config = self->config;
+    const char* output = config->bench_output;
+
+    GASSERT(!self->adapter);
+    if (output) {
+        self->out = fopen(output, "w");
+        if (!self->out) {
+            GERR("Failed to open %s: %s", output, strerror(errno));
+            return FALSE;
+        }
+    } else {
+        self->out = stdout;
+    }
+
+    self->transport = binder_nfc_transport_fake_new(BENCH_INSTANCE, NULL,
+        NULL);
+    self->adapter = binder_nfc_adapter_new(self->transport, config, NULL);
+    self->io = binder_nfc_adapter_hal_io(self->adapter);
+    self->adapter_event_id[BENCH_EVENT_POWERED] =
+        nfc_adapter_add_powered_changed_handler(self->adapter,
+            binder_nfc_bench_powered_changed, self);
+    self->adapter_event_id[BENCH_EVENT_MODE] =
+        nfc_adapter_add_mode_changed_handler(self->adapter,
+            binder_nfc_bench_mode_changed, self);
+
+    /* The adapter needs to be enabled by the manager */
+    self->manager = nfc_manager_ref(manager);
+    nfc_manager_add_adapter(manager, self->adapter);
+
+    GINFO("Running benchmark, %u frame(s) of %u byte(s), %u cycle(s)",
+        config->bench_frames, self->frame_len, config->bench_cycles);
+    self->done = done;
+    self->user_data = user_data;
+    self->watchdog_id = g_timeout_add_seconds(1, binder_nfc_bench_watchdog,
+        self);
+    binder_nfc_bench_schedule(self, binder_nfc_bench_write_start);
+    return TRUE;
+}
+
+void
+binder_nfc_bench_free(
+    BinderNfcBench* self)
+{
+    if (G_LIKELY(self)) {
+        self->done = NULL;
+        binder_nfc_bench_finish(self, FALSE);
+        if (self->next_id) {
+            g_source_remove(self->next_id);
+        }
+        if (self->adapter) {
+            nfc_adapter_remove_all_handlers(self->adapter,
+                self->adapter_event_id);
+            nfc_manager_remove_adapter(self->manager, self->adapter->name);
+            nfc_adapter_unref(self->adapter);
+            nfc_manager_unref(self->manager);
+        }
+        if (self->out && self->out != stdout) {
+            fclose(self->out);
+        }
+        binder_nfc_samples_free(self->samples[0]);
+        binder_nfc_samples_free(self->samples[1]);
+        g_free(self->chunk);
+        g_free(self->frame);
+        g_free(self);
+    }
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ * Copyright (C) 2021 Slava Monich <slava.monich@jolla.com>
+ *
+ * You may use this file under the terms of BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef BINDER_NFC_BENCH_H
+#define BINDER_NFC_BENCH_H
+
+/*
+ * In-process benchmark of the plugin's data path. It creates an adapter
+ * on top of the fake HAL and measures NCI writes (split into 1..N chunks),
+ * sendData delivery, power on/off cycles and discovery re-arms. Results
+ * are written as JSON, one object per line.
+ */
+
+#include "binder_nfc.h"
+
+typedef struct binder_nfc_bench BinderNfcBench;
+typedef struct binder_nfc_samples BinderNfcSamples;
+
+typedef
+void
+(*BinderNfcBenchDoneFunc)(
+    BinderNfcBench* bench,
+    gboolean ok,
+    void* user_data);
+
+BinderNfcBench*
+binder_nfc_bench_new(
+    const BinderNfcConfig* config);
+
+gboolean
+binder_nfc_bench_start(
+    BinderNfcBench* bench,
+    NfcManager* manager,
+    BinderNfcBenchDoneFunc done,
+    void* user_data);
+
+void
+binder_nfc_bench_free(
+    BinderNfcBench* bench);
+
+/* Latency samples (microseconds) */
+
+BinderNfcSamples*
+binder_nfc_samples_new(
+    void);
+
+void
+binder_nfc_samples_add(
+    BinderNfcSamples* samples,
+    gint64 usec);
+
+guint
+binder_nfc_samples_count(
+    BinderNfcSamples* samples);
+
+gint64
+binder_nfc_samples_percentile(
+    BinderNfcSamples* samples,
+    guint percent);
+
+void
+binder_nfc_samples_clear(
+    BinderNfcSamples* samples);
+
+void
+binder_nfc_samples_free(
+    BinderNfcSamples* samples);
+
+#endif /* BINDER_NFC_BENCH_H */
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,681 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ * Copyright (C) 2021 Slava Monich <slava.monich@jolla.com>
+ *
+ * You may use this file under the terms of BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "binder_nfc_capture.h"
+
+#include <gutil_macros.h>
+
+#include <sys/eventfd.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <unistd.h>
+
+/* binder_capture_log is a sub-module, used as a runtime on/off switch */
+GLogModule binder_capture_log = {
+    .name = "binder-pcap",
+    .parent = &GLOG_MODULE_NAME,
+    .max_level = GLOG_LEVEL_MAX,
+    .level = GLOG_LEVEL_NONE,
+    .flags = GLOG_FLAG_HIDE_NAME
+};
+
+#define CAPTURE_LEVEL GLOG_LEVEL_VERBOSE
+
+/* pcapng block types */
+#define PCAPNG_BT_SHB                   (0x0a0d0d0a)
+#define PCAPNG_BT_IDB                   (0x00000001)
+#define PCAPNG_BT_ISB                   (0x00000005)
+#define PCAPNG_BT_EPB                   (0x00000006)
+#define PCAPNG_BYTE_ORDER_MAGIC         (0x1a2b3c4d)
+
+/* pcapng options */
+#define PCAPNG_OPT_ENDOFOPT             (0)
+#define PCAPNG_OPT_SHB_USERAPPL         (4)
+#define PCAPNG_OPT_IF_NAME              (2)
+#define PCAPNG_OPT_IF_DESCRIPTION       (3)
+#define PCAPNG_OPT_EPB_FLAGS            (2)
+#define PCAPNG_OPT_ISB_IFRECV           (4)
+#define PCAPNG_OPT_ISB_IFDROP           (5)
+
+#define PCAPNG_EPB_FLAG_INBOUND         (0x01)
+#define PCAPNG_EPB_FLAG_OUTBOUND        (0x02)
+
+/* There's no registered link type for raw NCI, use the first user one */
+#define PCAPNG_LINKTYPE_NCI             (147) /* LINKTYPE_USER0 */
+
+/* NCI packet is at most 3 bytes of header plus 255 bytes of payload */
+#define CAPTURE_SNAPLEN                 (258)
+#define CAPTURE_APPLICATION             "nfcd-binder-plugin"
+
+typedef struct binder_nfc_capture_slot {
+    BinderNfcCaptureIface* iface;
+    gint64 timestamp;
+    guint32 flags;
+    guint32 len;
+    guint32 orig_len;
+    guint8 data[CAPTURE_SNAPLEN];
+} BinderNfcCaptureSlot;
+
+struct binder_nfc_capture_iface {
+    BinderNfcCapture* capture;
+    guint id;
+    char* name;
+    char* description;
+    gint dropped;           /* Atomic */
+    guint64 written;        /* Writer thread only */
+};
+
+struct binder_nfc_capture {
+    gint refcount;
+    char* file;
+    gsize max_size;
+    guint max_files;
+    gboolean failed;
+
+    /* Single producer (main thread), single consumer (writer thread) */
+    BinderNfcCaptureSlot* slots;
+    guint size;
+    guint mask;
+    gint head;              /* Only written by the producer */
+    gint tail;              /* Only written by the consumer */
+    gint dropped;
+    gint writer_idle;
+    gint stop;
+    int wakeup_fd;
+    GThread* thread;
+
+    /* Interfaces are added by the main thread, read by the writer */
+    GMutex mutex;
+    GPtrArray* ifaces;
+
+    /* Writer thread state */
+    FILE* fp;
+    gsize fsize;
+    guint ifaces_written;
+    GByteArray* buf;
+};
+
+/*==========================================================================*
+ * pcapng encoding (writer thread)
+ *==========================================================================*/
+
+static
+void
+binder_nfc_capture_put(
+    GByteArray* buf,
+    const void* data,
+    guint len)
+{
+    static const guint8 zero[3] = { 0, 0, 0 };
+
+    g_byte_array_append(buf, data, len);
+    if (len & 3) {
+        g_byte_array_append(buf, zero, 4 - (len & 3));
+    }
+}
+
+static
+void
+binder_nfc_capture_put_u16(
+    GByteArray* buf,
+    guint16 value)
+{
+    g_byte_array_append(buf, (void*)&value, sizeof(value));
+}
+
+static
+void
+binder_nfc_capture_put_u32(
+    GByteArray* buf,
+    guint32 value)
+{
+    g_byte_array_append(buf, (void*)&value, sizeof(value));
+}
+
+static
+void
+binder_nfc_capture_put_timestamp(
+    GByteArray* buf,
+    gint64 usec)
+{
+    /* Default if_tsresol is microseconds */
+    binder_nfc_capture_put_u32(buf, (guint32)(((guint64)usec) >> 32));
+    binder_nfc_capture_put_u32(buf, (guint32)usec);
+}
+
+static
+void
+binder_nfc_capture_put_option(
+    GByteArray* buf,
+    guint16 code,
+    const void* data,
+    guint16 len)
+{
+    binder_nfc_capture_put_u16(buf, code);
+    binder_nfc_capture_put_u16(buf, len);
+    binder_nfc_capture_put(buf, data, len);
+}
+
+static
+void
+binder_nfc_capture_put_string_option(
+    GByteArray* buf,
+    guint16 code,
+    const char* str)
+{
+    if (str && str[0]) {
+        binder_nfc_capture_put_option(buf, code, str, strlen(str));
+    }
+}
+
+static
+void
+binder_nfc_capture_block_start(
+    GByteArray* buf,
+    guint32 type)
+{
+    g_byte_array_set_size(buf, 0);
+    binder_nfc_capture_put_u32(buf, type);
+    binder_nfc_capture_put_u32(buf, 0); /* Filled by block_end */
+}
+
+static
+void
+binder_nfc_capture_block_end(
+    BinderNfcCapture* self)
+{
+    GByteArray* buf = self->buf;
+    guint32 total;
+
+    /* Terminate the option list */
+    binder_nfc_capture_put_u32(buf, PCAPNG_OPT_ENDOFOPT);
+    total = buf->len + 4;
+    memcpy(buf->data + 4, &total, 4);
+    binder_nfc_capture_put_u32(buf, total);
+
+    if (self->fp) {
+        if (fwrite(buf->data, buf->len, 1, self->fp) == 1) {
+            self->fsize += buf->len;
+        } else {
+            GWARN("Failed to write %s: %s", self->file, strerror(errno));
+            fclose(self->fp);
+            self->fp = NULL;
+        }
+    }
+}
+
+static
+void
+binder_nfc_capture_write_shb(
+    BinderNfcCapture* self)
+{
+    GByteArray* buf = self->buf;
+    const gint64 section_len = -1;
+
+    binder_nfc_capture_block_start(buf, PCAPNG_BT_SHB);
+    binder_nfc_capture_put_u32(buf, PCAPNG_BYTE_ORDER_MAGIC);
+    binder_nfc_capture_put_u16(buf, 1); /* Major version */
+    binder_nfc_capture_put_u16(buf, 0); /* Minor version */
+    g_byte_array_append(buf, (void*)&section_len, sizeof(section_len));
+    binder_nfc_capture_put_string_option(buf, PCAPNG_OPT_SHB_USERAPPL,
+        CAPTURE_APPLICATION);
+    binder_nfc_capture_block_end(self);
+}
+
+static
+void
+binder_nfc_capture_write_idb(
+    BinderNfcCapture* self,
+    BinderNfcCaptureIface* iface)
+{
+    GByteArray* buf = self->buf;
+
+    binder_nfc_capture_block_start(buf, PCAPNG_BT_IDB);
+    binder_nfc_capture_put_u16(buf, PCAPNG_LINKTYPE_NCI);
+    binder_nfc_capture_put_u16(buf, 0); /* Reserved */
+    binder_nfc_capture_put_u32(buf, CAPTURE_SNAPLEN);
+    binder_nfc_capture_put_string_option(buf, PCAPNG_OPT_IF_NAME,
+        iface->name);
+    binder_nfc_capture_put_string_option(buf, PCAPNG_OPT_IF_DESCRIPTION,
+        iface->description);
+    binder_nfc_capture_block_end(self);
+}
+
+static
+void
+binder_nfc_capture_write_isb(
+    BinderNfcCapture* self,
+    BinderNfcCaptureIface* iface)
+{
+    GByteArray* buf = self->buf;
+    const guint64 dropped = (guint)g_atomic_int_get(&iface->dropped);
+
+    binder_nfc_capture_block_start(buf, PCAPNG_BT_ISB);
+    binder_nfc_capture_put_u32(buf, iface->id);
+    binder_nfc_capture_put_timestamp(buf, g_get_real_time());
+    binder_nfc_capture_put_option(buf, PCAPNG_OPT_ISB_IFRECV,
+        &iface->written, sizeof(iface->written));
+    binder_nfc_capture_put_option(buf, PCAPNG_OPT_ISB_IFDROP,
+        &dropped, sizeof(dropped));
+    binder_nfc_capture_block_end(self);
+}
+
+static
+void
+binder_nfc_capture_write_epb(
+    BinderNfcCapture* self,
+    const BinderNfcCaptureSlot* slot)
+{
+    GByteArray* buf = self->buf;
+
+    binder_nfc_capture_block_start(buf, PCAPNG_BT_EPB);
+    binder_nfc_capture_put_u32(buf, slot->iface->id);
+    binder_nfc_capture_put_timestamp(buf, slot->timestamp);
+    binder_nfc_capture_put_u32(buf, slot->len);
+    binder_nfc_capture_put_u32(buf, slot->orig_len);
+    binder_nfc_capture_put(buf, slot->data, slot->len);
+    binder_nfc_capture_put_option(buf, PCAPNG_OPT_EPB_FLAGS,
+        &slot->flags, sizeof(slot->flags));
+    binder_nfc_capture_block_end(self);
+}
+
+/*==========================================================================*
+ * Writer thread
+ *==========================================================================*/
+
+static
+void
+binder_nfc_capture_write_stats(
+    BinderNfcCapture* self)
+{
+    guint i;
+
+    /* IDBs with ids below ifaces_written have been written */
+    g_mutex_lock(&self->mutex);
+    for (i = 0; i < self->ifaces_written; i++) {
+        binder_nfc_capture_write_isb(self, self->ifaces->pdata[i]);
+    }
+    g_mutex_unlock(&self->mutex);
+}
+
+static
+void
+binder_nfc_capture_close_file(
+    BinderNfcCapture* self)
+{
+    if (self->fp) {
+        binder_nfc_capture_write_stats(self);
+        if (self->fp) {
+            fclose(self->fp);
+            self->fp = NULL;
+        }
+    }
+}
+
+static
+void
+binder_nfc_capture_open_file(
+    BinderNfcCapture* self)
+{
+    self->fp = fopen(self->file, "wb");
+    self->fsize = 0;
+    self->ifaces_written = 0;
+    if (self->fp) {
+        GDEBUG("Writing %s", self->file);
+        binder_nfc_capture_write_shb(self);
+    } else {
+        GWARN("Failed to open %s: %s", self->file, strerror(errno));
+    }
+}
+
+static
+void
+binder_nfc_capture_rotate(
+    BinderNfcCapture* self)
+{
+    guint i;
+
+    binder_nfc_capture_close_file(self);
+
+    /* file => file.1 => file.2 ... the oldest one gets overwritten */
+    for (i = self->max_files - 1; i > 0; i--) {
+        char* dest = g_strdup_printf("%s.%u", self->file, i);
+        char* src = (i > 1) ?
+            g_strdup_printf("%s.%u", self->file, i - 1) :
+            g_strdup(self->file);
+
+        rename(src, dest);
+        g_free(src);
+        g_free(dest);
+    }
+
+    binder_nfc_capture_open_file(self);
+}
+
+static
+void
+binder_nfc_capture_write_slot(
+    BinderNfcCapture* self,
+    const BinderNfcCaptureSlot* slot)
+{
+    BinderNfcCaptureIface* iface = slot->iface;
+
+    if (self->fp && self->fsize >= self->max_size) {
+        binder_nfc_capture_rotate(self);
+    }
+
+    if (self->fp) {
+        /* Interface description blocks are written on demand */
+        if (iface->id >= self->ifaces_written) {
+            g_mutex_lock(&self->mutex);
+            while (self->ifaces_written <= iface->id) {
+                binder_nfc_capture_write_idb(self,
+                    self->ifaces->pdata[self->ifaces_written++]);
+            }
+            g_mutex_unlock(&self->mutex);
+        }
+        binder_nfc_capture_write_epb(self, slot);
+        iface->written++;
+    }
+}
+
+static
+guint
+binder_nfc_capture_drain(
+    BinderNfcCapture* self)
+{
+    guint tail = self->tail;
+    const guint head = (guint)g_atomic_int_get(&self->head);
+    const guint n = head - tail;
+
+    while (tail != head) {
+        binder_nfc_capture_write_slot(self, self->slots + (tail & self->mask));
+        g_atomic_int_set(&self->tail, ++tail);
+    }
+    return n;
+}
+
+static
+void
+binder_nfc_capture_wait(
+    BinderNfcCapture* self)
+{
+    struct pollfd pfd;
+    guint64 value;
+
+    pfd.fd = self->wakeup_fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    if (poll(&pfd, 1, -1) > 0 && (pfd.revents & POLLIN)) {
+        if (read(self->wakeup_fd, &value, sizeof(value)) < 0) {
+            GDEBUG("Capture wakeup read error: %s", strerror(errno));
+        }
+    }
+}
+
+static
+gpointer
+binder_nfc_capture_thread(
+    gpointer data)
+{
+    BinderNfcCapture* self = data;
+
+    binder_nfc_capture_open_file(self);
+    while (!g_atomic_int_get(&self->stop)) {
+        if (!binder_nfc_capture_drain(self)) {
+            if (self->fp) {
+                fflush(self->fp);
+            }
+            /* Make sure that we don't miss the wakeup */
+            g_atomic_int_set(&self->writer_idle, TRUE);
+            if ((guint)g_atomic_int_get(&self->head) == (guint)self->tail &&
+                !g_atomic_int_get(&self->stop)) {
+                binder_nfc_capture_wait(self);
+            }
+            g_atomic_int_set(&self->writer_idle, FALSE);
+        }
+    }
+    binder_nfc_capture_drain(self);
+    binder_nfc_capture_close_file(self);
+    return NULL;
+}
+
+static
+void
+binder_nfc_capture_wakeup(
+    BinderNfcCapture* self)
+{
+    const guint64 one = 1;
+
+    if (write(self->wakeup_fd, &one, sizeof(one)) < 0) {
+        GDEBUG("Capture wakeup write error: %s", strerror(errno));
+    }
+}
+
+static
+gboolean
+binder_nfc_capture_start(
+    BinderNfcCapture* self)
+{
+    GError* error = NULL;
+
+    self->wakeup_fd = eventfd(0, EFD_CLOEXEC);
+    if (self->wakeup_fd < 0) {
+        GERR("Failed to create eventfd: %s", strerror(errno));
+    } else {
+        self->thread = g_thread_try_new("binder-pcap",
+            binder_nfc_capture_thread, self, &error);
+        if (self->thread) {
+            return TRUE;
+        }
+        GERR("Failed to start capture thread: %s", error->message);
+        g_error_free(error);
+        close(self->wakeup_fd);
+        self->wakeup_fd = -1;
+    }
+    self->failed = TRUE;
+    return FALSE;
+}
+
+static
+void
+binder_nfc_capture_iface_free(
+    gpointer data)
+{
+    BinderNfcCaptureIface* iface = data;
+
+    g_free(iface->name);
+    g_free(iface->description);
+    g_free(iface);
+}
+
+static
+void
+binder_nfc_capture_free(
+    BinderNfcCapture* self)
+{
+    if (self->thread) {
+        g_atomic_int_set(&self->stop, TRUE);
+        binder_nfc_capture_wakeup(self);
+        g_thread_join(self->thread);
+        close(self->wakeup_fd);
+    }
+    if (self->dropped) {
+        GWARN("%u frame(s) not captured", (guint)self->dropped);
+    }
+    g_ptr_array_free(self->ifaces, TRUE);
+    g_byte_array_free(self->buf, TRUE);
+    g_mutex_clear(&self->mutex);
+    g_free(self->slots);
+    g_free(self->file);
+    g_free(self);
+}
+
+/*==========================================================================*
+ * Interface
+ *==========================================================================*/
+
+BinderNfcCapture*
+binder_nfc_capture_new(
+    const BinderNfcConfig* config)
+{
+    if (config && config->capture_file) {
+        BinderNfcCapture* self = g_new0(BinderNfcCapture, 1);
+        guint size = 1;
+
+        /* Queue size must be a power of 2 */
+        while (size < config->capture_queue_size && size < 0x10000) {
+            size <<= 1;
+        }
+
+        g_atomic_int_set(&self->refcount, 1);
+        self->file = g_strdup(config->capture_file);
+        self->max_size = MAX(config->capture_max_size, 4096);
+        self->max_files = MAX(config->capture_max_files, 1);
+        self->size = size;
+        self->mask = size - 1;
+        self->slots = g_new(BinderNfcCaptureSlot, size);
+        self->wakeup_fd = -1;
+        self->ifaces = g_ptr_array_new_with_free_func
+            (binder_nfc_capture_iface_free);
+        self->buf = g_byte_array_sized_new(2 * CAPTURE_SNAPLEN);
+        g_mutex_init(&self->mutex);
+
+        GDEBUG("Capture file %s (%u slots)", self->file, size);
+        if (config->capture_enabled) {
+            binder_capture_log.level = CAPTURE_LEVEL;
+        }
+        return self;
+    }
+    return NULL;
+}
+
+BinderNfcCapture*
+binder_nfc_capture_ref(
+    BinderNfcCapture* self)
+{
+    if (G_LIKELY(self)) {
+        GASSERT(self->refcount > 0);
+        g_atomic_int_inc(&self->refcount);
+    }
+    return self;
+}
+
+void
+binder_nfc_capture_unref(
+    BinderNfcCapture* self)
+{
+    if (G_LIKELY(self)) {
+        GASSERT(self->refcount > 0);
+        if (g_atomic_int_dec_and_test(&self->refcount)) {
+            binder_nfc_capture_free(self);
+        }
+    }
+}
+
+guint
+binder_nfc_capture_dropped(
+    BinderNfcCapture* self)
+{
+    return G_LIKELY(self) ? (guint)g_atomic_int_get(&self->dropped) : 0;
+}
+
+BinderNfcCaptureIface*
+binder_nfc_capture_add_iface(
+    BinderNfcCapture* self,
+    const char* name,
+    const char* description)
+{
+    if (G_LIKELY(self)) {
+        BinderNfcCaptureIface* iface = g_new0(BinderNfcCaptureIface, 1);
+
+        iface->capture = self;
+        iface->name = g_strdup(name);
+        iface->description = g_strdup(description);
+        g_mutex_lock(&self->mutex);
+        iface->id = self->ifaces->len;
+        g_ptr_array_add(self->ifaces, iface);
+        g_mutex_unlock(&self->mutex);
+        return iface;
+    }
+    return NULL;
+}
+
+void
+binder_nfc_capture_frame(
+    BinderNfcCaptureIface* iface,
+    BINDER_NFC_CAPTURE_DIR dir,
+    const void* data,
+    guint len)
+{
+    if (iface && gutil_log_enabled(&binder_capture_log, CAPTURE_LEVEL)) {
+        BinderNfcCapture* self = iface->capture;
+        const guint head = self->head;
+
+        if (!self->thread && (self->failed ||
+            !binder_nfc_capture_start(self))) {
+            return;
+        }
+
+        if (head - (guint)g_atomic_int_get(&self->tail) < self->size) {
+            BinderNfcCaptureSlot* slot = self->slots + (head & self->mask);
+
+            slot->iface = iface;
+            slot->timestamp = g_get_real_time();
+            slot->flags = (dir == BINDER_NFC_CAPTURE_IN) ?
+                PCAPNG_EPB_FLAG_INBOUND : PCAPNG_EPB_FLAG_OUTBOUND;
+            slot->orig_len = len;
+            slot->len = MIN(len, CAPTURE_SNAPLEN);
+            memcpy(slot->data, data, slot->len);
+            g_atomic_int_set(&self->head, head + 1);
+
+            /* Only poke the writer if it's sleeping */
+            if (g_atomic_int_get(&self->writer_idle) &&
+                g_atomic_int_compare_and_exchange(&self->writer_idle,
+                TRUE, FALSE)) {
+                binder_nfc_capture_wakeup(self);
+            }
+        } else {
+            g_atomic_int_inc(&iface->dropped);
+            g_atomic_int_inc(&self->dropped);
+        }
+    }
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ * Copyright (C) 2021 Slava Monich <slava.monich@jolla.com>
+ *
+ * You may use this file under the terms of BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef BINDER_NFC_CAPTURE_H
+#define BINDER_NFC_CAPTURE_H
+
+/*
+ * pcapng capture of NCI traffic. Frames are queued by the main thread
+ * into a lock-free ring and written to disk by a background thread.
+ * Frames which don't fit into the queue are dropped and counted.
+ *
+ * Capture can be turned on and off at runtime by changing the level
+ * of the "binder-pcap" log module (off = none, on = verbose).
+ */
+
+#include "binder_nfc.h"
+
+typedef struct binder_nfc_capture_iface BinderNfcCaptureIface;
+
+typedef enum binder_nfc_capture_dir {
+    BINDER_NFC_CAPTURE_IN,      /* HAL => nfcd */
+    BINDER_NFC_CAPTURE_OUT      /* nfcd => HAL */
+} BINDER_NFC_CAPTURE_DIR;
+
+extern GLogModule binder_capture_log;
+
+BinderNfcCapture*
+binder_nfc_capture_new(
+    const BinderNfcConfig* config);
+
+BinderNfcCapture*
+binder_nfc_capture_ref(
+    BinderNfcCapture* capture);
+
+void
+binder_nfc_capture_unref(
+    BinderNfcCapture* capture);
+
+guint
+binder_nfc_capture_dropped(
+    BinderNfcCapture* capture);
+
+BinderNfcCaptureIface*
+binder_nfc_capture_add_iface(
+    BinderNfcCapture* capture,
+    const char* name,
+    const char* description);
+
+void
+binder_nfc_capture_frame(
+    BinderNfcCaptureIface* iface,
+    BINDER_NFC_CAPTURE_DIR dir,
+    const void* data,
+    guint len);
+
+#endif /* BINDER_NFC_CAPTURE_H */
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,542 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ * Copyright (C) 2021 Slava Monich <slava.monich@jolla.com>
+ *
+ * You may use this file under the terms of BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "binder_nfc.h"
+
+/*
+ * Optional configuration file, e.g.
+ *
+ * [Capture]
+ * File = /var/log/nfcd/nci.pcapng
+ * Enabled = true
+ * MaxSize = 16777216
+ * MaxFiles = 2
+ * QueueSize = 1024
+ *
+ * [Receive]
+ * BatchFrames = 16
+ * BatchLatency = 1000
+ *
+ * [Control]
+ * Timeout = 5000
+ *
+ * [Prewarm]
+ * Enabled = true
+ * Timeout = 5000
+ * StateDir = /var/lib/nfcd
+ *
+ * [Failover]
+ * Instances = default;backup
+ * Threshold = 50
+ * Watchdog = 1000
+ * MaxRtt = 20000
+ *
+ * [Hexdump]
+ * Deferred = true
+ *
+ * [FakeHal]
+ * Enabled = true
+ * Script = /etc/nfcd/fake-hal.txt
+ * ReplyDelay = 0
+ * EventDelay = 0
+ * DataDelay = 0
+ * OpenCplt = before|after|none
+ * CloseCplt = before|after|none
+ * OpenError = 0
+ * CloseError = 0
+ * WriteError = 0
+ *
+ * [Record]
+ * File = /var/log/nfcd/hal.rec
+ *
+ * [Replay]
+ * File = /var/log/nfcd/hal.rec.default
+ * Speed = 1.0
+ * Exit = false
+ *
+ * [Bench]
+ * Enabled = true
+ * Output = /tmp/bench.json
+ * Frames = 10000
+ * FrameSize = 32
+ * MaxChunks = 4
+ * Cycles = 100
+ *
+ * [Stress]
+ * Enabled = true
+ * Output = /tmp/stress.json
+ * Rounds = 1000
+ * MaxBurst = 8
+ * MaxGap = 5
+ * MaxDelay = 5
+ * Seed = 0
+ *
+ * Missing file or missing keys mean the defaults.
+ */
+
+#define CONFIG_GROUP_CAPTURE                "Capture"
+#define CONFIG_CAPTURE_FILE                 "File"
+#define CONFIG_CAPTURE_ENABLED              "Enabled"
+#define CONFIG_CAPTURE_MAX_SIZE             "MaxSize"
+#define CONFIG_CAPTURE_MAX_FILES            "MaxFiles"
+#define CONFIG_CAPTURE_QUEUE_SIZE           "QueueSize"
+
+#define CONFIG_GROUP_RECEIVE                "Receive"
+#define CONFIG_RECEIVE_BATCH_FRAMES         "BatchFrames"
+#define CONFIG_RECEIVE_BATCH_LATENCY        "BatchLatency"
+
+#define CONFIG_GROUP_CONTROL                "Control"
+#define CONFIG_CONTROL_TIMEOUT              "Timeout"
+
+#define CONFIG_GROUP_PREWARM                "Prewarm"
+#define CONFIG_PREWARM_ENABLED              "Enabled"
+#define CONFIG_PREWARM_TIMEOUT              "Timeout"
+#define CONFIG_PREWARM_STATE_DIR            "StateDir"
+
+#define CONFIG_GROUP_FAILOVER               "Failover"
+#define CONFIG_FAILOVER_INSTANCES           "Instances"
+#define CONFIG_FAILOVER_THRESHOLD           "Threshold"
+#define CONFIG_FAILOVER_WATCHDOG            "Watchdog"
+#define CONFIG_FAILOVER_MAX_RTT             "MaxRtt"
+
+#define CONFIG_GROUP_HEXDUMP                "Hexdump"
+#define CONFIG_HEXDUMP_DEFERRED             "Deferred"
+
+#define CONFIG_GROUP_FAKE_HAL               "FakeHal"
+#define CONFIG_FAKE_HAL_ENABLED             "Enabled"
+#define CONFIG_FAKE_HAL_SCRIPT              "Script"
+#define CONFIG_FAKE_HAL_REPLY_DELAY         "ReplyDelay"
+#define CONFIG_FAKE_HAL_EVENT_DELAY         "EventDelay"
+#define CONFIG_FAKE_HAL_DATA_DELAY          "DataDelay"
+#define CONFIG_FAKE_HAL_OPEN_CPLT           "OpenCplt"
+#define CONFIG_FAKE_HAL_CLOSE_CPLT          "CloseCplt"
+#define CONFIG_FAKE_HAL_OPEN_ERROR          "OpenError"
+#define CONFIG_FAKE_HAL_CLOSE_ERROR         "CloseError"
+#define CONFIG_FAKE_HAL_WRITE_ERROR         "WriteError"
+
+#define CONFIG_GROUP_RECORD                 "Record"
+#define CONFIG_RECORD_FILE                  "File"
+
+#define CONFIG_GROUP_REPLAY                 "Replay"
+#define CONFIG_REPLAY_FILE                  "File"
+#define CONFIG_REPLAY_SPEED                 "Speed"
+#define CONFIG_REPLAY_EXIT                  "Exit"
+
+#define CONFIG_GROUP_BENCH                  "Bench"
+#define CONFIG_BENCH_ENABLED                "Enabled"
+#define CONFIG_BENCH_OUTPUT                 "Output"
+#define CONFIG_BENCH_FRAMES                 "Frames"
+#define CONFIG_BENCH_FRAME_SIZE             "FrameSize"
+#define CONFIG_BENCH_MAX_CHUNKS             "MaxChunks"
+#define CONFIG_BENCH_CYCLES                 "Cycles"
+
+#define CONFIG_GROUP_STRESS                 "Stress"
+#define CONFIG_STRESS_ENABLED               "Enabled"
+#define CONFIG_STRESS_OUTPUT                "Output"
+#define CONFIG_STRESS_ROUNDS                "Rounds"
+#define CONFIG_STRESS_MAX_BURST             "MaxBurst"
+#define CONFIG_STRESS_MAX_GAP               "MaxGap"
+#define CONFIG_STRESS_MAX_DELAY             "MaxDelay"
+#define CONFIG_STRESS_SEED                  "Seed"
+
+#define DEFAULT_CAPTURE_MAX_SIZE            (16*1024*1024)
+#define DEFAULT_CAPTURE_MAX_FILES           (2)
+#define DEFAULT_CAPTURE_QUEUE_SIZE          (1024)
+#define DEFAULT_RX_BATCH_FRAMES             (16)
+#define DEFAULT_RX_BATCH_LATENCY_US         (1000)
+#define DEFAULT_CONTROL_TIMEOUT_MS          (5000)
+#define DEFAULT_PREWARM_TIMEOUT_MS          (5000)
+#define DEFAULT_FAILOVER_THRESHOLD          (50)
+#define DEFAULT_FAILOVER_WATCHDOG_MS        (1000)
+#define DEFAULT_FAILOVER_MAX_RTT_US         (20000)
+#define DEFAULT_REPLAY_SPEED                (1.0)
+#define DEFAULT_BENCH_FRAMES                (10000)
+#define DEFAULT_BENCH_FRAME_SIZE            (32)
+#define DEFAULT_BENCH_MAX_CHUNKS            (4)
+#define DEFAULT_BENCH_CYCLES                (100)
+#define DEFAULT_STRESS_ROUNDS               (1000)
+#define DEFAULT_STRESS_MAX_BURST            (8)
+#define DEFAULT_STRESS_MAX_GAP_MS           (5)
+#define DEFAULT_STRESS_MAX_DELAY_MS         (5)
+
+static
+gboolean
+binder_nfc_config_get_boolean(
+    GKeyFile* k,
+    const char* group,
+    const char* key,
+    gboolean* value)
+{
+    GError* error = NULL;
+    const gboolean b = g_key_file_get_boolean(k, group, key, &error);
+
+    if (error) {
+        g_error_free(error);
+        return FALSE;
+    } else {
+        *value = b;
+        return TRUE;
+    }
+}
+
+static
+gboolean
+binder_nfc_config_get_uint(
+    GKeyFile* k,
+    const char* group,
+    const char* key,
+    guint* value)
+{
+    GError* error = NULL;
+    const int i = g_key_file_get_integer(k, group, key, &error);
+
+    if (error) {
+        g_error_free(error);
+        return FALSE;
+    } else if (i < 0) {
+        GWARN("Ignoring negative %s/%s value %d", group, key, i);
+        return FALSE;
+    } else {
+        *value = i;
+        return TRUE;
+    }
+}
+
+static
+gboolean
+binder_nfc_config_get_int(
+    GKeyFile* k,
+    const char* group,
+    const char* key,
+    int* value)
+{
+    GError* error = NULL;
+    const int i = g_key_file_get_integer(k, group, key, &error);
+
+    if (error) {
+        g_error_free(error);
+        return FALSE;
+    } else {
+        *value = i;
+        return TRUE;
+    }
+}
+
+static
+gboolean
+binder_nfc_config_get_double(
+    GKeyFile* k,
+    const char* group,
+    const char* key,
+    gdouble* value)
+{
+    GError* error = NULL;
+    const gdouble d = g_key_file_get_double(k, group, key, &error);
+
+    if (error) {
+        g_error_free(error);
+        return FALSE;
+    } else if (d < 0) {
+        GWARN("Ignoring negative %s/%s value %g", group, key, d);
+        return FALSE;
+    } else {
+        *value = d;
+        return TRUE;
+    }
+}
+
+static
+char*
+binder_nfc_config_get_string(
+    GKeyFile* k,
+    const char* group,
+    const char* key)
+{
+    char* str = g_key_file_get_string(k, group, key, NULL);
+
+    if (str) {
+        /* Treat empty value as a missing one */
+        if (!g_strstrip(str)[0]) {
+            g_free(str);
+            str = NULL;
+        }
+    }
+    return str;
+}
+
+static
+char**
+binder_nfc_config_get_string_list(
+    GKeyFile* k,
+    const char* group,
+    const char* key)
+{
+    char** list = g_key_file_get_string_list(k, group, key, NULL, NULL);
+
+    if (list) {
+        guint i, n = 0;
+
+        /* Drop empty items, treat empty list as a missing one */
+        for (i = 0; list[i]; i++) {
+            if (g_strstrip(list[i])[0]) {
+                list[n++] = list[i];
+            } else {
+                g_free(list[i]);
+            }
+        }
+        list[n] = NULL;
+        if (!n) {
+            g_free(list);
+            list = NULL;
+        }
+    }
+    return list;
+}
+
+static
+void
+binder_nfc_config_get_fake_cplt(
+    GKeyFile* k,
+    const char* group,
+    const char* key,
+    BINDER_NFC_FAKE_CPLT* value)
+{
+    char* str = binder_nfc_config_get_string(k, group, key);
+
+    if (str) {
+        if (!g_ascii_strcasecmp(str, "before")) {
+            *value = BINDER_NFC_FAKE_CPLT_BEFORE_REPLY;
+        } else if (!g_ascii_strcasecmp(str, "after")) {
+            *value = BINDER_NFC_FAKE_CPLT_AFTER_REPLY;
+        } else if (!g_ascii_strcasecmp(str, "none")) {
+            *value = BINDER_NFC_FAKE_CPLT_NONE;
+        } else {
+            GWARN("Invalid %s/%s value '%s'", group, key, str);
+        }
+        g_free(str);
+    }
+}
+
+static
+void
+binder_nfc_config_load(
+    BinderNfcConfig* config,
+    GKeyFile* k)
+{
+    BinderNfcFakeHalParams* fake = &config->fake_hal_params;
+    const char* group;
+
+    group = CONFIG_GROUP_CAPTURE;
+    config->capture_file = binder_nfc_config_get_string(k, group,
+        CONFIG_CAPTURE_FILE);
+    binder_nfc_config_get_boolean(k, group, CONFIG_CAPTURE_ENABLED,
+        &config->capture_enabled);
+    binder_nfc_config_get_uint(k, group, CONFIG_CAPTURE_MAX_SIZE,
+        &config->capture_max_size);
+    binder_nfc_config_get_uint(k, group, CONFIG_CAPTURE_MAX_FILES,
+        &config->capture_max_files);
+    binder_nfc_config_get_uint(k, group, CONFIG_CAPTURE_QUEUE_SIZE,
+        &config->capture_queue_size);
+
+    group = CONFIG_GROUP_RECEIVE;
+    binder_nfc_config_get_uint(k, group, CONFIG_RECEIVE_BATCH_FRAMES,
+        &config->rx_batch_frames);
+    binder_nfc_config_get_uint(k, group, CONFIG_RECEIVE_BATCH_LATENCY,
+        &config->rx_batch_latency_us);
+
+    group = CONFIG_GROUP_CONTROL;
+    binder_nfc_config_get_uint(k, group, CONFIG_CONTROL_TIMEOUT,
+        &config->control_timeout_ms);
+
+    group = CONFIG_GROUP_PREWARM;
+    binder_nfc_config_get_boolean(k, group, CONFIG_PREWARM_ENABLED,
+        &config->prewarm);
+    binder_nfc_config_get_uint(k, group, CONFIG_PREWARM_TIMEOUT,
+        &config->prewarm_timeout_ms);
+    config->prewarm_state_dir = binder_nfc_config_get_string(k, group,
+        CONFIG_PREWARM_STATE_DIR);
+    if (config->prewarm && !config->prewarm_state_dir) {
+        GWARN("%s/%s is required, not pre-warming", group,
+            CONFIG_PREWARM_STATE_DIR);
+        config->prewarm = FALSE;
+    }
+
+    group = CONFIG_GROUP_FAILOVER;
+    config->failover_instances = binder_nfc_config_get_string_list(k, group,
+        CONFIG_FAILOVER_INSTANCES);
+    binder_nfc_config_get_uint(k, group, CONFIG_FAILOVER_THRESHOLD,
+        &config->failover_threshold);
+    binder_nfc_config_get_uint(k, group, CONFIG_FAILOVER_WATCHDOG,
+        &config->failover_watchdog_ms);
+    binder_nfc_config_get_uint(k, group, CONFIG_FAILOVER_MAX_RTT,
+        &config->failover_max_rtt_us);
+
+    group = CONFIG_GROUP_HEXDUMP;
+    binder_nfc_config_get_boolean(k, group, CONFIG_HEXDUMP_DEFERRED,
+        &config->hexdump_deferred);
+
+    group = CONFIG_GROUP_FAKE_HAL;
+    binder_nfc_config_get_boolean(k, group, CONFIG_FAKE_HAL_ENABLED,
+        &config->fake_hal);
+    config->fake_hal_script = binder_nfc_config_get_string(k, group,
+        CONFIG_FAKE_HAL_SCRIPT);
+    binder_nfc_config_get_uint(k, group, CONFIG_FAKE_HAL_REPLY_DELAY,
+        &fake->reply_delay_ms);
+    binder_nfc_config_get_uint(k, group, CONFIG_FAKE_HAL_EVENT_DELAY,
+        &fake->event_delay_ms);
+    binder_nfc_config_get_uint(k, group, CONFIG_FAKE_HAL_DATA_DELAY,
+        &fake->data_delay_ms);
+    binder_nfc_config_get_fake_cplt(k, group, CONFIG_FAKE_HAL_OPEN_CPLT,
+        &fake->open_cplt);
+    binder_nfc_config_get_fake_cplt(k, group, CONFIG_FAKE_HAL_CLOSE_CPLT,
+        &fake->close_cplt);
+    binder_nfc_config_get_int(k, group, CONFIG_FAKE_HAL_OPEN_ERROR,
+        &fake->open_result);
+    binder_nfc_config_get_int(k, group, CONFIG_FAKE_HAL_CLOSE_ERROR,
+        &fake->close_result);
+    binder_nfc_config_get_int(k, group, CONFIG_FAKE_HAL_WRITE_ERROR,
+        &fake->write_result);
+
+    group = CONFIG_GROUP_RECORD;
+    config->record_file = binder_nfc_config_get_string(k, group,
+        CONFIG_RECORD_FILE);
+
+    group = CONFIG_GROUP_REPLAY;
+    config->replay_file = binder_nfc_config_get_string(k, group,
+        CONFIG_REPLAY_FILE);
+    binder_nfc_config_get_double(k, group, CONFIG_REPLAY_SPEED,
+        &config->replay_speed);
+    binder_nfc_config_get_boolean(k, group, CONFIG_REPLAY_EXIT,
+        &config->replay_exit);
+
+    group = CONFIG_GROUP_BENCH;
+    binder_nfc_config_get_boolean(k, group, CONFIG_BENCH_ENABLED,
+        &config->bench);
+    config->bench_output = binder_nfc_config_get_string(k, group,
+        CONFIG_BENCH_OUTPUT);
+    binder_nfc_config_get_uint(k, group, CONFIG_BENCH_FRAMES,
+        &config->bench_frames);
+    binder_nfc_config_get_uint(k, group, CONFIG_BENCH_FRAME_SIZE,
+        &config->bench_frame_size);
+    binder_nfc_config_get_uint(k, group, CONFIG_BENCH_MAX_CHUNKS,
+        &config->bench_max_chunks);
+    binder_nfc_config_get_uint(k, group, CONFIG_BENCH_CYCLES,
+        &config->bench_cycles);
+
+    group = CONFIG_GROUP_STRESS;
+    binder_nfc_config_get_boolean(k, group, CONFIG_STRESS_ENABLED,
+        &config->stress);
+    config->stress_output = binder_nfc_config_get_string(k, group,
+        CONFIG_STRESS_OUTPUT);
+    binder_nfc_config_get_uint(k, group, CONFIG_STRESS_ROUNDS,
+        &config->stress_rounds);
+    binder_nfc_config_get_uint(k, group, CONFIG_STRESS_MAX_BURST,
+        &config->stress_max_burst);
+    binder_nfc_config_get_uint(k, group, CONFIG_STRESS_MAX_GAP,
+        &config->stress_max_gap_ms);
+    binder_nfc_config_get_uint(k, group, CONFIG_STRESS_MAX_DELAY,
+        &config->stress_max_delay_ms);
+    binder_nfc_config_get_uint(k, group, CONFIG_STRESS_SEED,
+        &config->stress_seed);
+}
+
+/*==========================================================================*
+ * Interface
+ *==========================================================================*/
+
+BinderNfcConfig*
+binder_nfc_config_new(
+    const char* file)
+{
+    BinderNfcConfig* config = g_new0(BinderNfcConfig, 1);
+
+    config->capture_enabled = TRUE;
+    config->capture_max_size = DEFAULT_CAPTURE_MAX_SIZE;
+    config->capture_max_files = DEFAULT_CAPTURE_MAX_FILES;
+    config->capture_queue_size = DEFAULT_CAPTURE_QUEUE_SIZE;
+    config->rx_batch_frames = DEFAULT_RX_BATCH_FRAMES;
+    config->rx_batch_latency_us = DEFAULT_RX_BATCH_LATENCY_US;
+    config->control_timeout_ms = DEFAULT_CONTROL_TIMEOUT_MS;
+    config->prewarm_timeout_ms = DEFAULT_PREWARM_TIMEOUT_MS;
+    config->failover_threshold = DEFAULT_FAILOVER_THRESHOLD;
+    config->failover_watchdog_ms = DEFAULT_FAILOVER_WATCHDOG_MS;
+    config->failover_max_rtt_us = DEFAULT_FAILOVER_MAX_RTT_US;
+    config->replay_speed = DEFAULT_REPLAY_SPEED;
+    config->bench_frames = DEFAULT_BENCH_FRAMES;
+    config->bench_frame_size = DEFAULT_BENCH_FRAME_SIZE;
+    config->bench_max_chunks = DEFAULT_BENCH_MAX_CHUNKS;
+    config->bench_cycles = DEFAULT_BENCH_CYCLES;
+    config->stress_rounds = DEFAULT_STRESS_ROUNDS;
+    config->stress_max_burst = DEFAULT_STRESS_MAX_BURST;
+    config->stress_max_gap_ms = DEFAULT_STRESS_MAX_GAP_MS;
+    config->stress_max_delay_ms = DEFAULT_STRESS_MAX_DELAY_MS;
+
+    if (file) {
+        GError* error = NULL;
+        GKeyFile* k = g_key_file_new();
+
+        if (g_key_file_load_from_file(k, file, G_KEY_FILE_NONE, &error)) {
+            GDEBUG("Loading %s", file);
+            binder_nfc_config_load(config, k);
+        } else {
+            GDEBUG("%s", error->message);
+            g_error_free(error);
+        }
+        g_key_file_unref(k);
+    }
+    return config;
+}
+
+void
+binder_nfc_config_free(
+    BinderNfcConfig* config)
+{
+    if (config) {
+        g_free(config->capture_file);
+        g_free(config->prewarm_state_dir);
+        g_strfreev(config->failover_instances);
+        g_free(config->fake_hal_script);
+        g_free(config->record_file);
+        g_free(config->replay_file);
+        g_free(config->bench_output);
+        g_free(config->stress_output);
+        g_free(config);
+    }
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,1013 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ * Copyright (C) 2021 Slava Monich <slava.monich@jolla.com>
+ *
+ * You may use this file under the terms of BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "binder_nfc_failover.h"
+#include "binder_nfc_record.h"
+#include "binder_nfc_stats.h"
+
+#include <gutil_macros.h>
+
+/*
+ * Health score is 100 minus the penalty. Penalty points are added for
+ * each failure and leak at a constant rate, so an instance recovers
+ * once it stops failing. Slow writes (average round trip above the
+ * limit) cost a fixed number of points for as long as they stay slow.
+ * Without new writes the average halves every FAILOVER_RTT_HALF_LIFE
+ * seconds, so an instance that is not in use gets another chance and
+ * is measured again.
+ */
+#define FAILOVER_SCORE_MAX          (100)
+#define FAILOVER_PENALTY_CALL       (10)    /* Failed write or open */
+#define FAILOVER_PENALTY_ERROR      (25)    /* HAL_NFC_EVT_ERROR */
+#define FAILOVER_PENALTY_WATCHDOG   (30)    /* Call taking too long */
+#define FAILOVER_PENALTY_RTT        (30)    /* Slow writes */
+#define FAILOVER_LEAK_PER_SEC       (10)
+#define FAILOVER_RTT_HALF_LIFE      (10)
+
+typedef struct binder_nfc_failover BinderNfcFailover;
+
+typedef struct binder_nfc_failover_member {
+    BinderNfcFailover* failover;
+    BinderNfcTransportClient client;
+    BinderNfcTransport* transport;
+    char* instance;
+    guint rank;
+    gboolean open;
+    guint penalty;
+    gint64 penalty_time;
+    guint rtt_usec;
+    gint64 rtt_time;
+} BinderNfcFailoverMember;
+
+typedef struct binder_nfc_failover_call {
+    BinderNfcFailover* self;
+    BinderNfcFailoverMember* member;    /* NULL for local calls */
+    BINDER_NFC_CALL code;
+    gulong id;
+    gulong inner_id;
+    guint local_id;
+    gint64 start;
+    gboolean tripped;
+    BinderNfcTransportReplyFunc reply;
+    GDestroyNotify destroy;
+    void* user_data;
+} BinderNfcFailoverCall;
+
+struct binder_nfc_failover {
+    BinderNfcTransport transport;
+    BinderNfcTransportClient* client;
+    GPtrArray* members;                 /* Sorted by rank */
+    BinderNfcFailoverMember* active;
+    GHashTable* calls;
+    gulong last_id;
+    guint watchdog_id;
+    guint watchdog_ms;
+    guint threshold;
+    guint max_rtt_usec;
+    gint64 failover_start;
+    gboolean reopen_pending;
+    BinderNfcFailoverLostFunc lost;
+    void* user_data;
+};
+
+static inline
+BinderNfcFailover*
+binder_nfc_failover_cast(
+    BinderNfcTransport* transport)
+{
+    return G_CAST(transport, BinderNfcFailover, transport);
+}
+
+/*==========================================================================*
+ * Health
+ *==========================================================================*/
+
+static
+guint
+binder_nfc_failover_score(
+    BinderNfcFailover* self,
+    BinderNfcFailoverMember* member,
+    gint64 now)
+{
+    guint penalty;
+
+    if (member->penalty) {
+        const gint64 leak = (now - member->penalty_time) *
+            FAILOVER_LEAK_PER_SEC / G_USEC_PER_SEC;
+
+        if (leak >= member->penalty) {
+            member->penalty = 0;
+            member->penalty_time = now;
+        } else if (leak > 0) {
+            /* Keep the remainder, frequent updates still leak */
+            member->penalty -= leak;
+            member->penalty_time += leak * G_USEC_PER_SEC /
+                FAILOVER_LEAK_PER_SEC;
+        }
+    } else {
+        member->penalty_time = now;
+    }
+
+    if (member->rtt_usec) {
+        const gint64 halves = (now - member->rtt_time) /
+            (FAILOVER_RTT_HALF_LIFE * G_USEC_PER_SEC);
+
+        if (halves >= 32) {
+            member->rtt_usec = 0;
+        } else if (halves > 0) {
+            member->rtt_usec >>= halves;
+            member->rtt_time += halves * FAILOVER_RTT_HALF_LIFE *
+                G_USEC_PER_SEC;
+        }
+    }
+
+    penalty = member->penalty;
+    if (self->max_rtt_usec && member->rtt_usec > self->max_rtt_usec) {
+        penalty += FAILOVER_PENALTY_RTT;
+    }
+    return (penalty < FAILOVER_SCORE_MAX) ? (FAILOVER_SCORE_MAX - penalty) : 0;
+}
+
+static
+BinderNfcFailoverMember*
+binder_nfc_failover_best(
+    BinderNfcFailover* self,
+    gint64 now)
+{
+    BinderNfcFailoverMember* best = NULL;
+    guint best_score = 0;
+    guint i;
+
+    /* Highest ranked healthy one or the least unhealthy one */
+    for (i = 0; i < self->members->len; i++) {
+        BinderNfcFailoverMember* member = self->members->pdata[i];
+        const guint score = binder_nfc_failover_score(self, member, now);
+
+        if (score >= self->threshold) {
+            return member;
+        } else if (!best || score > best_score) {
+            best = member;
+            best_score = score;
+        }
+    }
+    return best;
+}
+
+static
+void
+binder_nfc_failover_start(
+    BinderNfcFailover* self,
+    gint64 now)
+{
+    BinderNfcTransportClient* client = self->client;
+
+    /* The adapter reopens the HAL, the next open() picks the best one */
+    if (!self->failover_start) {
+        self->failover_start = now;
+    }
+    self->reopen_pending = TRUE;
+    if (client) {
+        client->fn->event(client, BINDER_NFC_TRANSPORT_EVT_REOPEN,
+            HAL_NFC_STATUS_OK);
+    }
+}
+
+static
+void
+binder_nfc_failover_check(
+    BinderNfcFailover* self)
+{
+    BinderNfcFailoverMember* active = self->active;
+
+    if (active && active->open && !self->reopen_pending) {
+        const gint64 now = g_get_monotonic_time();
+        const guint score = binder_nfc_failover_score(self, active, now);
+
+        if (score < self->threshold) {
+            BinderNfcFailoverMember* best = binder_nfc_failover_best(self,
+                now);
+
+            if (best != active) {
+                const guint best_score = binder_nfc_failover_score(self,
+                    best, now);
+
+                if (best_score >= self->threshold) {
+                    GINFO("Failing over from %s (score %u) to %s (score %u)",
+                        active->instance, score, best->instance, best_score);
+                    binder_nfc_failover_start(self, now);
+                }
+            }
+        }
+    }
+}
+
+static
+void
+binder_nfc_failover_penalize(
+    BinderNfcFailover* self,
+    BinderNfcFailoverMember* member,
+    guint points,
+    const char* reason)
+{
+    const gint64 now = g_get_monotonic_time();
+
+    /* Leak what has leaked so far before adding more */
+    binder_nfc_failover_score(self, member, now);
+    member->penalty += points;
+    GDEBUG("%s: %s, score %u", member->instance, reason,
+        binder_nfc_failover_score(self, member, now));
+    if (member == self->active) {
+        binder_nfc_failover_check(self);
+    }
+}
+
+static
+void
+binder_nfc_failover_done(
+    BinderNfcFailover* self)
+{
+    const gint64 usec = g_get_monotonic_time() - self->failover_start;
+
+    GINFO("Failover to %s took %u us", self->active->instance, (guint)usec);
+    self->failover_start = 0;
+    binder_nfc_stats_failover(usec);
+}
+
+static
+void
+binder_nfc_failover_abandon(
+    BinderNfcFailover* self,
+    const char* reason)
+{
+    if (self->failover_start) {
+        GWARN("Failover abandoned, %s", reason);
+        self->failover_start = 0;
+    }
+    self->reopen_pending = FALSE;
+}
+
+/*==========================================================================*
+ * Calls
+ *==========================================================================*/
+
+static
+void
+binder_nfc_failover_call_free(
+    gpointer data)
+{
+    BinderNfcFailoverCall* call = data;
+
+    if (call->id) {
+        g_hash_table_remove(call->self->calls, GSIZE_TO_POINTER(call->id));
+    }
+    if (call->destroy) {
+        call->destroy(call->user_data);
+    }
+    g_slice_free1(sizeof(*call), call);
+}
+
+static
+BinderNfcFailoverCall*
+binder_nfc_failover_call_new(
+    BinderNfcFailover* self,
+    BinderNfcFailoverMember* member,
+    BINDER_NFC_CALL code,
+    BinderNfcTransportReplyFunc reply,
+    GDestroyNotify destroy,
+    void* user_data)
+{
+    BinderNfcFailoverCall* call = g_slice_new0(BinderNfcFailoverCall);
+
+    call->self = self;
+    call->member = member;
+    call->code = code;
+    call->start = g_get_monotonic_time();
+    call->reply = reply;
+    call->destroy = destroy;
+    call->user_data = user_data;
+    return call;
+}
+
+static
+gboolean
+binder_nfc_failover_watchdog(
+    gpointer user_data)
+{
+    BinderNfcFailover* self = user_data;
+    const gint64 now = g_get_monotonic_time();
+    const gint64 limit = ((gint64)self->watchdog_ms) * 1000;
+    GSList* tripped = NULL;
+    GSList* l;
+    GHashTableIter it;
+    gpointer value;
+
+    g_hash_table_iter_init(&it, self->calls);
+    while (g_hash_table_iter_next(&it, NULL, &value)) {
+        BinderNfcFailoverCall* call = value;
+
+        if (call->member && !call->tripped && (now - call->start) > limit) {
+            GWARN("%s: %s is taking too long", call->member->instance,
+                binder_nfc_call_name(call->code));
+            call->tripped = TRUE;
+            tripped = g_slist_prepend(tripped, call->member);
+        }
+    }
+
+    /* Penalties may trigger failover, don't do that while iterating */
+    for (l = tripped; l; l = l->next) {
+        binder_nfc_failover_penalize(self, l->data,
+            FAILOVER_PENALTY_WATCHDOG, "watchdog");
+    }
+    g_slist_free(tripped);
+
+    if (g_hash_table_size(self->calls)) {
+        return G_SOURCE_CONTINUE;
+    } else {
+        self->watchdog_id = 0;
+        return G_SOURCE_REMOVE;
+    }
+}
+
+static
+gulong
+binder_nfc_failover_call_started(
+    BinderNfcFailover* self,
+    BinderNfcFailoverMember* member,
+    BinderNfcFailoverCall* call,
+    gulong inner_id)
+{
+    if (inner_id) {
+        /* Member ids may collide, hand out our own */
+        if (!++self->last_id) {
+            self->last_id++;
+        }
+        call->id = self->last_id;
+        call->inner_id = inner_id;
+        g_hash_table_insert(self->calls, GSIZE_TO_POINTER(call->id), call);
+        if (!self->watchdog_id && self->watchdog_ms) {
+            self->watchdog_id = g_timeout_add(MAX(self->watchdog_ms / 2, 1),
+                binder_nfc_failover_watchdog, self);
+        }
+        return call->id;
+    } else {
+        /* The call has already been deallocated */
+        binder_nfc_failover_penalize(self, member, FAILOVER_PENALTY_CALL,
+            "call failed");
+        return 0;
+    }
+}
+
+static
+void
+binder_nfc_failover_reply(
+    BinderNfcTransport* inner,
+    int result,
+    void* user_data)
+{
+    BinderNfcFailoverCall* call = user_data;
+    BinderNfcFailover* self = call->self;
+    BinderNfcFailoverMember* member = call->member;
+    const gint64 now = g_get_monotonic_time();
+    const guint rtt = (guint)(now - call->start);
+
+    switch (call->code) {
+    case BINDER_NFC_CALL_WRITE:
+        /* Apply the decay (if any) before adding the new sample */
+        binder_nfc_failover_score(self, member, now);
+        member->rtt_usec = member->rtt_usec ?
+            ((7 * member->rtt_usec + rtt) / 8) : rtt;
+        member->rtt_time = now;
+        if (result) {
+            binder_nfc_failover_penalize(self, member, FAILOVER_PENALTY_CALL,
+                "write failed");
+        } else if (self->max_rtt_usec && rtt > self->max_rtt_usec) {
+            /* May have pushed the average over the limit */
+            binder_nfc_failover_check(self);
+        }
+        break;
+    case BINDER_NFC_CALL_OPEN:
+        if (result) {
+            member->open = FALSE;
+            if (member == self->active) {
+                binder_nfc_failover_abandon(self, "open failed");
+            }
+            binder_nfc_failover_penalize(self, member, FAILOVER_PENALTY_CALL,
+                "open failed");
+        }
+        break;
+    case BINDER_NFC_CALL_CLOSE:
+        member->open = FALSE;
+        break;
+    default:
+        break;
+    }
+    if (call->reply) {
+        call->reply(&self->transport, result, call->user_data);
+    }
+}
+
+static
+gulong
+binder_nfc_failover_forward(
+    BinderNfcFailover* self,
+    BinderNfcFailoverMember* member,
+    BINDER_NFC_CALL code,
+    const void* data,
+    guint len,
+    BinderNfcTransportReplyFunc reply,
+    GDestroyNotify destroy,
+    void* user_data)
+{
+    BinderNfcTransport* inner = member->transport;
+    const BinderNfcTransportFunctions* fn = inner->fn;
+    BinderNfcFailoverCall* call = binder_nfc_failover_call_new(self, member,
+        code, reply, destroy, user_data);
+    BinderNfcTransportReplyFunc inner_reply = binder_nfc_failover_reply;
+    GDestroyNotify inner_destroy = binder_nfc_failover_call_free;
+    gulong id = 0;
+
+    switch (code) {
+    case BINDER_NFC_CALL_OPEN:
+        id = fn->open(inner, inner_reply, inner_destroy, call);
+        break;
+    case BINDER_NFC_CALL_WRITE:
+        id = fn->write(inner, data, len, inner_reply, inner_destroy, call);
+        break;
+    case BINDER_NFC_CALL_CLOSE:
+        id = fn->close(inner, inner_reply, inner_destroy, call);
+        break;
+    case BINDER_NFC_CALL_CORE_INITIALIZED:
+        id = fn->core_initialized(inner, inner_reply, inner_destroy, call);
+        break;
+    case BINDER_NFC_CALL_PREDISCOVER:
+        id = fn->prediscover(inner, inner_reply, inner_destroy, call);
+        break;
+    case BINDER_NFC_CALL_POWER_CYCLE:
+        id = fn->power_cycle(inner, inner_reply, inner_destroy, call);
+        break;
+    case BINDER_NFC_CALL_CONTROL_GRANTED:
+        id = fn->control_granted(inner, inner_reply, inner_destroy, call);
+        break;
+    case BINDER_NFC_CALL_COUNT:
+        GASSERT(FALSE);
+        binder_nfc_failover_call_free(call);
+        return 0;
+    }
+    return binder_nfc_failover_call_started(self, member, call, id);
+}
+
+static
+gulong
+binder_nfc_failover_forward_active(
+    BinderNfcTransport* transport,
+    BINDER_NFC_CALL code,
+    BinderNfcTransportReplyFunc reply,
+    GDestroyNotify destroy,
+    void* user_data)
+{
+    BinderNfcFailover* self = binder_nfc_failover_cast(transport);
+
+    if (self->active) {
+        return binder_nfc_failover_forward(self, self->active, code, NULL, 0,
+            reply, destroy, user_data);
+    } else {
+        if (destroy) {
+            destroy(user_data);
+        }
+        return 0;
+    }
+}
+
+static
+gboolean
+binder_nfc_failover_local_close_done(
+    gpointer user_data)
+{
+    BinderNfcFailoverCall* call = user_data;
+    BinderNfcFailover* self = call->self;
+    BinderNfcTransportClient* client = self->client;
+
+    /* Nothing was open (the instance is gone), pretend it went well */
+    call->local_id = 0;
+    if (client) {
+        client->fn->event(client, HAL_NFC_EVT_CLOSE_CPLT, HAL_NFC_STATUS_OK);
+    }
+    if (call->reply) {
+        call->reply(&self->transport, 0, call->user_data);
+    }
+    binder_nfc_failover_call_free(call);
+    return G_SOURCE_REMOVE;
+}
+
+static
+void
+binder_nfc_failover_fail_calls(
+    BinderNfcFailover* self,
+    BinderNfcFailoverMember* member)
+{
+    GHashTableIter it;
+    gpointer key, value;
+    GSList* ids = NULL;
+    GSList* l;
+
+    /* Replies may start or cancel other calls, collect the ids first */
+    g_hash_table_iter_init(&it, self->calls);
+    while (g_hash_table_iter_next(&it, &key, &value)) {
+        BinderNfcFailoverCall* call = value;
+
+        if (call->member == member) {
+            ids = g_slist_prepend(ids, key);
+        }
+    }
+
+    for (l = ids; l; l = l->next) {
+        BinderNfcFailoverCall* call = g_hash_table_lookup(self->calls,
+            l->data);
+
+        if (call) {
+            BinderNfcTransportReplyFunc reply = call->reply;
+            BinderNfcTransport* inner = member->transport;
+
+            /* These are never going to complete */
+            call->reply = NULL;
+            if (reply) {
+                reply(&self->transport, BINDER_NFC_TRANSPORT_FAILED,
+                    call->user_data);
+            }
+            if (g_hash_table_lookup(self->calls, l->data) == call) {
+                inner->fn->cancel(inner, call->inner_id);
+            }
+        }
+    }
+    g_slist_free(ids);
+}
+
+/*==========================================================================*
+ * Members
+ *==========================================================================*/
+
+static
+void
+binder_nfc_failover_member_free(
+    BinderNfcFailoverMember* member)
+{
+    BinderNfcTransport* transport = member->transport;
+
+    transport->fn->set_client(transport, NULL);
+    binder_nfc_transport_free(transport);
+    g_free(member->instance);
+    g_slice_free1(sizeof(*member), member);
+}
+
+static
+void
+binder_nfc_failover_member_event(
+    BinderNfcTransportClient* member_client,
+    guint event,
+    guint status)
+{
+    BinderNfcFailoverMember* member = G_CAST(member_client,
+        BinderNfcFailoverMember, client);
+    BinderNfcFailover* self = member->failover;
+    BinderNfcTransportClient* client = self->client;
+
+    if (event == HAL_NFC_EVT_ERROR) {
+        binder_nfc_failover_penalize(self, member, FAILOVER_PENALTY_ERROR,
+            "error event");
+        if (self->reopen_pending) {
+            /* The adapter has already been told to reopen the HAL */
+            return;
+        }
+    }
+    if (member == self->active) {
+        if (event == HAL_NFC_EVT_OPEN_CPLT && self->failover_start) {
+            binder_nfc_failover_done(self);
+        }
+        if (client) {
+            client->fn->event(client, event, status);
+        }
+    } else {
+        GDEBUG("%s: dropping event %u", member->instance, event);
+    }
+}
+
+static
+void
+binder_nfc_failover_member_data(
+    BinderNfcTransportClient* member_client,
+    const void* data,
+    guint len)
+{
+    BinderNfcFailoverMember* member = G_CAST(member_client,
+        BinderNfcFailoverMember, client);
+    BinderNfcFailover* self = member->failover;
+    BinderNfcTransportClient* client = self->client;
+
+    if (member == self->active && client) {
+        client->fn->data(client, data, len);
+    }
+}
+
+static
+void
+binder_nfc_failover_member_death(
+    BinderNfcTransportClient* member_client)
+{
+    BinderNfcFailoverMember* member = G_CAST(member_client,
+        BinderNfcFailoverMember, client);
+    BinderNfcFailover* self = member->failover;
+    BinderNfcTransportClient* client = self->client;
+    const gboolean was_active = (member == self->active);
+    const gboolean was_open = member->open;
+
+    GWARN("%s has died", member->instance);
+    if (was_active) {
+        self->active = NULL;
+    }
+    binder_nfc_failover_fail_calls(self, member);
+    g_ptr_array_remove(self->members, member);
+    if (self->lost) {
+        self->lost(&self->transport, member->instance, self->user_data);
+    }
+    binder_nfc_failover_member_free(member);
+
+    if (!self->members->len) {
+        /* Nothing left, this may deallocate the whole thing */
+        if (client) {
+            client->fn->death(client);
+        }
+    } else if (was_active) {
+        const gint64 now = g_get_monotonic_time();
+
+        self->active = binder_nfc_failover_best(self, now);
+        if (was_open) {
+            GINFO("Failing over to %s", self->active->instance);
+            binder_nfc_failover_start(self, now);
+        }
+    }
+}
+
+/*==========================================================================*
+ * Transport
+ *==========================================================================*/
+
+static
+void
+binder_nfc_failover_set_client(
+    BinderNfcTransport* transport,
+    BinderNfcTransportClient* client)
+{
+    binder_nfc_failover_cast(transport)->client = client;
+}
+
+static
+gulong
+binder_nfc_failover_open(
+    BinderNfcTransport* transport,
+    BinderNfcTransportReplyFunc reply,
+    GDestroyNotify destroy,
+    void* user_data)
+{
+    BinderNfcFailover* self = binder_nfc_failover_cast(transport);
+    BinderNfcFailoverMember* member =
+        binder_nfc_failover_best(self, g_get_monotonic_time());
+
+    /* This is the reopen (if one was requested) */
+    self->reopen_pending = FALSE;
+    if (member) {
+        gulong id;
+
+        if (self->active != member) {
+            GINFO("Using %s", member->instance);
+            self->active = member;
+        }
+        member->open = TRUE;
+        id = binder_nfc_failover_forward(self, member, BINDER_NFC_CALL_OPEN,
+            NULL, 0, reply, destroy, user_data);
+        if (!id) {
+            member->open = FALSE;
+            binder_nfc_failover_abandon(self, "open failed");
+        }
+        return id;
+    } else {
+        binder_nfc_failover_abandon(self, "no instances");
+        if (destroy) {
+            destroy(user_data);
+        }
+        return 0;
+    }
+}
+
+static
+gulong
+binder_nfc_failover_write(
+    BinderNfcTransport* transport,
+    const void* data,
+    guint len,
+    BinderNfcTransportReplyFunc reply,
+    GDestroyNotify destroy,
+    void* user_data)
+{
+    BinderNfcFailover* self = binder_nfc_failover_cast(transport);
+
+    if (self->active) {
+        return binder_nfc_failover_forward(self, self->active,
+            BINDER_NFC_CALL_WRITE, data, len, reply, destroy, user_data);
+    } else {
+        if (destroy) {
+            destroy(user_data);
+        }
+        return 0;
+    }
+}
+
+static
+gulong
+binder_nfc_failover_close(
+    BinderNfcTransport* transport,
+    BinderNfcTransportReplyFunc reply,
+    GDestroyNotify destroy,
+    void* user_data)
+{
+    BinderNfcFailover* self = binder_nfc_failover_cast(transport);
+    BinderNfcFailoverMember* active = self->active;
+
+    if (!self->reopen_pending) {
+        /* Closing for good, not on the way to another instance */
+        binder_nfc_failover_abandon(self, "HAL closed");
+    }
+    if (active && active->open) {
+        return binder_nfc_failover_forward(self, active,
+            BINDER_NFC_CALL_CLOSE, NULL, 0, reply, destroy, user_data);
+    } else {
+        BinderNfcFailoverCall* call = binder_nfc_failover_call_new(self,
+            NULL, BINDER_NFC_CALL_CLOSE, reply, destroy, user_data);
+
+        /* Replies never come before the call returns */
+        if (!++self->last_id) {
+            self->last_id++;
+        }
+        call->id = self->last_id;
+        call->local_id = g_idle_add(binder_nfc_failover_local_close_done,
+            call);
+        g_hash_table_insert(self->calls, GSIZE_TO_POINTER(call->id), call);
+        return call->id;
+    }
+}
+
+static
+gulong
+binder_nfc_failover_core_initialized(
+    BinderNfcTransport* transport,
+    BinderNfcTransportReplyFunc reply,
+    GDestroyNotify destroy,
+    void* user_data)
+{
+    return binder_nfc_failover_forward_active(transport,
+        BINDER_NFC_CALL_CORE_INITIALIZED, reply, destroy, user_data);
+}
+
+static
+gulong
+binder_nfc_failover_prediscover(
+    BinderNfcTransport* transport,
+    BinderNfcTransportReplyFunc reply,
+    GDestroyNotify destroy,
+    void* user_data)
+{
+    return binder_nfc_failover_forward_active(transport,
+        BINDER_NFC_CALL_PREDISCOVER, reply, destroy, user_data);
+}
+
+static
+gulong
+binder_nfc_failover_power_cycle(
+    BinderNfcTransport* transport,
+    BinderNfcTransportReplyFunc reply,
+    GDestroyNotify destroy,
+    void* user_data)
+{
+    return binder_nfc_failover_forward_active(transport,
+        BINDER_NFC_CALL_POWER_CYCLE, reply, destroy, user_data);
+}
+
+static
+gulong
+binder_nfc_failover_control_granted(
+    BinderNfcTransport* transport,
+    BinderNfcTransportReplyFunc reply,
+    GDestroyNotify destroy,
+    void* user_data)
+{
+    return binder_nfc_failover_forward_active(transport,
+        BINDER_NFC_CALL_CONTROL_GRANTED, reply, destroy, user_data);
+}
+
+static
+void
+binder_nfc_failover_cancel(
+    BinderNfcTransport* transport,
+    gulong id)
+{
+    BinderNfcFailover* self = binder_nfc_failover_cast(transport);
+    BinderNfcFailoverCall* call = g_hash_table_lookup(self->calls,
+        GSIZE_TO_POINTER(id));
+
+    if (call) {
+        if (call->member) {
+            BinderNfcTransport* inner = call->member->transport;
+
+            inner->fn->cancel(inner, call->inner_id);
+        } else {
+            g_source_remove(call->local_id);
+            binder_nfc_failover_call_free(call);
+        }
+    }
+}
+
+static
+void
+binder_nfc_failover_release(
+    BinderNfcTransport* transport)
+{
+    BinderNfcFailover* self = binder_nfc_failover_cast(transport);
+
+    /* The HAL isn't going to be reopened, failover is off */
+    self->failover_start = 0;
+    self->reopen_pending = FALSE;
+    if (self->active) {
+        BinderNfcTransport* inner = self->active->transport;
+
+        inner->fn->release(inner);
+    }
+}
+
+static
+gboolean
+binder_nfc_failover_shutdown(
+    BinderNfcTransport* transport)
+{
+    BinderNfcFailover* self = binder_nfc_failover_cast(transport);
+    BinderNfcFailoverMember* active = self->active;
+
+    if (active && active->open &&
+        binder_nfc_transport_shutdown(active->transport)) {
+        active->open = FALSE;
+        return TRUE;
+    }
+    return FALSE;
+}
+
+static
+void
+binder_nfc_failover_free(
+    BinderNfcTransport* transport)
+{
+    BinderNfcFailover* self = binder_nfc_failover_cast(transport);
+    GHashTableIter it;
+    gpointer value;
+
+    if (self->watchdog_id) {
+        g_source_remove(self->watchdog_id);
+    }
+
+    /* Freeing the members cancels the calls forwarded to them */
+    self->active = NULL;
+    while (self->members->len) {
+        binder_nfc_failover_member_free(g_ptr_array_remove_index
+            (self->members, self->members->len - 1));
+    }
+    g_ptr_array_free(self->members, TRUE);
+
+    /* Only local calls may be left */
+    g_hash_table_iter_init(&it, self->calls);
+    while (g_hash_table_iter_next(&it, NULL, &value)) {
+        BinderNfcFailoverCall* call = value;
+
+        g_hash_table_iter_steal(&it);
+        if (call->local_id) {
+            g_source_remove(call->local_id);
+        }
+        call->id = 0;
+        binder_nfc_failover_call_free(call);
+    }
+    g_hash_table_destroy(self->calls);
+    g_free(self);
+}
+
+/*==========================================================================*
+ * Interface
+ *==========================================================================*/
+
+BinderNfcTransport*
+binder_nfc_failover_new(
+    const BinderNfcConfig* config,
+    BinderNfcFailoverLostFunc lost,
+    void* user_data)
+{
+    static const BinderNfcTransportFunctions failover_fn = {
+        .set_client = binder_nfc_failover_set_client,
+        .open = binder_nfc_failover_open,
+        .write = binder_nfc_failover_write,
+        .close = binder_nfc_failover_close,
+        .core_initialized = binder_nfc_failover_core_initialized,
+        .prediscover = binder_nfc_failover_prediscover,
+        .power_cycle = binder_nfc_failover_power_cycle,
+        .control_granted = binder_nfc_failover_control_granted,
+        .cancel = binder_nfc_failover_cancel,
+        .release = binder_nfc_failover_release,
+        .free = binder_nfc_failover_free,
+        .shutdown = binder_nfc_failover_shutdown
+    };
+    BinderNfcFailover* self = g_new0(BinderNfcFailover, 1);
+    BinderNfcTransport* transport = &self->transport;
+
+    self->members = g_ptr_array_new();
+    self->calls = g_hash_table_new(g_direct_hash, g_direct_equal);
+    self->watchdog_ms = config->failover_watchdog_ms;
+    self->threshold = MIN(config->failover_threshold, FAILOVER_SCORE_MAX);
+    self->max_rtt_usec = config->failover_max_rtt_us;
+    self->lost = lost;
+    self->user_data = user_data;
+    transport->fn = &failover_fn;
+    transport->name = BINDER_NFC_FAILOVER_NAME;
+    transport->description = "INfc failover group";
+    return transport;
+}
+
+void
+binder_nfc_failover_add(
+    BinderNfcTransport* transport,
+    BinderNfcTransport* inner,
+    const char* instance,
+    guint rank)
+{
+    static const BinderNfcTransportClientFunctions member_client_fn = {
+        .event = binder_nfc_failover_member_event,
+        .data = binder_nfc_failover_member_data,
+        .death = binder_nfc_failover_member_death
+    };
+
+    if (G_LIKELY(transport) && G_LIKELY(inner)) {
+        BinderNfcFailover* self = binder_nfc_failover_cast(transport);
+        BinderNfcFailoverMember* member =
+            g_slice_new0(BinderNfcFailoverMember);
+        guint i;
+
+        member->failover = self;
+        member->client.fn = &member_client_fn;
+        member->transport = inner;
+        member->instance = g_strdup(instance);
+        member->rank = rank;
+        member->penalty_time = g_get_monotonic_time();
+
+        /* Keep the members sorted by rank */
+        for (i = 0; i < self->members->len; i++) {
+            const BinderNfcFailoverMember* other = self->members->pdata[i];
+
+            if (other->rank > rank) {
+                break;
+            }
+        }
+        g_ptr_array_insert(self->members, i, member);
+        inner->fn->set_client(inner, &member->client);
+        GINFO("%s joined the failover group (rank %u)", instance, rank);
+    }
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ * Copyright (C) 2021 Slava Monich <slava.monich@jolla.com>
+ *
+ * You may use this file under the terms of BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef BINDER_NFC_FAILOVER_H
+#define BINDER_NFC_FAILOVER_H
+
+/*
+ * Failover group, one logical transport backed by a ranked set of HAL
+ * instances. Each instance gets a health score from its write errors,
+ * watchdog trips (calls taking too long), ERROR events and round trip
+ * time. The HAL session is opened on the highest ranked healthy
+ * instance. When the instance in use becomes unhealthy and a healthy
+ * one is available, BINDER_NFC_TRANSPORT_EVT_REOPEN makes the adapter
+ * reopen the HAL and the session moves to the other instance.
+ */
+
+#include "binder_nfc_transport.h"
+
+#define BINDER_NFC_FAILOVER_NAME "failover"
+
+/* Invoked when a member dies, after it has been removed from the group */
+typedef
+void
+(*BinderNfcFailoverLostFunc)(
+    BinderNfcTransport* failover,
+    const char* instance,
+    void* user_data);
+
+BinderNfcTransport*
+binder_nfc_failover_new(
+    const BinderNfcConfig* config,
+    BinderNfcFailoverLostFunc lost,
+    void* user_data);
+
+/* Takes the ownership of the member transport. Lower rank is better */
+void
+binder_nfc_failover_add(
+    BinderNfcTransport* failover,
+    BinderNfcTransport* member,
+    const char* instance,
+    guint rank);
+
+#endif /* BINDER_NFC_FAILOVER_H */
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -31,6 +31,13 @@
  */
 
 #include "binder_nfc.h"
+#include "binder_nfc_bench.h"
+#include "binder_nfc_capture.h"
+#include "binder_nfc_failover.h"
+#include "binder_nfc_record.h"
+#include "binder_nfc_stats.h"
+#include "binder_nfc_stress.h"
+#include "binder_nfc_transport.h"
 #include "plugin.h"
 
 #include <nfc_adapter.h>
@@ -43,61 +50,417 @@
 
 #include <gutil_misc.h>
 
+#include <errno.h>
+#include <string.h>
+
 GLOG_MODULE_DEFINE("binder");
 
+typedef struct binder_nfc_plugin BinderNfcPlugin;
+
+/* Last requested power state, one file per instance in the cache dir */
+#define POWER_FILE_PREFIX   "power."
+#define POWER_FILE_FAILOVER "failover.power"
+#define POWER_GROUP         "Power"
+#define POWER_REQUESTED     "Requested"
+
+/*
+ * Registry entry, one per instance. It's created as soon as the
+ * instance is discovered (which prevents duplicate lookups) and gets
+ * the adapter when the HAL is connected. The adapter's death handler
+ * gets the entry, so it doesn't have to look for it. Instances which
+ * belong to the failover group never get their own adapters, the group
+ * has its own entry (and the adapter) which is kept outside of the
+ * registry, so that it can't clash with any instance name.
+ */
 typedef struct binder_nfc_plugin_adapter_entry {
-    gulong death_id;
+    BinderNfcPlugin* plugin;
+    char* instance;
+    BinderNfcTransportConnect* connect;
     NfcAdapter* adapter;
+    BinderNfcTransport* failover;   /* Owned by the adapter */
+    gulong death_id;
+    gulong power_id;
+    gboolean power_requested;
 } BinderNfcPluginEntry;
 
 typedef NfcPluginClass BinderNfcPluginClass;
-typedef struct binder_nfc_plugin {
+struct binder_nfc_plugin {
     NfcPlugin parent;
     GBinderServiceManager* sm;
     NfcManager* manager;
+    BinderNfcConfig* config;
+    BinderNfcCapture* capture;
+    BinderNfcBench* bench;
+    BinderNfcStress* stress;
     GHashTable* adapters;
+    GHashTable* lost;
+    BinderNfcPluginEntry* failover;
+    gboolean failover_lost;
     gulong name_watch_id;
     gulong list_call_id;
-} BinderNfcPlugin;
+};
 
 G_DEFINE_TYPE(BinderNfcPlugin, binder_nfc_plugin, NFC_TYPE_PLUGIN)
 #define BINDER_TYPE_PLUGIN (binder_nfc_plugin_get_type())
 #define BINDER_NFC_PLUGIN(obj) (G_TYPE_CHECK_INSTANCE_CAST((obj), \
         BINDER_TYPE_PLUGIN, BinderNfcPlugin))
 
+static
+char*
+binder_nfc_plugin_power_file(
+    BinderNfcPluginEntry* entry)
+{
+    BinderNfcPlugin* self = entry->plugin;
+    const char* dir = self->config->prewarm_state_dir;
+    char* name = (entry == self->failover) ? g_strdup(POWER_FILE_FAILOVER) :
+        g_strconcat(POWER_FILE_PREFIX, entry->instance, NULL);
+    char* file = g_build_filename(dir, g_strdelimit(name, "/:", '_'), NULL);
+
+    g_free(name);
+    return file;
+}
+
+static
+gboolean
+binder_nfc_plugin_load_power(
+    BinderNfcPluginEntry* entry)
+{
+    char* file = binder_nfc_plugin_power_file(entry);
+    GKeyFile* k = g_key_file_new();
+    gboolean on = FALSE;
+
+    /* Missing or broken file means that the power wasn't requested */
+    if (g_key_file_load_from_file(k, file, G_KEY_FILE_NONE, NULL)) {
+        on = g_key_file_get_boolean(k, POWER_GROUP, POWER_REQUESTED, NULL);
+    }
+    g_key_file_unref(k);
+    g_free(file);
+    return on;
+}
+
+static
+void
+binder_nfc_plugin_save_power(
+    BinderNfcPluginEntry* entry,
+    gboolean on)
+{
+    char* file = binder_nfc_plugin_power_file(entry);
+    char* dir = g_path_get_dirname(file);
+    GKeyFile* k = g_key_file_new();
+    GError* error = NULL;
+
+    g_key_file_set_boolean(k, POWER_GROUP, POWER_REQUESTED, on);
+    if (g_mkdir_with_parents(dir, 0755) < 0) {
+        GWARN("Failed to create %s: %s", dir, strerror(errno));
+    } else if (g_key_file_save_to_file(k, file, &error)) {
+        GDEBUG("Saved %s", file);
+    } else {
+        GWARN("%s", error->message);
+        g_error_free(error);
+    }
+    g_key_file_unref(k);
+    g_free(dir);
+    g_free(file);
+}
+
+static
+void
+binder_nfc_plugin_adapter_power_requested_proc(
+    NfcAdapter* adapter,
+    void* user_data)
+{
+    BinderNfcPluginEntry* entry = user_data;
+
+    if (entry->power_requested != adapter->power_requested) {
+        entry->power_requested = adapter->power_requested;
+        binder_nfc_plugin_save_power(entry, entry->power_requested);
+    }
+}
+
+static
+void
+binder_nfc_plugin_entry_forget_power(
+    BinderNfcPluginEntry* entry)
+{
+    /* Removal of the adapter is not a user's request to power it off */
+    nfc_adapter_remove_handler(entry->adapter, entry->power_id);
+    entry->power_id = 0;
+}
+
+static
+BinderNfcPluginEntry*
+binder_nfc_plugin_entry_alloc(
+    BinderNfcPlugin* self,
+    const char* instance)
+{
+    BinderNfcPluginEntry* entry = g_slice_new0(BinderNfcPluginEntry);
+
+    entry->plugin = self;
+    entry->instance = g_strdup(instance);
+    return entry;
+}
+
+static
+BinderNfcPluginEntry*
+binder_nfc_plugin_entry_new(
+    BinderNfcPlugin* self,
+    const char* instance)
+{
+    BinderNfcPluginEntry* entry = binder_nfc_plugin_entry_alloc(self,
+        instance);
+
+    g_hash_table_insert(self->adapters, entry->instance, entry);
+    return entry;
+}
+
+static
+void
+binder_nfc_plugin_entry_free(
+    gpointer data)
+{
+    BinderNfcPluginEntry* entry = data;
+
+    binder_nfc_transport_binder_connect_cancel(entry->connect);
+    if (entry->adapter) {
+        nfc_adapter_remove_handler(entry->adapter, entry->death_id);
+        nfc_adapter_remove_handler(entry->adapter, entry->power_id);
+        nfc_adapter_unref(entry->adapter);
+    }
+    g_free(entry->instance);
+    g_slice_free1(sizeof(*entry), entry);
+}
+
+static
+void
+binder_nfc_plugin_entry_remove(
+    BinderNfcPluginEntry* entry)
+{
+    BinderNfcPlugin* self = entry->plugin;
+
+    if (entry == self->failover) {
+        self->failover = NULL;
+        binder_nfc_plugin_entry_free(entry);
+    } else {
+        g_hash_table_remove(self->adapters, entry->instance);
+    }
+}
+
+static
+void
+binder_nfc_plugin_entry_lost(
+    BinderNfcPluginEntry* entry)
+{
+    BinderNfcPlugin* self = entry->plugin;
+
+    if (entry == self->failover) {
+        self->failover_lost = TRUE;
+    } else {
+        g_hash_table_add(self->lost, g_strdup(entry->instance));
+    }
+}
+
+static
+gboolean
+binder_nfc_plugin_entry_found(
+    BinderNfcPluginEntry* entry)
+{
+    BinderNfcPlugin* self = entry->plugin;
+
+    /* Returns TRUE if the entry has been lost before */
+    if (entry == self->failover) {
+        const gboolean lost = self->failover_lost;
+
+        self->failover_lost = FALSE;
+        return lost;
+    } else {
+        return g_hash_table_remove(self->lost, entry->instance);
+    }
+}
+
+static
+void
+binder_nfc_plugin_entry_shutdown(
+    BinderNfcPluginEntry* entry)
+{
+    if (entry->adapter) {
+        /* nfcd is exiting, take the shortest way out */
+        binder_nfc_plugin_entry_forget_power(entry);
+        binder_nfc_adapter_shutdown(entry->adapter);
+        nfc_manager_remove_adapter(entry->plugin->manager,
+            entry->adapter->name);
+    }
+}
+
 static
 void
 binder_nfc_plugin_adapter_death_proc(
     NfcAdapter* adapter,
+    void* user_data)
+{
+    BinderNfcPluginEntry* entry = user_data;
+    BinderNfcPlugin* self = entry->plugin;
+
+    GWARN("NFC adapter \"%s\" has disappeared", entry->instance);
+    binder_nfc_plugin_entry_lost(entry);
+    binder_nfc_plugin_entry_forget_power(entry);
+
+    /* Removing the entry drops its reference, we are still using it */
+    nfc_adapter_ref(adapter);
+    nfc_manager_remove_adapter(self->manager, adapter->name);
+    binder_nfc_plugin_entry_remove(entry);
+    nfc_adapter_unref(adapter);
+}
+
+static
+gboolean
+binder_nfc_plugin_entry_attach(
+    BinderNfcPluginEntry* entry,
+    BinderNfcTransport* transport)
+{
+    BinderNfcPlugin* self = entry->plugin;
+    const BinderNfcConfig* config = self->config;
+    NfcAdapter* adapter;
+
+    if (transport && config->record_file) {
+        char* file = g_strconcat(config->record_file, ".",
+            transport->name, NULL);
+
+        transport = binder_nfc_transport_recorder_new(transport, file);
+        g_free(file);
+    }
+
+    adapter = binder_nfc_adapter_new(transport, config, self->capture);
+    if (adapter) {
+        GINFO("NFC adapter \"%s\"", entry->instance);
+        if (binder_nfc_plugin_entry_found(entry)) {
+            binder_nfc_stats_reconnect();
+        }
+        entry->adapter = adapter;
+        entry->death_id = binder_nfc_adapter_add_death_handler(adapter,
+            binder_nfc_plugin_adapter_death_proc, entry);
+        if (config->prewarm) {
+            entry->power_requested = binder_nfc_plugin_load_power(entry);
+            if (entry->power_requested) {
+                /* Most likely the manager is going to ask for the power */
+                binder_nfc_adapter_prewarm(adapter,
+                    config->prewarm_timeout_ms);
+            }
+            entry->power_id = nfc_adapter_add_power_requested_handler(
+                adapter, binder_nfc_plugin_adapter_power_requested_proc,
+                entry);
+        }
+        nfc_manager_add_adapter(self->manager, adapter);
+        return TRUE;
+    }
+    return FALSE;
+}
+
+static
+void
+binder_nfc_plugin_add_transport(
+    BinderNfcPlugin* self,
+    BinderNfcTransport* transport)
+{
+    if (transport) {
+        BinderNfcPluginEntry* entry = binder_nfc_plugin_entry_new(self,
+            transport->name);
+
+        if (!binder_nfc_plugin_entry_attach(entry, transport)) {
+            g_hash_table_remove(self->adapters, entry->instance);
+        }
+    }
+}
+
+static
+int
+binder_nfc_plugin_failover_rank(
+    BinderNfcPlugin* self,
+    const char* instance)
+{
+    char** list = self->config->failover_instances;
+
+    if (list) {
+        int i;
+
+        for (i = 0; list[i]; i++) {
+            if (!strcmp(list[i], instance)) {
+                return i;
+            }
+        }
+    }
+    return -1;
+}
+
+static
+void
+binder_nfc_plugin_failover_lost(
+    BinderNfcTransport* failover,
+    const char* instance,
     void* plugin)
 {
     BinderNfcPlugin* self = BINDER_NFC_PLUGIN(plugin);
-    GHashTableIter it;
-    gpointer key, value;
 
-    g_hash_table_iter_init(&it, self->adapters);
-    while (g_hash_table_iter_next(&it, &key, &value)) {
-        BinderNfcPluginEntry* entry = value;
+    /* Let the next registration notification reconnect it */
+    g_hash_table_add(self->lost, g_strdup(instance));
+    g_hash_table_remove(self->adapters, instance);
+}
 
-        if (entry->adapter == value) {
-            GWARN("NFC adapter \"%s\" has disappeared", (char*)key);
-            nfc_manager_remove_adapter(self->manager, adapter->name);
-            g_hash_table_iter_remove(&it);
-            break;
+static
+gboolean
+binder_nfc_plugin_failover_attach(
+    BinderNfcPluginEntry* entry,
+    BinderNfcTransport* transport,
+    guint rank)
+{
+    BinderNfcPlugin* self = entry->plugin;
+    BinderNfcPluginEntry* group;
+
+    if (!transport) {
+        return FALSE;
+    }
+
+    group = self->failover;
+    if (group) {
+        if (g_hash_table_remove(self->lost, entry->instance)) {
+            binder_nfc_stats_reconnect();
         }
+        binder_nfc_failover_add(group->failover, transport, entry->instance,
+            rank);
+    } else {
+        BinderNfcTransport* failover = binder_nfc_failover_new(self->config,
+            binder_nfc_plugin_failover_lost, self);
+
+        /* Reappearance of the group is what counts as a reconnect */
+        g_hash_table_remove(self->lost, entry->instance);
+        binder_nfc_failover_add(failover, transport, entry->instance, rank);
+        group = binder_nfc_plugin_entry_alloc(self, failover->name);
+        group->failover = failover;
+        self->failover = group;
+        binder_nfc_plugin_entry_attach(group, failover);
     }
+
+    /* The member entry stays in the registry (without adapter) */
+    return TRUE;
 }
 
 static
 void
-binder_nfc_plugin_adapter_entry_free(
-    gpointer data)
+binder_nfc_plugin_connect_done(
+    BinderNfcTransport* transport,
+    void* user_data)
 {
-    BinderNfcPluginEntry* entry = data;
-
-    nfc_adapter_remove_handler(entry->adapter, entry->death_id);
-    nfc_adapter_unref(entry->adapter);
-    g_free(entry);
+    BinderNfcPluginEntry* entry = user_data;
+    const int rank = binder_nfc_plugin_failover_rank(entry->plugin,
+        entry->instance);
+
+    /* The connect handle is gone by now */
+    entry->connect = NULL;
+    if (!((rank >= 0) ?
+        binder_nfc_plugin_failover_attach(entry, transport, rank) :
+        binder_nfc_plugin_entry_attach(entry, transport))) {
+        /* Let the next registration notification retry it */
+        g_hash_table_remove(entry->plugin->adapters, entry->instance);
+    }
 }
 
 static
@@ -107,17 +470,14 @@ binder_nfc_plugin_add_adapter(
     const char* instance)
 {
     if (instance[0] && !g_hash_table_contains(self->adapters, instance)) {
-        NfcAdapter* adapter = binder_nfc_adapter_new(self->sm, instance);
-
-        if (adapter) {
-            BinderNfcPluginEntry* entry = g_new0(BinderNfcPluginEntry, 1);
-
-            GINFO("NFC adapter \"%s\"", instance);
-            entry->adapter = adapter;
-            entry->death_id = binder_nfc_adapter_add_death_handler(adapter,
-                binder_nfc_plugin_adapter_death_proc, self);
-            g_hash_table_insert(self->adapters, g_strdup(instance), entry);
-            nfc_manager_add_adapter(self->manager, adapter);
+        BinderNfcPluginEntry* entry = binder_nfc_plugin_entry_new(self,
+            instance);
+
+        /* All instances are brought up in parallel */
+        entry->connect = binder_nfc_transport_binder_connect(self->sm,
+            instance, binder_nfc_plugin_connect_done, entry);
+        if (!entry->connect) {
+            g_hash_table_remove(self->adapters, instance);
         }
     }
 }
@@ -163,6 +523,54 @@ binder_nfc_plugin_service_registration_proc(
     }
 }
 
+static
+void
+binder_nfc_plugin_harness_done(
+    BinderNfcPlugin* self,
+    const char* what,
+    gboolean ok)
+{
+    if (ok) {
+        GINFO("%s finished", what);
+        nfc_manager_stop(self->manager, 0);
+    } else {
+        GERR("%s failed", what);
+        nfc_manager_stop(self->manager, 1);
+    }
+}
+
+static
+void
+binder_nfc_plugin_bench_done(
+    BinderNfcBench* bench,
+    gboolean ok,
+    void* plugin)
+{
+    binder_nfc_plugin_harness_done(BINDER_NFC_PLUGIN(plugin), "Benchmark",
+        ok);
+}
+
+static
+void
+binder_nfc_plugin_stress_done(
+    BinderNfcStress* stress,
+    gboolean ok,
+    void* plugin)
+{
+    binder_nfc_plugin_harness_done(BINDER_NFC_PLUGIN(plugin), "Stress test",
+        ok);
+}
+
+static
+void
+binder_nfc_plugin_replay_done(
+    BinderNfcTransport* transport,
+    void* plugin)
+{
+    binder_nfc_plugin_harness_done(BINDER_NFC_PLUGIN(plugin), "Replay",
+        TRUE);
+}
+
 static
 gboolean
 binder_nfc_plugin_start(
@@ -170,11 +578,54 @@ binder_nfc_plugin_start(
     NfcManager* manager)
 {
     BinderNfcPlugin* self = BINDER_NFC_PLUGIN(plugin);
+    const char* file = g_getenv(BINDER_NFC_CONFIG_ENV);
     GASSERT(!self->sm);
 
+    GVERBOSE("Starting");
+    self->config = binder_nfc_config_new(file ? file :
+        BINDER_NFC_CONFIG_FILE);
+    self->capture = binder_nfc_capture_new(self->config);
+    if (self->config->bench) {
+        /* Run the benchmark and exit */
+        self->manager = nfc_manager_ref(manager);
+        self->bench = binder_nfc_bench_new(self->config);
+        return binder_nfc_bench_start(self->bench, manager,
+            binder_nfc_plugin_bench_done, self);
+    } else if (self->config->stress) {
+        /* Run the stress test and exit */
+        self->manager = nfc_manager_ref(manager);
+        self->stress = binder_nfc_stress_new(self->config);
+        return binder_nfc_stress_start(self->stress, manager,
+            binder_nfc_plugin_stress_done, self);
+    } else if (self->config->replay_file) {
+        const BinderNfcConfig* config = self->config;
+        BinderNfcTransport* replay = binder_nfc_transport_replay_new
+            (DEFAULT_INSTANCE, config->replay_file, config->replay_speed);
+
+        /* Recorded session instead of the vendor HAL */
+        GINFO("Replaying NFC HAL session");
+        self->manager = nfc_manager_ref(manager);
+        if (config->replay_exit) {
+            /* Exit when the session is over (e.g. a PGO training run) */
+            binder_nfc_transport_replay_set_done_func(replay,
+                binder_nfc_plugin_replay_done, self);
+        }
+        binder_nfc_plugin_add_transport(self, replay);
+        return TRUE;
+    } else if (self->config->fake_hal) {
+        const BinderNfcConfig* config = self->config;
+
+        /* No hwbinder, no vendor HAL */
+        GINFO("Using fake NFC HAL");
+        self->manager = nfc_manager_ref(manager);
+        binder_nfc_plugin_add_transport(self,
+            binder_nfc_transport_fake_new(DEFAULT_INSTANCE,
+                &config->fake_hal_params, config->fake_hal_script));
+        return TRUE;
+    }
+
     self->sm = gbinder_hwservicemanager_new(NULL);
     if (self->sm) {
-        GVERBOSE("Starting");
         self->manager = nfc_manager_ref(manager);
         self->name_watch_id =
             gbinder_servicemanager_add_registration_handler(self->sm,
@@ -197,17 +648,23 @@ binder_nfc_plugin_stop(
     BinderNfcPlugin* self = BINDER_NFC_PLUGIN(plugin);
 
     GVERBOSE("Stopping");
+    binder_nfc_bench_free(self->bench);
+    binder_nfc_stress_free(self->stress);
+    self->bench = NULL;
+    self->stress = NULL;
     if (self->manager) {
         GHashTableIter it;
         gpointer value;
 
         g_hash_table_iter_init(&it, self->adapters);
         while (g_hash_table_iter_next(&it, NULL, &value)) {
-            BinderNfcPluginEntry* entry = value;
-
-            nfc_manager_remove_adapter(self->manager, entry->adapter->name);
+            binder_nfc_plugin_entry_shutdown(value);
             g_hash_table_iter_remove(&it);
         }
+        if (self->failover) {
+            binder_nfc_plugin_entry_shutdown(self->failover);
+            binder_nfc_plugin_entry_remove(self->failover);
+        }
         nfc_manager_unref(self->manager);
         if (self->list_call_id) {
             gbinder_servicemanager_cancel(self->sm, self->list_call_id);
@@ -226,8 +683,10 @@ void
 binder_nfc_plugin_init(
     BinderNfcPlugin* self)
 {
+    /* Keys are owned by the entries */
     self->adapters = g_hash_table_new_full(g_str_hash, g_str_equal,
-        g_free, binder_nfc_plugin_adapter_entry_free);
+        NULL, binder_nfc_plugin_entry_free);
+    self->lost = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
 }
 
 static
@@ -237,7 +696,15 @@ binder_nfc_plugin_finalize(
 {
     BinderNfcPlugin* self = BINDER_NFC_PLUGIN(object);
 
+    if (self->failover) {
+        binder_nfc_plugin_entry_remove(self->failover);
+    }
     g_hash_table_destroy(self->adapters);
+    g_hash_table_destroy(self->lost);
+    binder_nfc_bench_free(self->bench);
+    binder_nfc_stress_free(self->stress);
+    binder_nfc_capture_unref(self->capture);
+    binder_nfc_config_free(self->config);
     gbinder_servicemanager_remove_handler(self->sm, self->name_watch_id);
     gbinder_servicemanager_cancel(self->sm, self->list_call_id);
     gbinder_servicemanager_unref(self->sm);
@@ -266,6 +733,7 @@ binder_nfc_plugin_create(
 static GLogModule* const binder_nfc_plugin_logs[] = {
     &GLOG_MODULE_NAME,
     &binder_hexdump_log,
+    &binder_capture_log,
     &GBINDER_LOG_MODULE,
     &NCI_LOG_MODULE,
     NULL
@@ -0,0 +1,704 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ * Copyright (C) 2021 Slava Monich <slava.monich@jolla.com>
+ *
+ * You may use this file under the terms of BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "binder_nfc_record.h"
+
+#include <gutil_macros.h>
+
+#include <errno.h>
+#include <stdio.h>
+
+typedef struct binder_nfc_transport_recorder {
+    BinderNfcTransport transport;
+    BinderNfcTransportClient inner_client;
+    BinderNfcTransportClient* client;
+    BinderNfcTransport* inner;
+    FILE* fp;
+    char* file;
+    gint64 start;
+} BinderNfcTransportRecorder;
+
+typedef struct binder_nfc_transport_recorder_call {
+    BinderNfcTransportRecorder* self;
+    gulong id;
+    BinderNfcTransportReplyFunc reply;
+    GDestroyNotify destroy;
+    void* user_data;
+} BinderNfcTransportRecorderCall;
+
+static const char* binder_nfc_call_names[] = {
+    "open",
+    "write",
+    "close",
+    "coreInitialized",
+    "prediscover",
+    "powerCycle",
+    "controlGranted"
+};
+
+G_STATIC_ASSERT(G_N_ELEMENTS(binder_nfc_call_names) == BINDER_NFC_CALL_COUNT);
+
+static inline
+BinderNfcTransportRecorder*
+binder_nfc_transport_recorder_cast(
+    BinderNfcTransport* transport)
+{
+    return G_CAST(transport, BinderNfcTransportRecorder, transport);
+}
+
+/*==========================================================================*
+ * Parser
+ *==========================================================================*/
+
+static
+gboolean
+binder_nfc_record_parse_call(
+    const char* name,
+    BINDER_NFC_CALL* call)
+{
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS(binder_nfc_call_names); i++) {
+        if (!strcmp(name, binder_nfc_call_names[i])) {
+            *call = i;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static
+gboolean
+binder_nfc_record_parse_number(
+    const char* str,
+    gint64* value)
+{
+    char* end = NULL;
+
+    if (str) {
+        errno = 0;
+        *value = g_ascii_strtoll(str, &end, 0);
+        return !errno && end != str && !*end;
+    }
+    return FALSE;
+}
+
+static
+GBytes*
+binder_nfc_record_parse_data(
+    char** tokens)
+{
+    GByteArray* bytes = g_byte_array_new();
+
+    for (; *tokens; tokens++) {
+        const char* tok = *tokens;
+        const int hi = g_ascii_xdigit_value(tok[0]);
+        const int lo = (hi >= 0) ? g_ascii_xdigit_value(tok[1]) : -1;
+
+        if (lo >= 0 && !tok[2]) {
+            const guint8 b = (guint8)((hi << 4) | lo);
+
+            g_byte_array_append(bytes, &b, 1);
+        } else {
+            g_byte_array_free(bytes, TRUE);
+            return NULL;
+        }
+    }
+    return g_byte_array_free_to_bytes(bytes);
+}
+
+static
+void
+binder_nfc_record_entry_free(
+    gpointer data)
+{
+    BinderNfcRecordEntry* entry = data;
+
+    if (entry->data) {
+        g_bytes_unref(entry->data);
+    }
+    g_slice_free1(sizeof(*entry), entry);
+}
+
+static
+BinderNfcRecordEntry*
+binder_nfc_record_parse_line(
+    char** tok,
+    guint n)
+{
+    BinderNfcRecordEntry entry;
+    gint64 v1, v2;
+
+    memset(&entry, 0, sizeof(entry));
+    if (n < 2 || !binder_nfc_record_parse_number(tok[0], &entry.time)) {
+        return NULL;
+    }
+
+    if (!strcmp(tok[1], "call")) {
+        entry.type = BINDER_NFC_RECORD_CALL;
+        if (n < 4 || !binder_nfc_record_parse_call(tok[2], &entry.call) ||
+            !binder_nfc_record_parse_number(tok[3], &v1)) {
+            return NULL;
+        }
+        entry.id = (gulong)v1;
+        if (n > 4 && !(entry.data = binder_nfc_record_parse_data(tok + 4))) {
+            return NULL;
+        }
+    } else if (!strcmp(tok[1], "reply")) {
+        entry.type = BINDER_NFC_RECORD_REPLY;
+        if (n != 4 || !binder_nfc_record_parse_number(tok[2], &v1) ||
+            !binder_nfc_record_parse_number(tok[3], &v2)) {
+            return NULL;
+        }
+        entry.id = (gulong)v1;
+        entry.result = (int)v2;
+    } else if (!strcmp(tok[1], "event")) {
+        entry.type = BINDER_NFC_RECORD_EVENT;
+        if (n != 4 || !binder_nfc_record_parse_number(tok[2], &v1) ||
+            !binder_nfc_record_parse_number(tok[3], &v2)) {
+            return NULL;
+        }
+        entry.event = (guint)v1;
+        entry.status = (guint)v2;
+    } else if (!strcmp(tok[1], "data")) {
+        entry.type = BINDER_NFC_RECORD_DATA;
+        if (n < 3 || !(entry.data = binder_nfc_record_parse_data(tok + 2))) {
+            return NULL;
+        }
+    } else if (!strcmp(tok[1], "death")) {
+        entry.type = BINDER_NFC_RECORD_DEATH;
+    } else {
+        return NULL;
+    }
+    return g_slice_copy(sizeof(entry), &entry);
+}
+
+/*==========================================================================*
+ * Recorder
+ *==========================================================================*/
+
+static
+gint64
+binder_nfc_transport_recorder_time(
+    BinderNfcTransportRecorder* self)
+{
+    return g_get_monotonic_time() - self->start;
+}
+
+static
+void
+binder_nfc_transport_recorder_write_data(
+    BinderNfcTransportRecorder* self,
+    const guint8* data,
+    guint len)
+{
+    guint i;
+
+    for (i = 0; i < len; i++) {
+        fprintf(self->fp, " %02x", data[i]);
+    }
+}
+
+static
+void
+binder_nfc_transport_recorder_event(
+    BinderNfcTransportClient* inner_client,
+    guint event,
+    guint status)
+{
+    BinderNfcTransportRecorder* self = G_CAST(inner_client,
+        BinderNfcTransportRecorder, inner_client);
+    BinderNfcTransportClient* client = self->client;
+
+    if (self->fp) {
+        fprintf(self->fp, "%" G_GINT64_FORMAT " event %u %u\n",
+            binder_nfc_transport_recorder_time(self), event, status);
+    }
+    if (client) {
+        client->fn->event(client, event, status);
+    }
+}
+
+static
+void
+binder_nfc_transport_recorder_data(
+    BinderNfcTransportClient* inner_client,
+    const void* data,
+    guint len)
+{
+    BinderNfcTransportRecorder* self = G_CAST(inner_client,
+        BinderNfcTransportRecorder, inner_client);
+    BinderNfcTransportClient* client = self->client;
+
+    if (self->fp) {
+        fprintf(self->fp, "%" G_GINT64_FORMAT " data",
+            binder_nfc_transport_recorder_time(self));
+        binder_nfc_transport_recorder_write_data(self, data, len);
+        fputc('\n', self->fp);
+    }
+    if (client) {
+        client->fn->data(client, data, len);
+    }
+}
+
+static
+void
+binder_nfc_transport_recorder_death(
+    BinderNfcTransportClient* inner_client)
+{
+    BinderNfcTransportRecorder* self = G_CAST(inner_client,
+        BinderNfcTransportRecorder, inner_client);
+    BinderNfcTransportClient* client = self->client;
+
+    if (self->fp) {
+        fprintf(self->fp, "%" G_GINT64_FORMAT " death\n",
+            binder_nfc_transport_recorder_time(self));
+        fflush(self->fp);
+    }
+    if (client) {
+        client->fn->death(client);
+    }
+}
+
+static
+void
+binder_nfc_transport_recorder_reply(
+    BinderNfcTransport* inner,
+    int result,
+    void* user_data)
+{
+    BinderNfcTransportRecorderCall* call = user_data;
+    BinderNfcTransportRecorder* self = call->self;
+
+    if (self->fp) {
+        fprintf(self->fp, "%" G_GINT64_FORMAT " reply %lu %d\n",
+            binder_nfc_transport_recorder_time(self), call->id, result);
+    }
+    if (call->reply) {
+        call->reply(&self->transport, result, call->user_data);
+    }
+}
+
+static
+void
+binder_nfc_transport_recorder_call_free(
+    gpointer data)
+{
+    BinderNfcTransportRecorderCall* call = data;
+
+    if (call->destroy) {
+        call->destroy(call->user_data);
+    }
+    g_slice_free1(sizeof(*call), call);
+}
+
+static
+BinderNfcTransportRecorderCall*
+binder_nfc_transport_recorder_call_new(
+    BinderNfcTransportRecorder* self,
+    BinderNfcTransportReplyFunc reply,
+    GDestroyNotify destroy,
+    void* user_data)
+{
+    BinderNfcTransportRecorderCall* call =
+        g_slice_new0(BinderNfcTransportRecorderCall);
+
+    call->self = self;
+    call->reply = reply;
+    call->destroy = destroy;
+    call->user_data = user_data;
+    return call;
+}
+
+static
+gulong
+binder_nfc_transport_recorder_call_done(
+    BinderNfcTransportRecorder* self,
+    BinderNfcTransportRecorderCall* call,
+    BINDER_NFC_CALL code,
+    gint64 time,
+    gulong id,
+    const void* data,
+    guint len)
+{
+    /* Replies never come before the call returns. If the call has
+     * failed, it may have been already deallocated. */
+    if (id) {
+        call->id = id;
+    }
+    if (self->fp) {
+        fprintf(self->fp, "%" G_GINT64_FORMAT " call %s %lu", time,
+            binder_nfc_call_name(code), id);
+        binder_nfc_transport_recorder_write_data(self, data, len);
+        fputc('\n', self->fp);
+    }
+    return id;
+}
+
+static
+void
+binder_nfc_transport_recorder_set_client(
+    BinderNfcTransport* transport,
+    BinderNfcTransportClient* client)
+{
+    binder_nfc_transport_recorder_cast(transport)->client = client;
+}
+
+static
+gulong
+binder_nfc_transport_recorder_call(
+    BinderNfcTransport* transport,
+    BINDER_NFC_CALL code,
+    BinderNfcTransportReplyFunc reply,
+    GDestroyNotify destroy,
+    void* user_data)
+{
+    BinderNfcTransportRecorder* self =
+        binder_nfc_transport_recorder_cast(transport);
+    BinderNfcTransport* inner = self->inner;
+    const BinderNfcTransportFunctions* fn = inner->fn;
+    BinderNfcTransportRecorderCall* call =
+        binder_nfc_transport_recorder_call_new(self, reply, destroy,
+            user_data);
+    const gint64 time = binder_nfc_transport_recorder_time(self);
+    BinderNfcTransportReplyFunc inner_reply =
+        binder_nfc_transport_recorder_reply;
+    GDestroyNotify inner_destroy = binder_nfc_transport_recorder_call_free;
+    gulong id = 0;
+
+    switch (code) {
+    case BINDER_NFC_CALL_OPEN:
+        id = fn->open(inner, inner_reply, inner_destroy, call);
+        break;
+    case BINDER_NFC_CALL_CLOSE:
+        id = fn->close(inner, inner_reply, inner_destroy, call);
+        break;
+    case BINDER_NFC_CALL_CORE_INITIALIZED:
+        id = fn->core_initialized(inner, inner_reply, inner_destroy, call);
+        break;
+    case BINDER_NFC_CALL_PREDISCOVER:
+        id = fn->prediscover(inner, inner_reply, inner_destroy, call);
+        break;
+    case BINDER_NFC_CALL_POWER_CYCLE:
+        id = fn->power_cycle(inner, inner_reply, inner_destroy, call);
+        break;
+    case BINDER_NFC_CALL_CONTROL_GRANTED:
+        id = fn->control_granted(inner, inner_reply, inner_destroy, call);
+        break;
+    case BINDER_NFC_CALL_WRITE:
+    case BINDER_NFC_CALL_COUNT:
+        GASSERT(FALSE);
+        binder_nfc_transport_recorder_call_free(call);
+        break;
+    }
+    return binder_nfc_transport_recorder_call_done(self, call, code, time,
+        id, NULL, 0);
+}
+
+static
+gulong
+binder_nfc_transport_recorder_open(
+    BinderNfcTransport* transport,
+    BinderNfcTransportReplyFunc reply,
+    GDestroyNotify destroy,
+    void* user_data)
+{
+    return binder_nfc_transport_recorder_call(transport,
+        BINDER_NFC_CALL_OPEN, reply, destroy, user_data);
+}
+
+static
+gulong
+binder_nfc_transport_recorder_close(
+    BinderNfcTransport* transport,
+    BinderNfcTransportReplyFunc reply,
+    GDestroyNotify destroy,
+    void* user_data)
+{
+    return binder_nfc_transport_recorder_call(transport,
+        BINDER_NFC_CALL_CLOSE, reply, destroy, user_data);
+}
+
+static
+gulong
+binder_nfc_transport_recorder_core_initialized(
+    BinderNfcTransport* transport,
+    BinderNfcTransportReplyFunc reply,
+    GDestroyNotify destroy,
+    void* user_data)
+{
+    return binder_nfc_transport_recorder_call(transport,
+        BINDER_NFC_CALL_CORE_INITIALIZED, reply, destroy, user_data);
+}
+
+static
+gulong
+binder_nfc_transport_recorder_prediscover(
+    BinderNfcTransport* transport,
+    BinderNfcTransportReplyFunc reply,
+    GDestroyNotify destroy,
+    void* user_data)
+{
+    return binder_nfc_transport_recorder_call(transport,
+        BINDER_NFC_CALL_PREDISCOVER, reply, destroy, user_data);
+}
+
+static
+gulong
+binder_nfc_transport_recorder_power_cycle(
+    BinderNfcTransport* transport,
+    BinderNfcTransportReplyFunc reply,
+    GDestroyNotify destroy,
+    void* user_data)
+{
+    return binder_nfc_transport_recorder_call(transport,
+        BINDER_NFC_CALL_POWER_CYCLE, reply, destroy, user_data);
+}
+
+static
+gulong
+binder_nfc_transport_recorder_control_granted(
+    BinderNfcTransport* transport,
+    BinderNfcTransportReplyFunc reply,
+    GDestroyNotify destroy,
+    void* user_data)
+{
+    return binder_nfc_transport_recorder_call(transport,
+        BINDER_NFC_CALL_CONTROL_GRANTED, reply, destroy, user_data);
+}
+
+static
+gulong
+binder_nfc_transport_recorder_write(
+    BinderNfcTransport* transport,
+    const void* data,
+    guint len,
+    BinderNfcTransportReplyFunc reply,
+    GDestroyNotify destroy,
+    void* user_data)
+{
+    BinderNfcTransportRecorder* self =
+        binder_nfc_transport_recorder_cast(transport);
+    BinderNfcTransport* inner = self->inner;
+    BinderNfcTransportRecorderCall* call =
+        binder_nfc_transport_recorder_call_new(self, reply, destroy,
+            user_data);
+    const gint64 time = binder_nfc_transport_recorder_time(self);
+
+    return binder_nfc_transport_recorder_call_done(self, call,
+        BINDER_NFC_CALL_WRITE, time, inner->fn->write(inner, data, len,
+        binder_nfc_transport_recorder_reply,
+        binder_nfc_transport_recorder_call_free, call), data, len);
+}
+
+static
+void
+binder_nfc_transport_recorder_cancel(
+    BinderNfcTransport* transport,
+    gulong id)
+{
+    BinderNfcTransport* inner = binder_nfc_transport_recorder_cast
+        (transport)->inner;
+
+    inner->fn->cancel(inner, id);
+}
+
+static
+void
+binder_nfc_transport_recorder_release(
+    BinderNfcTransport* transport)
+{
+    BinderNfcTransportRecorder* self =
+        binder_nfc_transport_recorder_cast(transport);
+    BinderNfcTransport* inner = self->inner;
+
+    /* End of session is a good time to flush the file */
+    if (self->fp) {
+        fflush(self->fp);
+    }
+    inner->fn->release(inner);
+}
+
+static
+gboolean
+binder_nfc_transport_recorder_shutdown(
+    BinderNfcTransport* transport)
+{
+    BinderNfcTransportRecorder* self =
+        binder_nfc_transport_recorder_cast(transport);
+
+    if (self->fp) {
+        fflush(self->fp);
+    }
+    return binder_nfc_transport_shutdown(self->inner);
+}
+
+static
+void
+binder_nfc_transport_recorder_free(
+    BinderNfcTransport* transport)
+{
+    BinderNfcTransportRecorder* self =
+        binder_nfc_transport_recorder_cast(transport);
+
+    self->inner->fn->set_client(self->inner, NULL);
+    binder_nfc_transport_free(self->inner);
+    if (self->fp) {
+        fclose(self->fp);
+    }
+    g_free(self->file);
+    g_free(self);
+}
+
+/*==========================================================================*
+ * Interface
+ *==========================================================================*/
+
+const char*
+binder_nfc_call_name(
+    BINDER_NFC_CALL call)
+{
+    return (call < BINDER_NFC_CALL_COUNT) ? binder_nfc_call_names[call] :
+        "unknown";
+}
+
+GPtrArray*
+binder_nfc_record_load(
+    const char* file)
+{
+    GError* error = NULL;
+    char* contents = NULL;
+
+    if (g_file_get_contents(file, &contents, NULL, &error)) {
+        GPtrArray* entries = g_ptr_array_new_with_free_func
+            (binder_nfc_record_entry_free);
+        char** lines = g_strsplit(contents, "\n", -1);
+        char** ptr;
+        guint line = 0;
+
+        for (ptr = lines; *ptr && entries; ptr++) {
+            const char* str = g_strstrip(*ptr);
+
+            line++;
+            if (str[0] && str[0] != '#') {
+                char** tok = g_strsplit_set(str, " \t", -1);
+                BinderNfcRecordEntry* entry;
+                guint i, n = 0;
+
+                /* Squeeze out empty tokens */
+                for (i = 0; tok[i]; i++) {
+                    if (tok[i][0]) {
+                        tok[n++] = tok[i];
+                    } else {
+                        g_free(tok[i]);
+                    }
+                }
+                tok[n] = NULL;
+
+                entry = binder_nfc_record_parse_line(tok, n);
+                if (entry) {
+                    g_ptr_array_add(entries, entry);
+                } else {
+                    GWARN("%s:%u: syntax error", file, line);
+                    g_ptr_array_free(entries, TRUE);
+                    entries = NULL;
+                }
+                g_strfreev(tok);
+            }
+        }
+        g_strfreev(lines);
+        g_free(contents);
+        return entries;
+    } else {
+        GWARN("%s", error->message);
+        g_error_free(error);
+        return NULL;
+    }
+}
+
+BinderNfcTransport*
+binder_nfc_transport_recorder_new(
+    BinderNfcTransport* inner,
+    const char* file)
+{
+    static const BinderNfcTransportClientFunctions recorder_client_fn = {
+        .event = binder_nfc_transport_recorder_event,
+        .data = binder_nfc_transport_recorder_data,
+        .death = binder_nfc_transport_recorder_death
+    };
+    static const BinderNfcTransportFunctions recorder_fn = {
+        .set_client = binder_nfc_transport_recorder_set_client,
+        .open = binder_nfc_transport_recorder_open,
+        .write = binder_nfc_transport_recorder_write,
+        .close = binder_nfc_transport_recorder_close,
+        .core_initialized = binder_nfc_transport_recorder_core_initialized,
+        .prediscover = binder_nfc_transport_recorder_prediscover,
+        .power_cycle = binder_nfc_transport_recorder_power_cycle,
+        .control_granted = binder_nfc_transport_recorder_control_granted,
+        .cancel = binder_nfc_transport_recorder_cancel,
+        .release = binder_nfc_transport_recorder_release,
+        .free = binder_nfc_transport_recorder_free,
+        .shutdown = binder_nfc_transport_recorder_shutdown
+    };
+
+    if (G_LIKELY(inner)) {
+        BinderNfcTransportRecorder* self =
+            g_new0(BinderNfcTransportRecorder, 1);
+        BinderNfcTransport* transport = &self->transport;
+
+        self->inner = inner;
+        self->inner_client.fn = &recorder_client_fn;
+        self->file = g_strdup(file);
+        self->start = g_get_monotonic_time();
+        self->fp = fopen(file, "w");
+        if (self->fp) {
+            GINFO("Recording %s to %s", inner->description, file);
+            fprintf(self->fp, "# %s\n", inner->description);
+        } else {
+            GWARN("Failed to open %s: %s", file, strerror(errno));
+        }
+        inner->fn->set_client(inner, &self->inner_client);
+        transport->fn = &recorder_fn;
+        transport->name = inner->name;
+        transport->description = inner->description;
+        return transport;
+    }
+    return NULL;
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
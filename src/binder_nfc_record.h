@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ * Copyright (C) 2021 Slava Monich <slava.monich@jolla.com>
+ *
+ * You may use this file under the terms of BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef BINDER_NFC_RECORD_H
+#define BINDER_NFC_RECORD_H
+
+/*
+ * HAL session recording. Each line of the session file is one entry:
+ *
+ *   <usec> call <method> <id> [<hex data>]
+ *   <usec> reply <id> <result>
+ *   <usec> event <event> <status>
+ *   <usec> data <hex data>
+ *   <usec> death
+ *
+ * Timestamps are microseconds since the beginning of the recording.
+ * Lines starting with # are comments.
+ */
+
+#include "binder_nfc_transport.h"
+
+typedef enum binder_nfc_call {
+    BINDER_NFC_CALL_OPEN,
+    BINDER_NFC_CALL_WRITE,
+    BINDER_NFC_CALL_CLOSE,
+    BINDER_NFC_CALL_CORE_INITIALIZED,
+    BINDER_NFC_CALL_PREDISCOVER,
+    BINDER_NFC_CALL_POWER_CYCLE,
+    BINDER_NFC_CALL_CONTROL_GRANTED,
+    BINDER_NFC_CALL_COUNT
+} BINDER_NFC_CALL;
+
+typedef enum binder_nfc_record_type {
+    BINDER_NFC_RECORD_CALL,
+    BINDER_NFC_RECORD_REPLY,
+    BINDER_NFC_RECORD_EVENT,
+    BINDER_NFC_RECORD_DATA,
+    BINDER_NFC_RECORD_DEATH
+} BINDER_NFC_RECORD_TYPE;
+
+typedef struct binder_nfc_record_entry {
+    BINDER_NFC_RECORD_TYPE type;
+    gint64 time;
+    BINDER_NFC_CALL call;
+    gulong id;
+    int result;
+    guint event;
+    guint status;
+    GBytes* data;
+} BinderNfcRecordEntry;
+
+const char*
+binder_nfc_call_name(
+    BINDER_NFC_CALL call);
+
+/* Returns array of BinderNfcRecordEntry or NULL on failure */
+GPtrArray*
+binder_nfc_record_load(
+    const char* file);
+
+/* Wraps the transport, takes the ownership of it */
+BinderNfcTransport*
+binder_nfc_transport_recorder_new(
+    BinderNfcTransport* transport,
+    const char* file);
+
+typedef
+void
+(*BinderNfcReplayDoneFunc)(
+    BinderNfcTransport* transport,
+    void* user_data);
+
+BinderNfcTransport*
+binder_nfc_transport_replay_new(
+    const char* instance,
+    const char* file,
+    gdouble speed);
+
+/* Invoked once, after the last recorded entry has been delivered */
+void
+binder_nfc_transport_replay_set_done_func(
+    BinderNfcTransport* transport,
+    BinderNfcReplayDoneFunc done,
+    void* user_data);
+
+#endif /* BINDER_NFC_RECORD_H */
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
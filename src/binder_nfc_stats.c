@@ -0,0 +1,364 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ * Copyright (C) 2021 Slava Monich <slava.monich@jolla.com>
+ *
+ * You may use this file under the terms of BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "binder_nfc_stats.h"
+
+static BinderNfcStatsBlock binder_nfc_stats_total;
+
+static inline
+void
+binder_nfc_stats_begin(
+    BinderNfcStatsBlock* block)
+{
+    /* Odd sequence number means update in progress */
+    g_atomic_int_inc(&block->seq);
+    /* Data stores must not move before the odd sequence number */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline
+void
+binder_nfc_stats_end(
+    BinderNfcStatsBlock* block)
+{
+    /* Data stores must be visible before the even sequence number */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    g_atomic_int_inc(&block->seq);
+}
+
+static
+void
+binder_nfc_stats_block_frame(
+    BinderNfcStatsBlock* block,
+    gboolean out,
+    guint len)
+{
+    BinderNfcStats* stats = &block->stats;
+
+    binder_nfc_stats_begin(block);
+    if (out) {
+        stats->frames_out++;
+        stats->bytes_out += len;
+    } else {
+        stats->frames_in++;
+        stats->bytes_in += len;
+    }
+    binder_nfc_stats_end(block);
+}
+
+static
+void
+binder_nfc_stats_block_write_failed(
+    BinderNfcStatsBlock* block)
+{
+    binder_nfc_stats_begin(block);
+    block->stats.write_failures++;
+    binder_nfc_stats_end(block);
+}
+
+static
+void
+binder_nfc_stats_block_in_flight(
+    BinderNfcStatsBlock* block,
+    int delta)
+{
+    binder_nfc_stats_begin(block);
+    block->stats.in_flight += delta;
+    binder_nfc_stats_end(block);
+}
+
+static
+void
+binder_nfc_stats_block_event(
+    BinderNfcStatsBlock* block,
+    guint event)
+{
+    binder_nfc_stats_begin(block);
+    block->stats.events[MIN(event, BINDER_NFC_STATS_EVENT_COUNT - 1)]++;
+    binder_nfc_stats_end(block);
+}
+
+static
+void
+binder_nfc_stats_block_power(
+    BinderNfcStatsBlock* block,
+    gboolean on,
+    gint64 now)
+{
+    BinderNfcStats* stats = &block->stats;
+
+    binder_nfc_stats_begin(block);
+    if (on) {
+        stats->power_on++;
+        if (!block->powered++) {
+            block->powered_since = now;
+        }
+    } else {
+        stats->power_off++;
+        if (block->powered && !--block->powered) {
+            stats->powered_usec += now - block->powered_since;
+            block->powered_since = 0;
+        }
+    }
+    binder_nfc_stats_end(block);
+}
+
+static
+void
+binder_nfc_stats_block_control(
+    BinderNfcStatsBlock* block,
+    gboolean granted,
+    gint64 now)
+{
+    BinderNfcStats* stats = &block->stats;
+
+    binder_nfc_stats_begin(block);
+    if (granted) {
+        stats->control_grants++;
+        if (!block->controlled++) {
+            block->controlled_since = now;
+        }
+    } else if (block->controlled && !--block->controlled) {
+        stats->control_usec += now - block->controlled_since;
+        block->controlled_since = 0;
+    }
+    binder_nfc_stats_end(block);
+}
+
+static
+void
+binder_nfc_stats_block_rx_batch(
+    BinderNfcStatsBlock* block,
+    guint frames,
+    const guint* delays)
+{
+    BinderNfcStats* stats = &block->stats;
+    guint i, n;
+
+    /* 1, 2, 3-4, 5-8, 9-16 and 17+ frames */
+    for (i = 0, n = frames - 1; n && i < BINDER_NFC_STATS_BATCH_BUCKETS - 1;
+         n >>= 1) {
+        i++;
+    }
+
+    binder_nfc_stats_begin(block);
+    stats->rx_batches[i]++;
+    for (i = 0; i < BINDER_NFC_STATS_DELAY_BUCKETS; i++) {
+        stats->rx_delays[i] += delays[i];
+    }
+    binder_nfc_stats_end(block);
+}
+
+static
+void
+binder_nfc_stats_block_death(
+    BinderNfcStatsBlock* block)
+{
+    binder_nfc_stats_begin(block);
+    block->stats.deaths++;
+    binder_nfc_stats_end(block);
+}
+
+/*==========================================================================*
+ * Internal interface
+ *==========================================================================*/
+
+void
+binder_nfc_stats_frame(
+    BinderNfcStatsBlock* block,
+    gboolean out,
+    guint len)
+{
+    binder_nfc_stats_block_frame(block, out, len);
+    binder_nfc_stats_block_frame(&binder_nfc_stats_total, out, len);
+}
+
+void
+binder_nfc_stats_write_failed(
+    BinderNfcStatsBlock* block)
+{
+    binder_nfc_stats_block_write_failed(block);
+    binder_nfc_stats_block_write_failed(&binder_nfc_stats_total);
+}
+
+void
+binder_nfc_stats_tx_start(
+    BinderNfcStatsBlock* block)
+{
+    binder_nfc_stats_block_in_flight(block, 1);
+    binder_nfc_stats_block_in_flight(&binder_nfc_stats_total, 1);
+}
+
+void
+binder_nfc_stats_tx_done(
+    BinderNfcStatsBlock* block)
+{
+    binder_nfc_stats_block_in_flight(block, -1);
+    binder_nfc_stats_block_in_flight(&binder_nfc_stats_total, -1);
+}
+
+void
+binder_nfc_stats_event(
+    BinderNfcStatsBlock* block,
+    guint event)
+{
+    binder_nfc_stats_block_event(block, event);
+    binder_nfc_stats_block_event(&binder_nfc_stats_total, event);
+}
+
+void
+binder_nfc_stats_power(
+    BinderNfcStatsBlock* block,
+    gboolean on)
+{
+    const gint64 now = g_get_monotonic_time();
+
+    /*
+     * The plugin-wide block counts time when at least one adapter is
+     * powered, which is what the first power-on starts and the last
+     * power-off stops. Transitions are counted for each adapter.
+     */
+    binder_nfc_stats_block_power(block, on, now);
+    binder_nfc_stats_block_power(&binder_nfc_stats_total, on, now);
+}
+
+void
+binder_nfc_stats_control(
+    BinderNfcStatsBlock* block,
+    gboolean granted)
+{
+    const gint64 now = g_get_monotonic_time();
+
+    binder_nfc_stats_block_control(block, granted, now);
+    binder_nfc_stats_block_control(&binder_nfc_stats_total, granted, now);
+}
+
+void
+binder_nfc_stats_rx_batch(
+    BinderNfcStatsBlock* block,
+    guint frames,
+    const guint* delays)
+{
+    if (frames) {
+        binder_nfc_stats_block_rx_batch(block, frames, delays);
+        binder_nfc_stats_block_rx_batch(&binder_nfc_stats_total, frames,
+            delays);
+    }
+}
+
+void
+binder_nfc_stats_death(
+    BinderNfcStatsBlock* block)
+{
+    binder_nfc_stats_block_death(block);
+    binder_nfc_stats_block_death(&binder_nfc_stats_total);
+}
+
+void
+binder_nfc_stats_reconnect(
+    void)
+{
+    BinderNfcStatsBlock* block = &binder_nfc_stats_total;
+
+    binder_nfc_stats_begin(block);
+    block->stats.reconnects++;
+    binder_nfc_stats_end(block);
+}
+
+void
+binder_nfc_stats_failover(
+    gint64 usec)
+{
+    BinderNfcStatsBlock* block = &binder_nfc_stats_total;
+
+    binder_nfc_stats_begin(block);
+    block->stats.failovers++;
+    block->stats.failover_usec += usec;
+    binder_nfc_stats_end(block);
+}
+
+void
+binder_nfc_stats_read(
+    const BinderNfcStatsBlock* block,
+    BinderNfcStats* stats)
+{
+    gint64 since = 0;
+    gint64 controlled_since = 0;
+    gint seq;
+
+    /* Retry until we get a snapshot not overlapping with an update */
+    do {
+        seq = g_atomic_int_get(&block->seq);
+        if (seq & 1) {
+            continue;
+        }
+        /* Data loads must not move before the first sequence load... */
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        *stats = block->stats;
+        since = block->powered_since;
+        controlled_since = block->controlled_since;
+        /* ...nor after the second one */
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (g_atomic_int_get(&block->seq) != seq || (seq & 1));
+
+    if (since || controlled_since) {
+        const gint64 now = g_get_monotonic_time();
+
+        if (since) {
+            stats->powered_usec += now - since;
+        }
+        if (controlled_since) {
+            stats->control_usec += now - controlled_since;
+        }
+    }
+}
+
+/*==========================================================================*
+ * Interface
+ *==========================================================================*/
+
+void
+binder_nfc_get_stats(
+    BinderNfcStats* stats)
+{
+    if (G_LIKELY(stats)) {
+        binder_nfc_stats_read(&binder_nfc_stats_total, stats);
+    }
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,134 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ * Copyright (C) 2021 Slava Monich <slava.monich@jolla.com>
+ *
+ * You may use this file under the terms of BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef BINDER_NFC_STATS_H
+#define BINDER_NFC_STATS_H
+
+/*
+ * Statistics are written by the main thread only, so updates don't
+ * need atomic operations. Each update is wrapped into a pair of
+ * sequence counter increments which allows lock-free readers to detect
+ * (and retry) a snapshot taken in the middle of an update. Every update
+ * is applied to both the per-adapter and the plugin-wide block.
+ */
+
+#include "binder_nfc.h"
+
+typedef struct binder_nfc_stats_block {
+    gint seq;
+    guint powered;
+    gint64 powered_since;
+    guint controlled;
+    gint64 controlled_since;
+    BinderNfcStats stats;
+} BinderNfcStatsBlock;
+
+static inline
+guint
+binder_nfc_stats_delay_bucket(
+    gint64 usec)
+{
+    guint i = 0;
+
+    /* <16us goes to the first bucket, 1ms or more to the last one */
+    for (usec >>= 4; usec > 0 && i < BINDER_NFC_STATS_DELAY_BUCKETS - 1;
+         usec >>= 1) {
+        i++;
+    }
+    return i;
+}
+
+void
+binder_nfc_stats_frame(
+    BinderNfcStatsBlock* block,
+    gboolean out,
+    guint len);
+
+void
+binder_nfc_stats_write_failed(
+    BinderNfcStatsBlock* block);
+
+void
+binder_nfc_stats_tx_start(
+    BinderNfcStatsBlock* block);
+
+void
+binder_nfc_stats_tx_done(
+    BinderNfcStatsBlock* block);
+
+void
+binder_nfc_stats_event(
+    BinderNfcStatsBlock* block,
+    guint event);
+
+void
+binder_nfc_stats_power(
+    BinderNfcStatsBlock* block,
+    gboolean on);
+
+void
+binder_nfc_stats_control(
+    BinderNfcStatsBlock* block,
+    gboolean granted);
+
+void
+binder_nfc_stats_rx_batch(
+    BinderNfcStatsBlock* block,
+    guint frames,
+    const guint* delays);
+
+void
+binder_nfc_stats_death(
+    BinderNfcStatsBlock* block);
+
+void
+binder_nfc_stats_reconnect(
+    void);
+
+void
+binder_nfc_stats_failover(
+    gint64 usec);
+
+void
+binder_nfc_stats_read(
+    const BinderNfcStatsBlock* block,
+    BinderNfcStats* stats);
+
+#endif /* BINDER_NFC_STATS_H */
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
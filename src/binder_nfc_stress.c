@@ -0,0 +1,301 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ * Copyright (C) 2021 Slava Monich <slava.monich@jolla.com>
+ *
+ * You may use this file under the terms of BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "binder_nfc_stress.h"
+#include "binder_nfc_bench.h"
+#include "binder_nfc_transport.h"
+
+#include <nfc_manager.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+/* A burst which hasn't settled in this many seconds is stuck */
+#define STRESS_STUCK_SEC (5)
+
+#define STRESS_INSTANCE "stress"
+
+struct binder_nfc_stress {
+    const BinderNfcConfig* config;
+    FILE* out;
+    NfcManager* manager;
+    NfcAdapter* adapter;
+    BinderNfcTransport* transport;
+    GRand* rand;
+    guint32 seed;
+    guint round;
+    guint burst;
+    guint requests;
+    gboolean want_power;
+    gint64 t0;
+    guint timer_id;
+    BinderNfcSamples* settle;
+    BinderNfcStressDoneFunc done;
+    void* user_data;
+};
+
+/*==========================================================================*
+ * Implementation
+ *==========================================================================*/
+
+static
+void
+binder_nfc_stress_round_start(
+    BinderNfcStress* self);
+
+static
+void
+binder_nfc_stress_report(
+    BinderNfcStress* self)
+{
+    FILE* out = self->out;
+    BinderNfcSamples* settle = self->settle;
+
+    fprintf(out, "{\"test\":\"power_churn\",\"seed\":%u,\"rounds\":%u,"
+        "\"requests\":%u,\"settled\":%u", self->seed, self->round,
+        self->requests, binder_nfc_samples_count(settle));
+    fprintf(out, ",\"settle_p50_usec\":%" G_GINT64_FORMAT
+        ",\"settle_p90_usec\":%" G_GINT64_FORMAT
+        ",\"settle_p99_usec\":%" G_GINT64_FORMAT
+        ",\"settle_max_usec\":%" G_GINT64_FORMAT "}\n",
+        binder_nfc_samples_percentile(settle, 50),
+        binder_nfc_samples_percentile(settle, 90),
+        binder_nfc_samples_percentile(settle, 99),
+        binder_nfc_samples_percentile(settle, 100));
+    fflush(out);
+}
+
+static
+void
+binder_nfc_stress_finish(
+    BinderNfcStress* self,
+    gboolean ok)
+{
+    BinderNfcStressDoneFunc done = self->done;
+
+    if (self->timer_id) {
+        g_source_remove(self->timer_id);
+        self->timer_id = 0;
+    }
+    if (done) {
+        self->done = NULL;
+        binder_nfc_stress_report(self);
+        done(self, ok, self->user_data);
+    }
+}
+
+static
+gboolean
+binder_nfc_stress_settled(
+    BinderNfcStress* self)
+{
+    NfcAdapter* adapter = self->adapter;
+
+    return adapter->powered == self->want_power &&
+        adapter->power_requested == self->want_power &&
+        binder_nfc_adapter_settled(adapter);
+}
+
+static
+gboolean
+binder_nfc_stress_settle_proc(
+    gpointer user_data)
+{
+    BinderNfcStress* self = user_data;
+    const gint64 elapsed = g_get_monotonic_time() - self->t0;
+
+    if (binder_nfc_stress_settled(self)) {
+        self->timer_id = 0;
+        binder_nfc_samples_add(self->settle, elapsed);
+        self->round++;
+        binder_nfc_stress_round_start(self);
+        return G_SOURCE_REMOVE;
+    } else if (elapsed > STRESS_STUCK_SEC * G_USEC_PER_SEC) {
+        GERR("Round %u is stuck: power %s, adapter %s (seed %u)",
+            self->round, self->want_power ? "on" : "off",
+            self->adapter->powered ? "on" : "off", self->seed);
+        self->timer_id = 0;
+        binder_nfc_stress_finish(self, FALSE);
+        return G_SOURCE_REMOVE;
+    } else {
+        return G_SOURCE_CONTINUE;
+    }
+}
+
+static
+guint
+binder_nfc_stress_random(
+    BinderNfcStress* self,
+    guint max)
+{
+    return g_rand_int_range(self->rand, 0, max + 1);
+}
+
+static
+gboolean
+binder_nfc_stress_request_proc(
+    gpointer user_data)
+{
+    BinderNfcStress* self = user_data;
+
+    self->want_power = g_rand_boolean(self->rand);
+    self->requests++;
+    nfc_adapter_request_power(self->adapter, self->want_power);
+    if (--self->burst) {
+        self->timer_id = g_timeout_add(binder_nfc_stress_random(self,
+            self->config->stress_max_gap_ms),
+            binder_nfc_stress_request_proc, self);
+    } else {
+        /* Poll until the dust settles */
+        self->t0 = g_get_monotonic_time();
+        self->timer_id = g_timeout_add(1, binder_nfc_stress_settle_proc,
+            self);
+    }
+    return G_SOURCE_REMOVE;
+}
+
+static
+void
+binder_nfc_stress_round_start(
+    BinderNfcStress* self)
+{
+    const BinderNfcConfig* config = self->config;
+
+    if (self->round < config->stress_rounds) {
+        const guint max_delay = config->stress_max_delay_ms;
+        BinderNfcFakeHalParams params;
+
+        /* Shuffle reply and event ordering. OPEN_CPLT never gets lost. */
+        memset(&params, 0, sizeof(params));
+        params.reply_delay_ms = binder_nfc_stress_random(self, max_delay);
+        params.event_delay_ms = binder_nfc_stress_random(self, max_delay);
+        params.data_delay_ms = binder_nfc_stress_random(self, max_delay);
+        params.open_cplt = g_rand_boolean(self->rand) ?
+            BINDER_NFC_FAKE_CPLT_BEFORE_REPLY :
+            BINDER_NFC_FAKE_CPLT_AFTER_REPLY;
+        params.close_cplt = (BINDER_NFC_FAKE_CPLT)
+            binder_nfc_stress_random(self, BINDER_NFC_FAKE_CPLT_NONE);
+        binder_nfc_transport_fake_set_params(self->transport, &params);
+
+        self->burst = 1 + binder_nfc_stress_random(self,
+            MAX(config->stress_max_burst, 1) - 1);
+        self->timer_id = g_timeout_add(binder_nfc_stress_random(self,
+            config->stress_max_gap_ms), binder_nfc_stress_request_proc, self);
+    } else {
+        binder_nfc_stress_finish(self, TRUE);
+    }
+}
+
+/*==========================================================================*
+ * Interface
+ *==========================================================================*/
+
+BinderNfcStress*
+binder_nfc_stress_new(
+    const BinderNfcConfig* config)
+{
+    BinderNfcStress* self = g_new0(BinderNfcStress, 1);
+
+    self->config = config;
+    self->seed = config->stress_seed ? config->stress_seed :
+        (guint32)g_get_monotonic_time();
+    self->rand = g_rand_new_with_seed(self->seed);
+    self->settle = binder_nfc_samples_new();
+    return self;
+}
+
+gboolean
+binder_nfc_stress_start(
+    BinderNfcStress* self,
+    NfcManager* manager,
+    BinderNfcStressDoneFunc done,
+    void* user_data)
+{
+    const BinderNfcConfig* config = self->config;
+    const char* output = config->stress_output;
+
+    GASSERT(!self->adapter);
+    if (output) {
+        self->out = fopen(output, "w");
+        if (!self->out) {
+            GERR("Failed to open %s: %s", output, strerror(errno));
+            return FALSE;
+        }
+    } else {
+        self->out = stdout;
+    }
+
+    self->transport = binder_nfc_transport_fake_new(STRESS_INSTANCE, NULL,
+        NULL);
+    self->adapter = binder_nfc_adapter_new(self->transport, config, NULL);
+
+    /* The adapter needs to be enabled by the manager */
+    self->manager = nfc_manager_ref(manager);
+    nfc_manager_add_adapter(manager, self->adapter);
+
+    GINFO("Running %u power churn round(s), seed %u", config->stress_rounds,
+        self->seed);
+    self->done = done;
+    self->user_data = user_data;
+    binder_nfc_stress_round_start(self);
+    return TRUE;
+}
+
+void
+binder_nfc_stress_free(
+    BinderNfcStress* self)
+{
+    if (G_LIKELY(self)) {
+        self->done = NULL;
+        binder_nfc_stress_finish(self, FALSE);
+        if (self->adapter) {
+            nfc_manager_remove_adapter(self->manager, self->adapter->name);
+            nfc_adapter_unref(self->adapter);
+            nfc_manager_unref(self->manager);
+        }
+        if (self->out && self->out != stdout) {
+            fclose(self->out);
+        }
+        binder_nfc_samples_free(self->settle);
+        g_rand_free(self->rand);
+        g_free(self);
+    }
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,216 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ * Copyright (C) 2021 Slava Monich <slava.monich@jolla.com>
+ *
+ * You may use this file under the terms of BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef BINDER_NFC_TRANSPORT_H
+#define BINDER_NFC_TRANSPORT_H
+
+/*
+ * Transport for android.hardware.nfc::INfc calls and INfcClientCallback
+ * events. The real one talks to the HAL over hwbinder, the fake one
+ * emulates the HAL in-process.
+ */
+
+#include "binder_nfc.h"
+
+typedef struct binder_nfc_transport_client BinderNfcTransportClient;
+
+#define BINDER_NFC_EVENTS(e) \
+    e(OPEN_CPLT) \
+    e(CLOSE_CPLT) \
+    e(POST_INIT_CPLT) \
+    e(PRE_DISCOVER_CPLT) \
+    e(REQUEST_CONTROL) \
+    e(RELEASE_CONTROL) \
+    e(ERROR) \
+    e(HCI_NETWORK_RESET)
+
+enum BinderNfcEvent {
+#define HAL_NFC_EVT(x) HAL_NFC_EVT_##x,
+    BINDER_NFC_EVENTS(HAL_NFC_EVT)
+#undef HAL_NFC_EVT
+};
+
+/*
+ * Not a HAL event. Transport asks the adapter to close the HAL and
+ * open it again (e.g. to switch to another instance).
+ */
+#define BINDER_NFC_TRANSPORT_EVT_REOPEN (0x100)
+
+enum BinderNfcStatus_t {
+    HAL_NFC_STATUS_OK,
+    HAL_NFC_STATUS_FAILED,
+    HAL_NFC_STATUS_ERR_TRANSPORT,
+    HAL_NFC_STATUS_ERR_CMD_TIMEOUT,
+    HAL_NFC_STATUS_REFUSED
+};
+
+/* Negative result means that the call didn't make it to the HAL */
+#define BINDER_NFC_TRANSPORT_FAILED (-1)
+
+typedef
+void
+(*BinderNfcTransportReplyFunc)(
+    BinderNfcTransport* transport,
+    int result,
+    void* user_data);
+
+typedef struct binder_nfc_transport_client_functions {
+    void (*event)(BinderNfcTransportClient* client, guint event,
+        guint status);
+    void (*data)(BinderNfcTransportClient* client, const void* data,
+        guint len);
+    void (*death)(BinderNfcTransportClient* client);
+} BinderNfcTransportClientFunctions;
+
+struct binder_nfc_transport_client {
+    const BinderNfcTransportClientFunctions* fn;
+};
+
+/*
+ * Each call returns non-zero id of the pending call or zero on failure.
+ * Reply function is invoked when the call completes. Destroy function is
+ * invoked when the call completes or gets cancelled, and also when the
+ * call fails right away.
+ */
+typedef struct binder_nfc_transport_functions {
+    void (*set_client)(BinderNfcTransport* transport,
+        BinderNfcTransportClient* client);
+    gulong (*open)(BinderNfcTransport* transport,
+        BinderNfcTransportReplyFunc reply, GDestroyNotify destroy,
+        void* user_data);
+    gulong (*write)(BinderNfcTransport* transport, const void* data,
+        guint len, BinderNfcTransportReplyFunc reply, GDestroyNotify destroy,
+        void* user_data);
+    gulong (*close)(BinderNfcTransport* transport,
+        BinderNfcTransportReplyFunc reply, GDestroyNotify destroy,
+        void* user_data);
+    gulong (*core_initialized)(BinderNfcTransport* transport,
+        BinderNfcTransportReplyFunc reply, GDestroyNotify destroy,
+        void* user_data);
+    gulong (*prediscover)(BinderNfcTransport* transport,
+        BinderNfcTransportReplyFunc reply, GDestroyNotify destroy,
+        void* user_data);
+    gulong (*power_cycle)(BinderNfcTransport* transport,
+        BinderNfcTransportReplyFunc reply, GDestroyNotify destroy,
+        void* user_data);
+    /* Hands the NFCC over to the HAL after REQUEST_CONTROL event */
+    gulong (*control_granted)(BinderNfcTransport* transport,
+        BinderNfcTransportReplyFunc reply, GDestroyNotify destroy,
+        void* user_data);
+    void (*cancel)(BinderNfcTransport* transport, gulong id);
+    /* Releases per-session resources after the HAL has been closed */
+    void (*release)(BinderNfcTransport* transport);
+    void (*free)(BinderNfcTransport* transport);
+    /* Optional. Synchronously closes the HAL when nfcd is exiting */
+    gboolean (*shutdown)(BinderNfcTransport* transport);
+} BinderNfcTransportFunctions;
+
+struct binder_nfc_transport {
+    const BinderNfcTransportFunctions* fn;
+    const char* name;
+    const char* description;
+};
+
+/* Constructors */
+
+typedef struct binder_nfc_transport_connect BinderNfcTransportConnect;
+
+/* Transport is NULL if the HAL couldn't be found */
+typedef
+void
+(*BinderNfcTransportConnectFunc)(
+    BinderNfcTransport* transport,
+    void* user_data);
+
+/*
+ * Looks up the HAL asynchronously, so that any number of instances can
+ * be connected in parallel. The completion function is invoked exactly
+ * once unless the connection is cancelled. Returns NULL on immediate
+ * failure, without invoking the completion function.
+ */
+BinderNfcTransportConnect*
+binder_nfc_transport_binder_connect(
+    GBinderServiceManager* sm,
+    const char* instance,
+    BinderNfcTransportConnectFunc done,
+    void* user_data);
+
+void
+binder_nfc_transport_binder_connect_cancel(
+    BinderNfcTransportConnect* connect);
+
+BinderNfcTransport*
+binder_nfc_transport_fake_new(
+    const char* instance,
+    const BinderNfcFakeHalParams* params,
+    const char* script);
+
+/* Fake HAL control */
+
+void
+binder_nfc_transport_fake_set_params(
+    BinderNfcTransport* transport,
+    const BinderNfcFakeHalParams* params);
+
+void
+binder_nfc_transport_fake_inject_event(
+    BinderNfcTransport* transport,
+    guint event,
+    guint status);
+
+void
+binder_nfc_transport_fake_inject_data(
+    BinderNfcTransport* transport,
+    const void* data,
+    guint len);
+
+void
+binder_nfc_transport_fake_kill(
+    BinderNfcTransport* transport);
+
+gboolean
+binder_nfc_transport_shutdown(
+    BinderNfcTransport* transport);
+
+void
+binder_nfc_transport_free(
+    BinderNfcTransport* transport);
+
+#endif /* BINDER_NFC_TRANSPORT_H */
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
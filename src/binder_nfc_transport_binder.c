@@ -0,0 +1,661 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ * Copyright (C) 2021 Slava Monich <slava.monich@jolla.com>
+ *
+ * You may use this file under the terms of BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "binder_nfc_transport.h"
+
+#include <gbinder.h>
+
+#include <gutil_macros.h>
+
+#define BINDER_IFACE_1_1(x) "android.hardware.nfc@1.1::" x
+#define BINDER_IFACE_1_2(x) "android.hardware.nfc@1.2::" x
+#define BINDER_NFC_1_1      BINDER_IFACE_1_1("INfc")
+#define BINDER_NFC_1_2      BINDER_IFACE_1_2("INfc")
+#define BINDER_NFC_CALLBACK_1_1 BINDER_IFACE_1_1("INfcClientCallback")
+
+/* android.hardware.nfc@1.0::INfc */
+#define BINDER_NFC_REQ_OPEN                 (1) /* open */
+#define BINDER_NFC_REQ_WRITE                (2) /* write */
+#define BINDER_NFC_REQ_CORE_INITIALIZED     (3) /* coreInitialized */
+#define BINDER_NFC_REQ_PREDISCOVER          (4) /* prediscover */
+#define BINDER_NFC_REQ_CLOSE                (5) /* close */
+#define BINDER_NFC_REQ_CONTROL_GRANTED      (6) /* controlGranted */
+#define BINDER_NFC_REQ_POWER_CYCLE          (7) /* powerCycle */
+
+/* android.hardware.nfc@1.1::INfc */
+#define BINDER_NFC_REQ_FACTORY_RESET        (8) /* factoryReset */
+#define BINDER_NFC_REQ_CLOSE_FOR_POWER_OFF  (9) /* closeForPowerOffCase */
+#define BINDER_NFC_REQ_OPEN_1_1            (10) /* open_1_1 */
+#define BINDER_NFC_REQ_GET_CONFIG          (11) /* getConfig */
+
+/* android.hardware.nfc@1.2::INfc */
+#define BINDER_NFC_REQ_GET_CONFIG_1_2      (12) /* getConfig_1_2 */
+
+/* android.hardware.nfc@1.0::INfcClientCallback */
+#define BINDER_NFC_REQ_CALLBACK_SEND_EVENT  (1) /* sendEvent */
+#define BINDER_NFC_REQ_SEND_DATA            (2) /* sendData */
+
+/* android.hardware.nfc@1.1::INfcClientCallback */
+#define BINDER_NFC_REQ_CALLBACK_SEND_EVENT_1_1 (3) /* sendEvent_1_1 */
+
+/* Highest version first */
+static const GBinderClientIfaceInfo binder_nfc_ifaces[] = {
+    { BINDER_NFC_1_2, BINDER_NFC_REQ_GET_CONFIG_1_2 },
+    { BINDER_NFC_1_1, BINDER_NFC_REQ_GET_CONFIG },
+    { BINDER_NFC, BINDER_NFC_REQ_POWER_CYCLE }
+};
+
+#define BINDER_NFC_MAX_VERSION (G_N_ELEMENTS(binder_nfc_ifaces) - 1)
+
+typedef struct binder_nfc_transport_binder {
+    BinderNfcTransport transport;
+    BinderNfcTransportClient* client;
+    GBinderRemoteObject* remote;
+    GBinderClient* binder;
+    GBinderLocalObject* callback;
+    GBinderLocalRequest* req_open;
+    GBinderLocalRequest* req_close;
+    GBinderLocalRequest* req_core_initialized;
+    GBinderLocalRequest* req_prediscover;
+    gulong death_id;
+    guint version;
+    char* instance;
+    char* fqname;
+} BinderNfcTransportBinder;
+
+typedef struct binder_nfc_transport_binder_call {
+    BinderNfcTransportBinder* self;
+    BinderNfcTransportReplyFunc reply;
+    GDestroyNotify destroy;
+    void* user_data;
+} BinderNfcTransportBinderCall;
+
+static inline
+BinderNfcTransportBinder*
+binder_nfc_transport_binder_cast(
+    BinderNfcTransport* transport)
+{
+    return G_CAST(transport, BinderNfcTransportBinder, transport);
+}
+
+/*==========================================================================*
+ * INfcClientCallback
+ *==========================================================================*/
+
+static
+int
+binder_nfc_transport_binder_handle_event(
+    BinderNfcTransportBinder* self,
+    GBinderReader* reader)
+{
+    guint32 event, status;
+
+    if (gbinder_reader_read_uint32(reader, &event) &&
+        gbinder_reader_read_uint32(reader, &status) &&
+        gbinder_reader_at_end(reader)) {
+        BinderNfcTransportClient* client = self->client;
+
+        if (client) {
+            client->fn->event(client, event, status);
+        }
+        return GBINDER_STATUS_OK;
+    } else {
+        GWARN("Failed to parse INfcClientCallback::sendEvent payload");
+        return GBINDER_STATUS_FAILED;
+    }
+}
+
+static
+int
+binder_nfc_transport_binder_handle_data(
+    BinderNfcTransportBinder* self,
+    GBinderReader* reader)
+{
+    gsize len;
+    const guint8* data = gbinder_reader_read_hidl_byte_vec(reader, &len);
+
+    if (data && gbinder_reader_at_end(reader)) {
+        BinderNfcTransportClient* client = self->client;
+
+        if (client) {
+            client->fn->data(client, data, len);
+        }
+        return GBINDER_STATUS_OK;
+    } else {
+        GWARN("Failed to parse INfcClientCallback::sendData payload");
+        return GBINDER_STATUS_FAILED;
+    }
+}
+
+static
+GBinderLocalReply*
+binder_nfc_transport_binder_callback_handler(
+    GBinderLocalObject* obj,
+    GBinderRemoteRequest* req,
+    guint code,
+    guint flags,
+    int* status,
+    void* user_data)
+{
+    BinderNfcTransportBinder* self = user_data;
+    const char* iface = gbinder_remote_request_interface(req);
+
+    if (!g_strcmp0(iface, BINDER_NFC_CALLBACK) ||
+        !g_strcmp0(iface, BINDER_NFC_CALLBACK_1_1)) {
+        GBinderReader reader;
+
+        gbinder_remote_request_init_reader(req, &reader);
+        switch (code) {
+        case BINDER_NFC_REQ_CALLBACK_SEND_EVENT:
+            GDEBUG("%s %u sendEvent", iface, code);
+            *status = binder_nfc_transport_binder_handle_event(self, &reader);
+            break;
+        case BINDER_NFC_REQ_SEND_DATA:
+            GDEBUG("%s %u sendData", iface, code);
+            *status = binder_nfc_transport_binder_handle_data(self, &reader);
+            break;
+        case BINDER_NFC_REQ_CALLBACK_SEND_EVENT_1_1:
+            GDEBUG("%s %u sendEvent_1_1", iface, code);
+            *status = binder_nfc_transport_binder_handle_event(self, &reader);
+            break;
+        default:
+            GDEBUG("%s %u", iface, code);
+            *status = GBINDER_STATUS_FAILED;
+            break;
+        }
+    } else {
+        GDEBUG("%s %u", iface, code);
+        *status = GBINDER_STATUS_FAILED;
+    }
+    return (*status == GBINDER_STATUS_OK) ? gbinder_local_reply_append_int32
+        (gbinder_local_object_new_reply(obj), 0) : NULL;
+}
+
+/*==========================================================================*
+ * INfc
+ *==========================================================================*/
+
+static
+void
+binder_nfc_transport_binder_call_reply(
+    GBinderClient* client,
+    GBinderRemoteReply* reply,
+    int status,
+    void* user_data)
+{
+    BinderNfcTransportBinderCall* call = user_data;
+    int result = BINDER_NFC_TRANSPORT_FAILED;
+
+    if (status == GBINDER_STATUS_OK) {
+        gint32 value;
+
+        if (gbinder_remote_reply_read_int32(reply, &value)) {
+            result = value;
+        }
+    }
+    if (call->reply) {
+        call->reply(&call->self->transport, result, call->user_data);
+    }
+}
+
+static
+void
+binder_nfc_transport_binder_call_free(
+    gpointer data)
+{
+    BinderNfcTransportBinderCall* call = data;
+
+    if (call->destroy) {
+        call->destroy(call->user_data);
+    }
+    g_slice_free1(sizeof(*call), call);
+}
+
+static
+gulong
+binder_nfc_transport_binder_transact(
+    BinderNfcTransportBinder* self,
+    guint32 code,
+    GBinderLocalRequest* req,
+    BinderNfcTransportReplyFunc reply,
+    GDestroyNotify destroy,
+    void* user_data)
+{
+    BinderNfcTransportBinderCall* call =
+        g_slice_new(BinderNfcTransportBinderCall);
+
+    call->self = self;
+    call->reply = reply;
+    call->destroy = destroy;
+    call->user_data = user_data;
+
+    return gbinder_client_transact(self->binder, code, 0, req,
+        binder_nfc_transport_binder_call_reply,
+        binder_nfc_transport_binder_call_free, call);
+}
+
+static
+void
+binder_nfc_transport_binder_set_client(
+    BinderNfcTransport* transport,
+    BinderNfcTransportClient* client)
+{
+    binder_nfc_transport_binder_cast(transport)->client = client;
+}
+
+static
+gulong
+binder_nfc_transport_binder_open(
+    BinderNfcTransport* transport,
+    BinderNfcTransportReplyFunc reply,
+    GDestroyNotify destroy,
+    void* user_data)
+{
+    BinderNfcTransportBinder* self = binder_nfc_transport_binder_cast
+        (transport);
+
+    /* INfc@1.1 gets INfcClientCallback@1.1 */
+    return binder_nfc_transport_binder_transact(self, self->version ?
+        BINDER_NFC_REQ_OPEN_1_1 : BINDER_NFC_REQ_OPEN, self->req_open,
+        reply, destroy, user_data);
+}
+
+static
+gulong
+binder_nfc_transport_binder_write(
+    BinderNfcTransport* transport,
+    const void* data,
+    guint len,
+    BinderNfcTransportReplyFunc reply,
+    GDestroyNotify destroy,
+    void* user_data)
+{
+    BinderNfcTransportBinder* self = binder_nfc_transport_binder_cast
+        (transport);
+    GBinderLocalRequest* req = gbinder_client_new_request2(self->binder,
+        BINDER_NFC_REQ_WRITE);
+    GBinderWriter writer;
+    gulong id;
+
+    gbinder_local_request_init_writer(req, &writer);
+    gbinder_writer_append_hidl_vec(&writer, data, len, 1);
+    id = binder_nfc_transport_binder_transact(self, BINDER_NFC_REQ_WRITE,
+        req, reply, destroy, user_data);
+    gbinder_local_request_unref(req);
+    return id;
+}
+
+static
+gulong
+binder_nfc_transport_binder_close(
+    BinderNfcTransport* transport,
+    BinderNfcTransportReplyFunc reply,
+    GDestroyNotify destroy,
+    void* user_data)
+{
+    BinderNfcTransportBinder* self = binder_nfc_transport_binder_cast
+        (transport);
+
+    return binder_nfc_transport_binder_transact(self, BINDER_NFC_REQ_CLOSE,
+        self->req_close, reply, destroy, user_data);
+}
+
+static
+gulong
+binder_nfc_transport_binder_core_initialized(
+    BinderNfcTransport* transport,
+    BinderNfcTransportReplyFunc reply,
+    GDestroyNotify destroy,
+    void* user_data)
+{
+    BinderNfcTransportBinder* self = binder_nfc_transport_binder_cast
+        (transport);
+
+    return binder_nfc_transport_binder_transact(self,
+        BINDER_NFC_REQ_CORE_INITIALIZED, self->req_core_initialized,
+        reply, destroy, user_data);
+}
+
+static
+gulong
+binder_nfc_transport_binder_prediscover(
+    BinderNfcTransport* transport,
+    BinderNfcTransportReplyFunc reply,
+    GDestroyNotify destroy,
+    void* user_data)
+{
+    BinderNfcTransportBinder* self = binder_nfc_transport_binder_cast
+        (transport);
+
+    return binder_nfc_transport_binder_transact(self,
+        BINDER_NFC_REQ_PREDISCOVER, self->req_prediscover,
+        reply, destroy, user_data);
+}
+
+static
+gulong
+binder_nfc_transport_binder_power_cycle(
+    BinderNfcTransport* transport,
+    BinderNfcTransportReplyFunc reply,
+    GDestroyNotify destroy,
+    void* user_data)
+{
+    return binder_nfc_transport_binder_transact
+        (binder_nfc_transport_binder_cast(transport),
+            BINDER_NFC_REQ_POWER_CYCLE, NULL, reply, destroy, user_data);
+}
+
+static
+gulong
+binder_nfc_transport_binder_control_granted(
+    BinderNfcTransport* transport,
+    BinderNfcTransportReplyFunc reply,
+    GDestroyNotify destroy,
+    void* user_data)
+{
+    return binder_nfc_transport_binder_transact
+        (binder_nfc_transport_binder_cast(transport),
+            BINDER_NFC_REQ_CONTROL_GRANTED, NULL, reply, destroy, user_data);
+}
+
+static
+void
+binder_nfc_transport_binder_cancel(
+    BinderNfcTransport* transport,
+    gulong id)
+{
+    gbinder_client_cancel(binder_nfc_transport_binder_cast(transport)->
+        binder, id);
+}
+
+static
+void
+binder_nfc_transport_binder_release(
+    BinderNfcTransport* transport)
+{
+    /* Session objects live as long as the HAL connection */
+}
+
+static
+gboolean
+binder_nfc_transport_binder_shutdown(
+    BinderNfcTransport* transport)
+{
+    BinderNfcTransportBinder* self = binder_nfc_transport_binder_cast
+        (transport);
+
+    if (self->version) {
+        int status = GBINDER_STATUS_FAILED;
+        GBinderRemoteReply* reply = gbinder_client_transact_sync_reply
+            (self->binder, BINDER_NFC_REQ_CLOSE_FOR_POWER_OFF, NULL,
+                &status);
+        gint32 result = BINDER_NFC_TRANSPORT_FAILED;
+
+        if (reply) {
+            gbinder_remote_reply_read_int32(reply, &result);
+            gbinder_remote_reply_unref(reply);
+        }
+        GDEBUG("closeForPowerOffCase status %d", result);
+        return (status == GBINDER_STATUS_OK && result == 0);
+    }
+    return FALSE;
+}
+
+static
+void
+binder_nfc_transport_binder_free(
+    BinderNfcTransport* transport)
+{
+    BinderNfcTransportBinder* self = binder_nfc_transport_binder_cast
+        (transport);
+
+    gbinder_local_request_unref(self->req_open);
+    gbinder_local_request_unref(self->req_close);
+    gbinder_local_request_unref(self->req_core_initialized);
+    gbinder_local_request_unref(self->req_prediscover);
+    gbinder_client_unref(self->binder);
+    gbinder_local_object_drop(self->callback);
+    gbinder_remote_object_remove_handler(self->remote, self->death_id);
+    gbinder_remote_object_unref(self->remote);
+    g_free(self->instance);
+    g_free(self->fqname);
+    g_free(self);
+}
+
+static
+void
+binder_nfc_transport_binder_death(
+    GBinderRemoteObject* remote,
+    void* user_data)
+{
+    BinderNfcTransportBinder* self = user_data;
+    BinderNfcTransportClient* client = self->client;
+
+    if (client) {
+        client->fn->death(client);
+    }
+}
+
+static
+void
+binder_nfc_transport_binder_session_init(
+    BinderNfcTransportBinder* self)
+{
+    GBinderIpc* ipc = gbinder_remote_object_ipc(self->remote);
+    GBinderClient* binder = self->binder;
+    static const char* ifaces_1_0[] = { BINDER_NFC_CALLBACK, NULL };
+    static const char* ifaces_1_1[] = {
+        BINDER_NFC_CALLBACK_1_1, BINDER_NFC_CALLBACK, NULL
+    };
+
+    /*
+     * These are created once per HAL connection and reused by every
+     * power cycle. The requests don't change after they have been
+     * built, so the same request can be submitted again and again.
+     */
+    self->callback = gbinder_local_object_new(ipc, self->version ?
+        ifaces_1_1 : ifaces_1_0, binder_nfc_transport_binder_callback_handler,
+        self);
+    self->req_open = gbinder_client_new_request2(binder, self->version ?
+        BINDER_NFC_REQ_OPEN_1_1 : BINDER_NFC_REQ_OPEN);
+    gbinder_local_request_append_local_object(self->req_open, self->callback);
+    self->req_close = gbinder_client_new_request2(binder,
+        BINDER_NFC_REQ_CLOSE);
+    self->req_core_initialized = gbinder_client_new_request2(binder,
+        BINDER_NFC_REQ_CORE_INITIALIZED);
+    self->req_prediscover = gbinder_client_new_request2(binder,
+        BINDER_NFC_REQ_PREDISCOVER);
+}
+
+static
+BinderNfcTransport*
+binder_nfc_transport_binder_create(
+    GBinderRemoteObject* remote,
+    guint iface,
+    const char* instance,
+    char* fqname)
+{
+    static const BinderNfcTransportFunctions binder_fn = {
+        .set_client = binder_nfc_transport_binder_set_client,
+        .open = binder_nfc_transport_binder_open,
+        .write = binder_nfc_transport_binder_write,
+        .close = binder_nfc_transport_binder_close,
+        .core_initialized = binder_nfc_transport_binder_core_initialized,
+        .prediscover = binder_nfc_transport_binder_prediscover,
+        .power_cycle = binder_nfc_transport_binder_power_cycle,
+        .control_granted = binder_nfc_transport_binder_control_granted,
+        .cancel = binder_nfc_transport_binder_cancel,
+        .release = binder_nfc_transport_binder_release,
+        .free = binder_nfc_transport_binder_free,
+        .shutdown = binder_nfc_transport_binder_shutdown
+    };
+
+    BinderNfcTransportBinder* self = g_new0(BinderNfcTransportBinder, 1);
+    BinderNfcTransport* transport = &self->transport;
+
+    /* The remote object reference passed in is not ours */
+    self->remote = gbinder_remote_object_ref(remote);
+    self->version = BINDER_NFC_MAX_VERSION - iface;
+    self->binder = gbinder_client_new2(self->remote, binder_nfc_ifaces + iface,
+        self->version + 1);
+    self->death_id = gbinder_remote_object_add_death_handler(remote,
+        binder_nfc_transport_binder_death, self);
+    binder_nfc_transport_binder_session_init(self);
+    self->instance = g_strdup(instance);
+    self->fqname = fqname;
+    transport->fn = &binder_fn;
+    transport->name = self->instance;
+    transport->description = self->fqname;
+    GDEBUG("Connected to %s", fqname);
+    return transport;
+}
+
+/*==========================================================================*
+ * Connect
+ *==========================================================================*/
+
+struct binder_nfc_transport_connect {
+    GBinderServiceManager* sm;
+    char* instance;
+    char* fqname;
+    guint iface;
+    gulong call_id;
+    BinderNfcTransportConnectFunc done;
+    void* user_data;
+};
+
+static
+void
+binder_nfc_transport_connect_free(
+    BinderNfcTransportConnect* connect)
+{
+    gbinder_servicemanager_unref(connect->sm);
+    g_free(connect->instance);
+    g_free(connect->fqname);
+    g_slice_free1(sizeof(*connect), connect);
+}
+
+static
+void
+binder_nfc_transport_connect_reply(
+    GBinderServiceManager* sm,
+    GBinderRemoteObject* remote,
+    int status,
+    void* user_data);
+
+static
+gboolean
+binder_nfc_transport_connect_lookup(
+    BinderNfcTransportConnect* connect)
+{
+    g_free(connect->fqname);
+    connect->fqname = g_strconcat(binder_nfc_ifaces[connect->iface].
+        interface, "/", connect->instance, NULL);
+    connect->call_id = gbinder_servicemanager_get_service(connect->sm,
+        connect->fqname, binder_nfc_transport_connect_reply, connect);
+    return (connect->call_id != 0);
+}
+
+static
+void
+binder_nfc_transport_connect_reply(
+    GBinderServiceManager* sm,
+    GBinderRemoteObject* remote,
+    int status,
+    void* user_data)
+{
+    BinderNfcTransportConnect* connect = user_data;
+
+    connect->call_id = 0;
+    if (remote) {
+        BinderNfcTransport* transport = binder_nfc_transport_binder_create
+            (remote, connect->iface, connect->instance, connect->fqname);
+
+        /* The transport took the ownership of fqname */
+        connect->fqname = NULL;
+        connect->done(transport, connect->user_data);
+        binder_nfc_transport_connect_free(connect);
+    } else if (++connect->iface >= G_N_ELEMENTS(binder_nfc_ifaces) ||
+        !binder_nfc_transport_connect_lookup(connect)) {
+        GERR("Failed to connect to %s", connect->fqname);
+        connect->done(NULL, connect->user_data);
+        binder_nfc_transport_connect_free(connect);
+    }
+}
+
+/*==========================================================================*
+ * Interface
+ *==========================================================================*/
+
+BinderNfcTransportConnect*
+binder_nfc_transport_binder_connect(
+    GBinderServiceManager* sm,
+    const char* instance,
+    BinderNfcTransportConnectFunc done,
+    void* user_data)
+{
+    if (G_LIKELY(sm) && G_LIKELY(instance) && G_LIKELY(done)) {
+        BinderNfcTransportConnect* connect =
+            g_slice_new0(BinderNfcTransportConnect);
+
+        connect->sm = gbinder_servicemanager_ref(sm);
+        connect->instance = g_strdup(instance);
+        connect->done = done;
+        connect->user_data = user_data;
+
+        /* Highest interface version first */
+        if (binder_nfc_transport_connect_lookup(connect)) {
+            return connect;
+        }
+        GERR("Failed to look up %s", connect->fqname);
+        binder_nfc_transport_connect_free(connect);
+    }
+    return NULL;
+}
+
+void
+binder_nfc_transport_binder_connect_cancel(
+    BinderNfcTransportConnect* connect)
+{
+    if (connect) {
+        gbinder_servicemanager_cancel(connect->sm, connect->call_id);
+        binder_nfc_transport_connect_free(connect);
+    }
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
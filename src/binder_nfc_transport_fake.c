@@ -0,0 +1,1250 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ * Copyright (C) 2021 Slava Monich <slava.monich@jolla.com>
+ *
+ * You may use this file under the terms of BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "binder_nfc_record.h"
+
+#include <gutil_macros.h>
+
+/*
+ * In-process stand-in for android.hardware.nfc::INfc. Replies, events
+ * and NCI responses are delivered from the main loop after configurable
+ * delays, in the order in which they are due.
+ *
+ * NCI responses are scripted. Script file consists of lines like this:
+ *
+ *   # Command prefix : response [; notification ...]
+ *   20 00 : 40 00 03 00 10 01
+ *   21 03 : 41 03 01 00 ; 61 05 ...
+ *
+ * The first rule matching the beginning of the written packet wins.
+ * Commands not matching any rule get a generic STATUS_OK response,
+ * data packets get CORE_CONN_CREDITS_NTF.
+ *
+ * In replay mode, everything is taken from the recorded session. Each
+ * call is matched with the next recorded call of the same kind, and the
+ * replies, events and data which followed it in the recording are sent
+ * with the recorded delays (scaled by the replay speed).
+ */
+
+typedef enum binder_nfc_fake_op_type {
+    FAKE_OP_REPLY,
+    FAKE_OP_EVENT,
+    FAKE_OP_DATA,
+    FAKE_OP_DEATH
+} FAKE_OP_TYPE;
+
+typedef struct binder_nfc_fake_op {
+    FAKE_OP_TYPE type;
+    gint64 due;
+    gulong id;
+    BinderNfcTransportReplyFunc reply;
+    GDestroyNotify destroy;
+    void* user_data;
+    int result;
+    guint event;
+    guint status;
+    GBytes* data;
+} BinderNfcFakeOp;
+
+typedef struct binder_nfc_fake_rule {
+    GBytes* prefix;
+    GSList* frames;
+} BinderNfcFakeRule;
+
+typedef struct binder_nfc_fake_replay_call {
+    gulong id;
+    BinderNfcTransportReplyFunc reply;
+    GDestroyNotify destroy;
+    void* user_data;
+} BinderNfcFakeReplayCall;
+
+typedef struct binder_nfc_fake_replay {
+    GPtrArray* entries;
+    guint cursor;
+    gdouble speed;
+    GHashTable* calls;
+    guint matched;
+    guint mismatched;
+    BinderNfcReplayDoneFunc done;
+    void* done_data;
+} BinderNfcFakeReplay;
+
+typedef struct binder_nfc_transport_fake {
+    BinderNfcTransport transport;
+    BinderNfcTransportClient* client;
+    BinderNfcFakeHalParams params;
+    BinderNfcFakeReplay* replay;
+    GSList* rules;
+    GQueue ops;
+    gulong last_id;
+    guint timer_id;
+    guint death_id;
+    gboolean dispatching;
+    gboolean dead;
+    char* instance;
+    char* description;
+} BinderNfcTransportFake;
+
+#define NCI_MT_MASK         (0xe0)
+#define NCI_MT_DATA         (0x00)
+#define NCI_MT_CMD          (0x20)
+#define NCI_MT_RSP          (0x40)
+#define NCI_GID_MASK        (0x0f)
+#define NCI_OID_MASK        (0x3f)
+#define NCI_CONN_ID_MASK    (0x0f)
+
+/* NCI 1.0 CORE_RESET and CORE_INIT responses */
+static const guint8 fake_core_reset_cmd[] = { 0x20, 0x00 };
+static const guint8 fake_core_reset_rsp[] = {
+    0x40, 0x00, 0x03, 0x00, 0x10, 0x01
+};
+static const guint8 fake_core_init_cmd[] = { 0x20, 0x01 };
+static const guint8 fake_core_init_rsp[] = {
+    0x40, 0x01, 0x14,
+    0x00,                       /* Status */
+    0x03, 0x1e, 0x03, 0x00,     /* NFCC Features */
+    0x03, 0x01, 0x02, 0x03,     /* Supported RF Interfaces */
+    0x01,                       /* Max Logical Connections */
+    0x00, 0x02,                 /* Max Routing Table Size */
+    0xff,                       /* Max Control Packet Payload Size */
+    0x00, 0x01,                 /* Max Size for Large Parameters */
+    0x00,                       /* Manufacturer ID */
+    0x00, 0x00, 0x00, 0x00      /* Manufacturer Specific Information */
+};
+
+static inline
+BinderNfcTransportFake*
+binder_nfc_transport_fake_cast(
+    BinderNfcTransport* transport)
+{
+    return G_CAST(transport, BinderNfcTransportFake, transport);
+}
+
+/*==========================================================================*
+ * Script
+ *==========================================================================*/
+
+static
+GBytes*
+binder_nfc_fake_parse_hex(
+    const char* str)
+{
+    GByteArray* bytes = g_byte_array_new();
+    int hi = -1;
+
+    for (; *str; str++) {
+        const int val = g_ascii_xdigit_value(*str);
+
+        if (val >= 0) {
+            if (hi < 0) {
+                hi = val;
+            } else {
+                const guint8 b = (guint8)((hi << 4) | val);
+
+                g_byte_array_append(bytes, &b, 1);
+                hi = -1;
+            }
+        } else if (!g_ascii_isspace(*str)) {
+            break;
+        }
+    }
+
+    if (*str || hi >= 0 || !bytes->len) {
+        g_byte_array_free(bytes, TRUE);
+        return NULL;
+    }
+    return g_byte_array_free_to_bytes(bytes);
+}
+
+static
+void
+binder_nfc_fake_rule_free(
+    gpointer data)
+{
+    BinderNfcFakeRule* rule = data;
+
+    g_bytes_unref(rule->prefix);
+    g_slist_free_full(rule->frames, (GDestroyNotify) g_bytes_unref);
+    g_free(rule);
+}
+
+static
+BinderNfcFakeRule*
+binder_nfc_fake_rule_new(
+    const void* prefix,
+    gsize prefix_len,
+    const void* frame,
+    gsize frame_len)
+{
+    BinderNfcFakeRule* rule = g_new0(BinderNfcFakeRule, 1);
+
+    rule->prefix = g_bytes_new(prefix, prefix_len);
+    rule->frames = g_slist_append(NULL, g_bytes_new(frame, frame_len));
+    return rule;
+}
+
+static
+BinderNfcFakeRule*
+binder_nfc_fake_rule_parse(
+    const char* line)
+{
+    BinderNfcFakeRule* rule = NULL;
+    char** parts = g_strsplit(line, ":", 2);
+
+    if (g_strv_length(parts) == 2) {
+        GBytes* prefix = binder_nfc_fake_parse_hex(parts[0]);
+
+        if (prefix) {
+            char** frames = g_strsplit(parts[1], ";", -1);
+            char** ptr;
+
+            rule = g_new0(BinderNfcFakeRule, 1);
+            rule->prefix = prefix;
+            for (ptr = frames; *ptr && rule; ptr++) {
+                GBytes* frame = binder_nfc_fake_parse_hex(*ptr);
+
+                if (frame) {
+                    rule->frames = g_slist_append(rule->frames, frame);
+                } else {
+                    binder_nfc_fake_rule_free(rule);
+                    rule = NULL;
+                }
+            }
+            g_strfreev(frames);
+        }
+    }
+    g_strfreev(parts);
+    return rule;
+}
+
+static
+GSList*
+binder_nfc_fake_script_load(
+    const char* file)
+{
+    GSList* rules = NULL;
+    GError* error = NULL;
+    char* contents = NULL;
+
+    if (g_file_get_contents(file, &contents, NULL, &error)) {
+        char** lines = g_strsplit(contents, "\n", -1);
+        char** ptr;
+        guint n = 0;
+
+        for (ptr = lines; *ptr; ptr++) {
+            const char* line = g_strstrip(*ptr);
+
+            n++;
+            if (line[0] && line[0] != '#') {
+                BinderNfcFakeRule* rule = binder_nfc_fake_rule_parse(line);
+
+                if (rule) {
+                    rules = g_slist_append(rules, rule);
+                } else {
+                    GWARN("%s:%u: syntax error", file, n);
+                }
+            }
+        }
+        g_strfreev(lines);
+        g_free(contents);
+        GDEBUG("Loaded %u rule(s) from %s", g_slist_length(rules), file);
+    } else {
+        GWARN("%s", error->message);
+        g_error_free(error);
+    }
+    return rules;
+}
+
+static
+const BinderNfcFakeRule*
+binder_nfc_fake_script_match(
+    BinderNfcTransportFake* self,
+    const guint8* data,
+    guint len)
+{
+    GSList* l;
+
+    for (l = self->rules; l; l = l->next) {
+        const BinderNfcFakeRule* rule = l->data;
+        gsize size;
+        const void* prefix = g_bytes_get_data(rule->prefix, &size);
+
+        if (len >= size && !memcmp(data, prefix, size)) {
+            return rule;
+        }
+    }
+    return NULL;
+}
+
+/*==========================================================================*
+ * Scheduler
+ *==========================================================================*/
+
+static
+void
+binder_nfc_fake_op_free(
+    BinderNfcFakeOp* op)
+{
+    if (op->destroy) {
+        op->destroy(op->user_data);
+    }
+    if (op->data) {
+        g_bytes_unref(op->data);
+    }
+    g_slice_free1(sizeof(*op), op);
+}
+
+static
+gboolean
+binder_nfc_fake_dispatch(
+    gpointer user_data);
+
+static
+void
+binder_nfc_fake_replay_done_check(
+    BinderNfcTransportFake* self)
+{
+    BinderNfcFakeReplay* replay = self->replay;
+
+    if (replay && replay->done && replay->cursor == replay->entries->len &&
+        g_queue_is_empty(&self->ops)) {
+        BinderNfcReplayDoneFunc done = replay->done;
+
+        replay->done = NULL;
+        done(&self->transport, replay->done_data);
+    }
+}
+
+static
+void
+binder_nfc_fake_reschedule(
+    BinderNfcTransportFake* self)
+{
+    const BinderNfcFakeOp* head = g_queue_peek_head(&self->ops);
+
+    if (self->timer_id) {
+        g_source_remove(self->timer_id);
+        self->timer_id = 0;
+    }
+    if (head) {
+        const gint64 delay = head->due - g_get_monotonic_time();
+
+        if (delay > 0) {
+            self->timer_id = g_timeout_add((guint)((delay + 999) / 1000),
+                binder_nfc_fake_dispatch, self);
+        } else {
+            self->timer_id = g_idle_add(binder_nfc_fake_dispatch, self);
+        }
+    }
+}
+
+static
+gboolean
+binder_nfc_fake_die(
+    BinderNfcTransportFake* self)
+{
+    if (!self->dead) {
+        BinderNfcFakeOp* op;
+
+        /* Pending calls never complete */
+        self->dead = TRUE;
+        while ((op = g_queue_pop_head(&self->ops)) != NULL) {
+            binder_nfc_fake_op_free(op);
+        }
+        if (self->replay) {
+            g_hash_table_remove_all(self->replay->calls);
+        }
+        return TRUE;
+    }
+    return FALSE;
+}
+
+static
+gboolean
+binder_nfc_fake_death(
+    gpointer user_data)
+{
+    BinderNfcTransportFake* self = user_data;
+    BinderNfcTransportClient* client = self->client;
+
+    /* The death handler may deallocate the transport, don't touch it */
+    self->death_id = 0;
+    if (client) {
+        client->fn->death(client);
+    }
+    return G_SOURCE_REMOVE;
+}
+
+static
+gboolean
+binder_nfc_fake_dispatch(
+    gpointer user_data)
+{
+    BinderNfcTransportFake* self = user_data;
+    BinderNfcTransport* transport = &self->transport;
+    const gint64 now = g_get_monotonic_time();
+    BinderNfcFakeOp* op;
+
+    self->timer_id = 0;
+    self->dispatching = TRUE;
+    while ((op = g_queue_peek_head(&self->ops)) != NULL && op->due <= now) {
+        BinderNfcTransportClient* client = self->client;
+
+        g_queue_pop_head(&self->ops);
+        switch (op->type) {
+        case FAKE_OP_REPLY:
+            if (op->reply) {
+                op->reply(transport, op->result, op->user_data);
+            }
+            break;
+        case FAKE_OP_EVENT:
+            if (client) {
+                client->fn->event(client, op->event, op->status);
+            }
+            break;
+        case FAKE_OP_DATA:
+            if (client) {
+                gsize len;
+                const void* data = g_bytes_get_data(op->data, &len);
+
+                client->fn->data(client, data, len);
+            }
+            break;
+        case FAKE_OP_DEATH:
+            /* Deliver it after we are done with the queue */
+            if (binder_nfc_fake_die(self)) {
+                self->death_id = g_idle_add(binder_nfc_fake_death, self);
+            }
+            break;
+        }
+        binder_nfc_fake_op_free(op);
+    }
+    self->dispatching = FALSE;
+    binder_nfc_fake_reschedule(self);
+    binder_nfc_fake_replay_done_check(self);
+    return G_SOURCE_REMOVE;
+}
+
+static
+void
+binder_nfc_fake_schedule(
+    BinderNfcTransportFake* self,
+    BinderNfcFakeOp* op,
+    guint delay_ms)
+{
+    GList* l;
+
+    /* Keep the queue sorted, ops due at the same time stay in order */
+    op->due = g_get_monotonic_time() + ((gint64)delay_ms) * 1000;
+    for (l = self->ops.tail; l; l = l->prev) {
+        const BinderNfcFakeOp* prev = l->data;
+
+        if (prev->due <= op->due) {
+            break;
+        }
+    }
+    if (l) {
+        g_queue_insert_after(&self->ops, l, op);
+    } else {
+        g_queue_push_head(&self->ops, op);
+    }
+    if (!self->dispatching && g_queue_peek_head(&self->ops) == op) {
+        binder_nfc_fake_reschedule(self);
+    }
+}
+
+static
+gulong
+binder_nfc_fake_new_id(
+    BinderNfcTransportFake* self)
+{
+    if (!++self->last_id) {
+        ++self->last_id;
+    }
+    return self->last_id;
+}
+
+static
+gulong
+binder_nfc_fake_schedule_reply(
+    BinderNfcTransportFake* self,
+    gulong id,
+    int result,
+    guint delay_ms,
+    BinderNfcTransportReplyFunc reply,
+    GDestroyNotify destroy,
+    void* user_data)
+{
+    BinderNfcFakeOp* op = g_slice_new0(BinderNfcFakeOp);
+
+    op->type = FAKE_OP_REPLY;
+    op->reply = reply;
+    op->destroy = destroy;
+    op->user_data = user_data;
+    op->result = result;
+    op->id = id;
+    binder_nfc_fake_schedule(self, op, delay_ms);
+    return op->id;
+}
+
+static
+void
+binder_nfc_fake_schedule_event(
+    BinderNfcTransportFake* self,
+    guint event,
+    guint status,
+    guint delay_ms)
+{
+    BinderNfcFakeOp* op = g_slice_new0(BinderNfcFakeOp);
+
+    op->type = FAKE_OP_EVENT;
+    op->event = event;
+    op->status = status;
+    binder_nfc_fake_schedule(self, op, delay_ms);
+}
+
+static
+void
+binder_nfc_fake_schedule_death(
+    BinderNfcTransportFake* self,
+    guint delay_ms)
+{
+    BinderNfcFakeOp* op = g_slice_new0(BinderNfcFakeOp);
+
+    op->type = FAKE_OP_DEATH;
+    binder_nfc_fake_schedule(self, op, delay_ms);
+}
+
+static
+void
+binder_nfc_fake_schedule_data(
+    BinderNfcTransportFake* self,
+    GBytes* data,
+    guint delay_ms)
+{
+    BinderNfcFakeOp* op = g_slice_new0(BinderNfcFakeOp);
+
+    op->type = FAKE_OP_DATA;
+    op->data = g_bytes_ref(data);
+    binder_nfc_fake_schedule(self, op, delay_ms);
+}
+
+/*
+ * Schedules the reply and the completion event in the requested order.
+ * The event is only sent if the call succeeds.
+ */
+static
+gulong
+binder_nfc_fake_schedule_call(
+    BinderNfcTransportFake* self,
+    int result,
+    guint event,
+    BINDER_NFC_FAKE_CPLT order,
+    BinderNfcTransportReplyFunc reply,
+    GDestroyNotify destroy,
+    void* user_data)
+{
+    const BinderNfcFakeHalParams* params = &self->params;
+    guint reply_delay = params->reply_delay_ms;
+    guint event_delay = params->event_delay_ms;
+    gulong id;
+
+    if (self->dead) {
+        if (destroy) {
+            destroy(user_data);
+        }
+        return 0;
+    }
+
+    if (result || order == BINDER_NFC_FAKE_CPLT_NONE) {
+        return binder_nfc_fake_schedule_reply(self,
+            binder_nfc_fake_new_id(self), result, reply_delay,
+            reply, destroy, user_data);
+    }
+
+    if (order == BINDER_NFC_FAKE_CPLT_BEFORE_REPLY) {
+        reply_delay = MAX(reply_delay, event_delay);
+        binder_nfc_fake_schedule_event(self, event, HAL_NFC_STATUS_OK,
+            event_delay);
+        id = binder_nfc_fake_schedule_reply(self,
+            binder_nfc_fake_new_id(self), result, reply_delay,
+            reply, destroy, user_data);
+    } else {
+        event_delay = MAX(reply_delay, event_delay);
+        id = binder_nfc_fake_schedule_reply(self,
+            binder_nfc_fake_new_id(self), result, reply_delay,
+            reply, destroy, user_data);
+        binder_nfc_fake_schedule_event(self, event, HAL_NFC_STATUS_OK,
+            event_delay);
+    }
+    return id;
+}
+
+/*==========================================================================*
+ * Replay
+ *==========================================================================*/
+
+static
+void
+binder_nfc_fake_replay_call_free(
+    gpointer data)
+{
+    BinderNfcFakeReplayCall* call = data;
+
+    if (call->destroy) {
+        call->destroy(call->user_data);
+    }
+    g_slice_free1(sizeof(*call), call);
+}
+
+static
+guint
+binder_nfc_fake_replay_delay(
+    BinderNfcFakeReplay* replay,
+    gint64 usec)
+{
+    return (replay->speed > 0 && usec > 0) ?
+        (guint)(usec / replay->speed / 1000) : 0;
+}
+
+static
+void
+binder_nfc_fake_replay_schedule(
+    BinderNfcTransportFake* self,
+    const BinderNfcRecordEntry* call)
+{
+    BinderNfcFakeReplay* replay = self->replay;
+    GPtrArray* entries = replay->entries;
+
+    /* Schedule everything up to the next recorded call */
+    while (replay->cursor < entries->len) {
+        const BinderNfcRecordEntry* e = entries->pdata[replay->cursor];
+        const guint delay = binder_nfc_fake_replay_delay(replay,
+            e->time - call->time);
+        BinderNfcFakeReplayCall* pending;
+
+        if (e->type == BINDER_NFC_RECORD_CALL) {
+            break;
+        }
+        replay->cursor++;
+        switch (e->type) {
+        case BINDER_NFC_RECORD_REPLY:
+            pending = g_hash_table_lookup(replay->calls,
+                GSIZE_TO_POINTER(e->id));
+            if (pending) {
+                g_hash_table_steal(replay->calls, GSIZE_TO_POINTER(e->id));
+                binder_nfc_fake_schedule_reply(self, pending->id, e->result,
+                    delay, pending->reply, pending->destroy,
+                    pending->user_data);
+                g_slice_free1(sizeof(*pending), pending);
+            }
+            break;
+        case BINDER_NFC_RECORD_EVENT:
+            binder_nfc_fake_schedule_event(self, e->event, e->status, delay);
+            break;
+        case BINDER_NFC_RECORD_DATA:
+            binder_nfc_fake_schedule_data(self, e->data, delay);
+            break;
+        case BINDER_NFC_RECORD_DEATH:
+            binder_nfc_fake_schedule_death(self, delay);
+            break;
+        case BINDER_NFC_RECORD_CALL:
+            break;
+        }
+    }
+    if (replay->cursor == entries->len) {
+        GINFO("Replay finished, %u call(s) matched, %u mismatch(es)",
+            replay->matched, replay->mismatched);
+        /* Otherwise it's checked when the queue gets drained */
+        binder_nfc_fake_replay_done_check(self);
+    }
+}
+
+static
+gulong
+binder_nfc_fake_replay_call(
+    BinderNfcTransportFake* self,
+    BINDER_NFC_CALL code,
+    const void* data,
+    guint len,
+    BinderNfcTransportReplyFunc reply,
+    GDestroyNotify destroy,
+    void* user_data)
+{
+    BinderNfcFakeReplay* replay = self->replay;
+    GPtrArray* entries = replay->entries;
+    const BinderNfcRecordEntry* call = NULL;
+    guint i;
+
+    if (self->dead) {
+        if (destroy) {
+            destroy(user_data);
+        }
+        return 0;
+    }
+
+    /* Find the next recorded call of the same kind */
+    for (i = replay->cursor; i < entries->len && !call; i++) {
+        const BinderNfcRecordEntry* e = entries->pdata[i];
+
+        if (e->type == BINDER_NFC_RECORD_CALL) {
+            if (e->call == code) {
+                call = e;
+            } else if (i == replay->cursor) {
+                GDEBUG("Replay expected %s, got %s",
+                    binder_nfc_call_name(e->call),
+                    binder_nfc_call_name(code));
+                replay->mismatched++;
+            }
+        }
+    }
+
+    if (call) {
+        gsize size = 0;
+        const void* recorded = call->data ?
+            g_bytes_get_data(call->data, &size) : NULL;
+
+        replay->cursor = i;
+        if (code == BINDER_NFC_CALL_WRITE &&
+            (size != len || memcmp(recorded, data, len))) {
+            GDEBUG("Replay write data mismatch");
+            replay->mismatched++;
+        } else {
+            replay->matched++;
+        }
+
+        if (call->id) {
+            BinderNfcFakeReplayCall* pending =
+                g_slice_new(BinderNfcFakeReplayCall);
+            const gulong id = binder_nfc_fake_new_id(self);
+
+            pending->id = id;
+            pending->reply = reply;
+            pending->destroy = destroy;
+            pending->user_data = user_data;
+            g_hash_table_replace(replay->calls, GSIZE_TO_POINTER(call->id),
+                pending);
+            binder_nfc_fake_replay_schedule(self, call);
+            return id;
+        } else {
+            /* This call has failed in the recorded session */
+            binder_nfc_fake_replay_schedule(self, call);
+        }
+    } else {
+        /* Nothing to replay, pretend that the call has succeeded */
+        GDEBUG("Replay has no %s call", binder_nfc_call_name(code));
+        replay->mismatched++;
+        return binder_nfc_fake_schedule_reply(self,
+            binder_nfc_fake_new_id(self), 0, 0, reply, destroy, user_data);
+    }
+
+    if (destroy) {
+        destroy(user_data);
+    }
+    return 0;
+}
+
+static
+gboolean
+binder_nfc_fake_replay_cancel(
+    BinderNfcTransportFake* self,
+    gulong id)
+{
+    GHashTableIter it;
+    gpointer value;
+
+    g_hash_table_iter_init(&it, self->replay->calls);
+    while (g_hash_table_iter_next(&it, NULL, &value)) {
+        const BinderNfcFakeReplayCall* pending = value;
+
+        if (pending->id == id) {
+            /* binder_nfc_fake_replay_call_free invokes destroy */
+            g_hash_table_iter_remove(&it);
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static
+void
+binder_nfc_fake_replay_free(
+    BinderNfcFakeReplay* replay)
+{
+    g_hash_table_destroy(replay->calls);
+    g_ptr_array_free(replay->entries, TRUE);
+    g_free(replay);
+}
+
+/*==========================================================================*
+ * NCI
+ *==========================================================================*/
+
+static
+void
+binder_nfc_fake_handle_packet(
+    BinderNfcTransportFake* self,
+    const guint8* pkt,
+    guint len)
+{
+    const guint delay = self->params.data_delay_ms;
+    const BinderNfcFakeRule* rule = binder_nfc_fake_script_match(self,
+        pkt, len);
+
+    if (rule) {
+        GSList* l;
+
+        for (l = rule->frames; l; l = l->next) {
+            binder_nfc_fake_schedule_data(self, l->data, delay);
+        }
+    } else if (len >= 3) {
+        GBytes* frame = NULL;
+
+        switch (pkt[0] & NCI_MT_MASK) {
+        case NCI_MT_CMD:
+            {
+                guint8 rsp[4];
+
+                rsp[0] = NCI_MT_RSP | (pkt[0] & NCI_GID_MASK);
+                rsp[1] = pkt[1] & NCI_OID_MASK;
+                rsp[2] = 1;
+                rsp[3] = HAL_NFC_STATUS_OK;
+                frame = g_bytes_new(rsp, sizeof(rsp));
+            }
+            break;
+        case NCI_MT_DATA:
+            {
+                guint8 ntf[6];
+
+                /* CORE_CONN_CREDITS_NTF */
+                ntf[0] = 0x60;
+                ntf[1] = 0x06;
+                ntf[2] = 3;
+                ntf[3] = 1;
+                ntf[4] = pkt[0] & NCI_CONN_ID_MASK;
+                ntf[5] = 1;
+                frame = g_bytes_new(ntf, sizeof(ntf));
+            }
+            break;
+        default:
+            break;
+        }
+        if (frame) {
+            binder_nfc_fake_schedule_data(self, frame, delay);
+            g_bytes_unref(frame);
+        }
+    }
+}
+
+/*==========================================================================*
+ * Transport
+ *==========================================================================*/
+
+static
+void
+binder_nfc_transport_fake_set_client(
+    BinderNfcTransport* transport,
+    BinderNfcTransportClient* client)
+{
+    binder_nfc_transport_fake_cast(transport)->client = client;
+}
+
+static
+gulong
+binder_nfc_transport_fake_open(
+    BinderNfcTransport* transport,
+    BinderNfcTransportReplyFunc reply,
+    GDestroyNotify destroy,
+    void* user_data)
+{
+    BinderNfcTransportFake* self = binder_nfc_transport_fake_cast(transport);
+
+    if (self->replay) {
+        return binder_nfc_fake_replay_call(self, BINDER_NFC_CALL_OPEN,
+            NULL, 0, reply, destroy, user_data);
+    }
+    return binder_nfc_fake_schedule_call(self, self->params.open_result,
+        HAL_NFC_EVT_OPEN_CPLT, self->params.open_cplt, reply, destroy,
+        user_data);
+}
+
+static
+gulong
+binder_nfc_transport_fake_write(
+    BinderNfcTransport* transport,
+    const void* data,
+    guint len,
+    BinderNfcTransportReplyFunc reply,
+    GDestroyNotify destroy,
+    void* user_data)
+{
+    BinderNfcTransportFake* self = binder_nfc_transport_fake_cast(transport);
+    const int result = self->params.write_result;
+    gulong id;
+
+    if (self->replay) {
+        return binder_nfc_fake_replay_call(self, BINDER_NFC_CALL_WRITE,
+            data, len, reply, destroy, user_data);
+    }
+    id = binder_nfc_fake_schedule_call(self, result, 0,
+        BINDER_NFC_FAKE_CPLT_NONE, reply, destroy, user_data);
+    if (id && !result) {
+        binder_nfc_fake_handle_packet(self, data, len);
+    }
+    return id;
+}
+
+static
+gulong
+binder_nfc_transport_fake_close(
+    BinderNfcTransport* transport,
+    BinderNfcTransportReplyFunc reply,
+    GDestroyNotify destroy,
+    void* user_data)
+{
+    BinderNfcTransportFake* self = binder_nfc_transport_fake_cast(transport);
+
+    if (self->replay) {
+        return binder_nfc_fake_replay_call(self, BINDER_NFC_CALL_CLOSE,
+            NULL, 0, reply, destroy, user_data);
+    }
+    return binder_nfc_fake_schedule_call(self, self->params.close_result,
+        HAL_NFC_EVT_CLOSE_CPLT, self->params.close_cplt, reply, destroy,
+        user_data);
+}
+
+static
+gulong
+binder_nfc_transport_fake_core_initialized(
+    BinderNfcTransport* transport,
+    BinderNfcTransportReplyFunc reply,
+    GDestroyNotify destroy,
+    void* user_data)
+{
+    BinderNfcTransportFake* self = binder_nfc_transport_fake_cast(transport);
+
+    if (self->replay) {
+        return binder_nfc_fake_replay_call(self,
+            BINDER_NFC_CALL_CORE_INITIALIZED, NULL, 0, reply, destroy,
+            user_data);
+    }
+    return binder_nfc_fake_schedule_call(self, 0, HAL_NFC_EVT_POST_INIT_CPLT,
+        BINDER_NFC_FAKE_CPLT_AFTER_REPLY, reply, destroy, user_data);
+}
+
+static
+gulong
+binder_nfc_transport_fake_prediscover(
+    BinderNfcTransport* transport,
+    BinderNfcTransportReplyFunc reply,
+    GDestroyNotify destroy,
+    void* user_data)
+{
+    BinderNfcTransportFake* self = binder_nfc_transport_fake_cast(transport);
+
+    if (self->replay) {
+        return binder_nfc_fake_replay_call(self, BINDER_NFC_CALL_PREDISCOVER,
+            NULL, 0, reply, destroy, user_data);
+    }
+    return binder_nfc_fake_schedule_call(self, 0, HAL_NFC_EVT_PRE_DISCOVER_CPLT,
+        BINDER_NFC_FAKE_CPLT_AFTER_REPLY, reply, destroy, user_data);
+}
+
+static
+gulong
+binder_nfc_transport_fake_power_cycle(
+    BinderNfcTransport* transport,
+    BinderNfcTransportReplyFunc reply,
+    GDestroyNotify destroy,
+    void* user_data)
+{
+    BinderNfcTransportFake* self = binder_nfc_transport_fake_cast(transport);
+
+    if (self->replay) {
+        return binder_nfc_fake_replay_call(self, BINDER_NFC_CALL_POWER_CYCLE,
+            NULL, 0, reply, destroy, user_data);
+    }
+    return binder_nfc_fake_schedule_call(self, 0, HAL_NFC_EVT_OPEN_CPLT,
+        BINDER_NFC_FAKE_CPLT_AFTER_REPLY, reply, destroy, user_data);
+}
+
+static
+gulong
+binder_nfc_transport_fake_control_granted(
+    BinderNfcTransport* transport,
+    BinderNfcTransportReplyFunc reply,
+    GDestroyNotify destroy,
+    void* user_data)
+{
+    BinderNfcTransportFake* self = binder_nfc_transport_fake_cast(transport);
+
+    if (self->replay) {
+        return binder_nfc_fake_replay_call(self,
+            BINDER_NFC_CALL_CONTROL_GRANTED, NULL, 0, reply, destroy,
+            user_data);
+    }
+    /* Fake HAL has nothing to do and gives the control right back */
+    return binder_nfc_fake_schedule_call(self, 0, HAL_NFC_EVT_RELEASE_CONTROL,
+        BINDER_NFC_FAKE_CPLT_AFTER_REPLY, reply, destroy, user_data);
+}
+
+static
+void
+binder_nfc_transport_fake_cancel(
+    BinderNfcTransport* transport,
+    gulong id)
+{
+    BinderNfcTransportFake* self = binder_nfc_transport_fake_cast(transport);
+
+    if (id && !(self->replay && binder_nfc_fake_replay_cancel(self, id))) {
+        GList* l;
+
+        for (l = self->ops.head; l; l = l->next) {
+            BinderNfcFakeOp* op = l->data;
+
+            if (op->id == id) {
+                g_queue_delete_link(&self->ops, l);
+                binder_nfc_fake_op_free(op);
+                break;
+            }
+        }
+    }
+}
+
+static
+void
+binder_nfc_transport_fake_release(
+    BinderNfcTransport* transport)
+{
+}
+
+static
+void
+binder_nfc_transport_fake_free(
+    BinderNfcTransport* transport)
+{
+    BinderNfcTransportFake* self = binder_nfc_transport_fake_cast(transport);
+    BinderNfcFakeOp* op;
+
+    if (self->timer_id) {
+        g_source_remove(self->timer_id);
+    }
+    if (self->death_id) {
+        g_source_remove(self->death_id);
+    }
+    while ((op = g_queue_pop_head(&self->ops)) != NULL) {
+        binder_nfc_fake_op_free(op);
+    }
+    if (self->replay) {
+        binder_nfc_fake_replay_free(self->replay);
+    }
+    g_slist_free_full(self->rules, binder_nfc_fake_rule_free);
+    g_free(self->instance);
+    g_free(self->description);
+    g_free(self);
+}
+
+static
+BinderNfcTransportFake*
+binder_nfc_transport_fake_create(
+    const char* instance,
+    const char* description)
+{
+    static const BinderNfcTransportFunctions fake_fn = {
+        .set_client = binder_nfc_transport_fake_set_client,
+        .open = binder_nfc_transport_fake_open,
+        .write = binder_nfc_transport_fake_write,
+        .close = binder_nfc_transport_fake_close,
+        .core_initialized = binder_nfc_transport_fake_core_initialized,
+        .prediscover = binder_nfc_transport_fake_prediscover,
+        .power_cycle = binder_nfc_transport_fake_power_cycle,
+        .control_granted = binder_nfc_transport_fake_control_granted,
+        .cancel = binder_nfc_transport_fake_cancel,
+        .release = binder_nfc_transport_fake_release,
+        .free = binder_nfc_transport_fake_free
+    };
+
+    BinderNfcTransportFake* self = g_new0(BinderNfcTransportFake, 1);
+    BinderNfcTransport* transport = &self->transport;
+
+    g_queue_init(&self->ops);
+    self->instance = g_strdup(instance);
+    self->description = g_strdup(description);
+    transport->fn = &fake_fn;
+    transport->name = self->instance;
+    transport->description = self->description;
+    GDEBUG("Created %s", self->description);
+    return self;
+}
+
+/*==========================================================================*
+ * Interface
+ *==========================================================================*/
+
+BinderNfcTransport*
+binder_nfc_transport_fake_new(
+    const char* instance,
+    const BinderNfcFakeHalParams* params,
+    const char* script)
+{
+    char* desc = g_strconcat("fake " BINDER_NFC "/", instance, NULL);
+    BinderNfcTransportFake* self = binder_nfc_transport_fake_create(instance,
+        desc);
+
+    g_free(desc);
+    if (params) {
+        self->params = *params;
+    }
+    if (script) {
+        self->rules = binder_nfc_fake_script_load(script);
+    }
+
+    /* Built-in rules come after the scripted ones */
+    self->rules = g_slist_append(self->rules, binder_nfc_fake_rule_new
+        (fake_core_reset_cmd, sizeof(fake_core_reset_cmd),
+            fake_core_reset_rsp, sizeof(fake_core_reset_rsp)));
+    self->rules = g_slist_append(self->rules, binder_nfc_fake_rule_new
+        (fake_core_init_cmd, sizeof(fake_core_init_cmd),
+            fake_core_init_rsp, sizeof(fake_core_init_rsp)));
+    return &self->transport;
+}
+
+BinderNfcTransport*
+binder_nfc_transport_replay_new(
+    const char* instance,
+    const char* file,
+    gdouble speed)
+{
+    GPtrArray* entries = binder_nfc_record_load(file);
+
+    if (entries) {
+        char* desc = g_strconcat("replay ", file, NULL);
+        BinderNfcTransportFake* self = binder_nfc_transport_fake_create
+            (instance, desc);
+        BinderNfcFakeReplay* replay = g_new0(BinderNfcFakeReplay, 1);
+
+        GINFO("Replaying %u entries from %s", entries->len, file);
+        replay->entries = entries;
+        replay->speed = speed;
+        replay->calls = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+            NULL, binder_nfc_fake_replay_call_free);
+        self->replay = replay;
+        g_free(desc);
+        return &self->transport;
+    }
+    return NULL;
+}
+
+void
+binder_nfc_transport_replay_set_done_func(
+    BinderNfcTransport* transport,
+    BinderNfcReplayDoneFunc done,
+    void* user_data)
+{
+    if (G_LIKELY(transport)) {
+        BinderNfcTransportFake* self = binder_nfc_transport_fake_cast
+            (transport);
+
+        if (self->replay) {
+            self->replay->done = done;
+            self->replay->done_data = user_data;
+        }
+    }
+}
+
+void
+binder_nfc_transport_fake_set_params(
+    BinderNfcTransport* transport,
+    const BinderNfcFakeHalParams* params)
+{
+    if (G_LIKELY(transport) && G_LIKELY(params)) {
+        binder_nfc_transport_fake_cast(transport)->params = *params;
+    }
+}
+
+void
+binder_nfc_transport_fake_inject_event(
+    BinderNfcTransport* transport,
+    guint event,
+    guint status)
+{
+    if (G_LIKELY(transport)) {
+        BinderNfcTransportFake* self = binder_nfc_transport_fake_cast
+            (transport);
+
+        binder_nfc_fake_schedule_event(self, event, status,
+            self->params.event_delay_ms);
+    }
+}
+
+void
+binder_nfc_transport_fake_inject_data(
+    BinderNfcTransport* transport,
+    const void* data,
+    guint len)
+{
+    if (G_LIKELY(transport)) {
+        BinderNfcTransportFake* self = binder_nfc_transport_fake_cast
+            (transport);
+        GBytes* bytes = g_bytes_new(data, len);
+
+        binder_nfc_fake_schedule_data(self, bytes,
+            self->params.data_delay_ms);
+        g_bytes_unref(bytes);
+    }
+}
+
+void
+binder_nfc_transport_fake_kill(
+    BinderNfcTransport* transport)
+{
+    if (G_LIKELY(transport)) {
+        BinderNfcTransportFake* self = binder_nfc_transport_fake_cast
+            (transport);
+
+        if (binder_nfc_fake_die(self)) {
+            BinderNfcTransportClient* client = self->client;
+
+            if (client) {
+                client->fn->death(client);
+            }
+        }
+    }
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */